@@ -1,12 +1,40 @@
 /* Code based on https://github.com/rogerclarkmelbourne/STM32duino-bootloader/blob/master/hardware.c */
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stm32f1xx.h>
 
 #include "config.h"
+#include "boot.h"
 
-int checkUserCode(void) {
-    uint32_t sp = *(volatile uint32_t *) USER_PROGRAM;
+#if BL_FLASH_GEOMETRY
+uint32_t flashSize;
+uint32_t flashPageSize;
+
+/* Work out how much flash the part has and how big its erase pages are. High and XL density
+   parts (and the connectivity line) use 2K pages. DBGMCU_IDCODE reads as zero on some
+   revisions unless a debugger is attached, so anything above 128K is taken as high density. */
+void detectFlashGeometry(void) {
+    uint32_t devId = DBGMCU->IDCODE & DBGMCU_IDCODE_DEV_ID;
+    uint16_t sizeKb = *(volatile uint16_t *) FLASHSIZE_BASE;
+
+    /* fall back to the C8 layout if the size register is blank */
+    if (sizeKb == 0 || sizeKb == 0xFFFF)
+        sizeKb = 64;
+    /* the second bank of XL density parts has its own registers, stay within the first one */
+    if (sizeKb > 512)
+        sizeKb = 512;
+    flashSize = sizeKb * 1024;
+
+    if (devId == 0x414 || devId == 0x418 || devId == 0x430 || flashSize > 128 * 1024)
+        flashPageSize = 2048;
+    else
+        flashPageSize = 1024;
+}
+#endif
+
+int checkUserCode(uint32_t base) {
+    uint32_t sp = *(volatile uint32_t *) base;
 
     if ((sp & 0x2FFE0000) == 0x20000000) {
         return 0;
@@ -15,6 +43,111 @@ int checkUserCode(void) {
     }
 }
 
+/* CRC-32 (IEEE 802.3) of a flash region, a nibble at a time: this runs over a whole slot
+   on every reset, and the table costs 64 bytes where a byte-wide one would take 1K */
+static const uint32_t crcTable[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+uint32_t flashCRC(const uint8_t *data, uint32_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (size--) {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ crcTable[crc & 15];
+        crc = (crc >> 4) ^ crcTable[crc & 15];
+    }
+
+    return ~crc;
+}
+
+#if BL_AB_SLOTS
+/* Both slots are the same size and start on an erase page, the record takes the last two pages */
+uint32_t slotSize(void) {
+    return ((FLASH_BASE + flashSize - 2 * flashPageSize - USER_PROGRAM) / 2) & ~(flashPageSize - 1);
+}
+
+uint32_t slotBase(uint32_t slot) {
+    return USER_PROGRAM + slot * slotSize();
+}
+
+volatile struct slotEntry *slotRecord(void) {
+    return (volatile struct slotEntry *) (FLASH_BASE + flashSize - 2 * flashPageSize);
+}
+
+/* The header is written in order, its last word completes it */
+static int slotPageStarted(volatile struct slotEntry *page) {
+    return page->magic == SLOT_PAGE_MAGIC && page->size == ~page->slot && page->crc == SLOT_PAGE_MAGIC;
+}
+
+volatile struct slotEntry *slotOtherPage(volatile struct slotEntry *page) {
+    volatile struct slotEntry *first = slotRecord();
+
+    return page == first ? first + flashPageSize / sizeof(*first) : first;
+}
+
+volatile struct slotEntry *slotCurrentPage(void) {
+    volatile struct slotEntry *first = slotRecord();
+    volatile struct slotEntry *second = slotOtherPage(first);
+
+    if (!slotPageStarted(first))
+        return slotPageStarted(second) ? second : NULL;
+    if (!slotPageStarted(second))
+        return first;
+    return (int32_t) (second->slot - first->slot) > 0 ? second : first;
+}
+
+int slotValid(uint32_t slot, uint32_t size, uint32_t crc) {
+    return slot < 2 && size && size <= slotSize() && !checkUserCode(slotBase(slot)) &&
+        flashCRC((const uint8_t *) slotBase(slot), size) == crc;
+}
+
+/* Look for the newest valid entry of a record page */
+static int slotSearchPage(volatile struct slotEntry *page, uint32_t *slot) {
+    int count = 1;
+
+    if (!slotPageStarted(page))
+        return 0;
+
+    while (count < (int) (flashPageSize / sizeof(*page)) && page[count].magic != 0xFFFFFFFF)
+        ++count;
+
+    while (--count > 0) {
+        if (page[count].magic == SLOT_RECORD_MAGIC && slotValid(page[count].slot, page[count].size, page[count].crc)) {
+            *slot = page[count].slot;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+uint32_t selectSlot(void) {
+    volatile struct slotEntry *page = slotCurrentPage();
+    uint32_t slot = 0;
+
+    if (page && !slotSearchPage(page, &slot))
+        slotSearchPage(slotOtherPage(page), &slot);
+
+    return slot;
+}
+
+/* The slot selectSlot picked plus one, 0 until it is looked up. The CRC runs over a whole
+   slot, so it is done once per boot and again only after the flash may have changed */
+static uint32_t selectedSlot;
+
+uint32_t activeSlot(void) {
+    if (!selectedSlot)
+        selectedSlot = selectSlot() + 1;
+    return selectedSlot - 1;
+}
+
+void slotsChanged(void) {
+    selectedSlot = 0;
+}
+#endif
+
 int checkAndClearBootloaderFlag(void) {
     int flag = 0;
 
@@ -56,6 +189,39 @@ void setInsecureFlag(void) {
     RCC->APB1ENR &= ~(RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
 }
 
+/* Flash progress is kept in DR7-DR9 so that it survives a USB drop or a system reset:
+   DR7/DR8 hold the host-supplied image identity, DR9 the next 64-byte page to be written */
+void setFlashCheckpoint(uint32_t image, uint16_t page) {
+    // Enable clocks for the backup domain registers
+    RCC->APB1ENR |= (RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+
+    // Disable backup register write protection
+    PWR->CR |= PWR_CR_DBP;
+    BKP->DR7 = image & 0xFFFF;
+    BKP->DR8 = image >> 16;
+    BKP->DR9 = page;
+    // Re-enable backup register write protection
+    PWR->CR &=~ PWR_CR_DBP;
+
+    // Disable clocks
+    RCC->APB1ENR &= ~(RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+}
+
+uint16_t getFlashCheckpoint(uint32_t *image) {
+    uint16_t page;
+
+    // Enable clocks for the backup domain registers
+    RCC->APB1ENR |= (RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+
+    *image = BKP->DR7 | (BKP->DR8 << 16);
+    page = BKP->DR9;
+
+    // Disable clocks
+    RCC->APB1ENR &= ~(RCC_APB1ENR_PWREN | RCC_APB1ENR_BKPEN);
+
+    return page;
+}
+
 int checkKbMatrix(void) {
     /* output low on the row_pin */
     BL_ROW_BANK->BRR = (1U << BL_ROW_PIN);
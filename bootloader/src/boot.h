@@ -1,8 +1,55 @@
 #pragma once
 
-int checkUserCode(void);
+#include "config.h"
+
+#if BL_FLASH_GEOMETRY
+extern uint32_t flashSize;
+extern uint32_t flashPageSize;
+
+void detectFlashGeometry(void);
+#else
+#define flashSize (64 * 1024)
+#define flashPageSize 1024
+#endif
+int checkUserCode(uint32_t base);
 int checkAndClearBootloaderFlag(void);
 void setInsecureFlag(void);
+void setFlashCheckpoint(uint32_t image, uint16_t page);
+uint16_t getFlashCheckpoint(uint32_t *image);
 int checkKbMatrix(void);
+uint32_t flashCRC(const uint8_t *data, uint32_t size);
+
+#if BL_AB_SLOTS
+/* The slot record is an append-only list of entries over the last two erase pages of flash.
+   Each page starts with a header entry holding its generation; entries go to the page with
+   the newer one, and when it is full the other page is erased and started with the next
+   generation, so the entries of the full page remain as fallbacks. The newest entry whose
+   slot still matches its size and CRC selects the slot to boot, looking through the older
+   page when the newer one has none, so a torn write or a damaged slot falls back to the
+   previous one, and with no valid entry at all slot A is booted. Running firmware may
+   append entries itself: write the inactive slot, then program an entry for it. */
+#define SLOT_RECORD_MAGIC 0x42415653 /* "SVAB" */
+/* A page header is {SLOT_PAGE_MAGIC, generation, ~generation, SLOT_PAGE_MAGIC} */
+#define SLOT_PAGE_MAGIC 0x50415653 /* "SVAP" */
+
+struct slotEntry {
+    uint32_t magic;
+    uint32_t slot;
+    uint32_t size;
+    uint32_t crc;
+};
+
+uint32_t slotSize(void);
+uint32_t slotBase(uint32_t slot);
+volatile struct slotEntry *slotRecord(void);
+/* The record page entries currently go to, NULL before the first one is written */
+volatile struct slotEntry *slotCurrentPage(void);
+volatile struct slotEntry *slotOtherPage(volatile struct slotEntry *page);
+uint32_t selectSlot(void);
+/* selectSlot's answer, kept until slotsChanged says a slot or the record was written */
+uint32_t activeSlot(void);
+void slotsChanged(void);
+int slotValid(uint32_t slot, uint32_t size, uint32_t crc);
+#endif
 
 void setupGPIO(void);
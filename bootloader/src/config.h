@@ -1,11 +1,132 @@
 #pragma once
 
-// HID Bootloader takes 4K
+/* Compact build: the HID flashing protocol only, every optional part below left out
+   unless asked for, aiming for a bootloader of 2K */
+#ifndef BL_COMPACT
+#define BL_COMPACT 0
+#endif
+
+/* Full build: every optional part below but the A/B slots, for a bootloader given the
+   10K they take. Without it only what fits in 4K, in front of the 0x08001000 Vial firmware
+   built for vibl starts at, is in by default */
+#ifndef BL_FULL
+#define BL_FULL 0
+#endif
+
+#if BL_COMPACT && BL_FULL
+#error A build is either compact or full
+#endif
+
+// HID Bootloader takes 4K, 2K when compact and 10K when full. The build passes this in
+// along with the size the linker checks the bootloader against
+#ifndef USER_PROGRAM
+#if BL_COMPACT
+#define USER_PROGRAM 0x08000800
+#elif BL_FULL
+#define USER_PROGRAM 0x08002800
+#else
 #define USER_PROGRAM 0x08001000
+#endif
+#endif
 
 #define RTC_BOOTLOADER_FLAG 0x7662 /* Flag whether to jump into bootloader, "vb" */
 #define RTC_INSECURE_FLAG 0x4953 /* Flag to indicate qmk that we want to boot into insecure mode, "IS" */
 
+/* Erase the whole range of a flash session up front when the host asks for it, reporting
+   progress, so that the data phase only has to program */
+#ifndef BL_ERASE_AHEAD
+#define BL_ERASE_AHEAD BL_FULL
+#endif
+
+/* Keep a checkpoint of the pages a flash session has written in the backup registers, so
+   that a session cut short can be picked up where it stopped */
+#ifndef BL_RESUME
+#define BL_RESUME BL_FULL
+#endif
+
+/* Answer the CRC command, for the host to check what it wrote */
+#ifndef BL_VERIFY
+#define BL_VERIFY BL_FULL
+#endif
+
+/* Answer the capabilities command with all the host needs in one report. Without it the
+   host falls back to the ident and UID commands */
+#ifndef BL_CAPABILITIES
+#define BL_CAPABILITIES (!BL_COMPACT)
+#endif
+
+/* Double buffer the OUT endpoints in the packet memory */
+#ifndef BL_DBL_BUF
+#define BL_DBL_BUF BL_FULL
+#endif
+
+/* Read the flash size and erase page size off the part. Without it the C8 layout, 64K in
+   1K pages, is taken for granted */
+#ifndef BL_FLASH_GEOMETRY
+#define BL_FLASH_GEOMETRY (!BL_COMPACT)
+#endif
+
+/* Offer the command set over a vendor-class bulk interface too, next to the HID one */
+#ifndef BL_VENDOR_INTERFACE
+#define BL_VENDOR_INTERFACE BL_FULL
+#endif
+
+/* Accept delta patches that rebuild the image from the one already in flash */
+#ifndef BL_DELTA
+#define BL_DELTA BL_FULL
+#endif
+
+/* Split the application area into two slots and boot whichever the slot record in the
+   last two erase pages selects, so new firmware can be written next to the running one */
+#ifndef BL_AB_SLOTS
+#define BL_AB_SLOTS 0
+#endif
+
+/* Keep performance counters for the stats command */
+#ifndef BL_STATS
+#define BL_STATS BL_FULL
+#endif
+
+/* Accept a launch command that starts the application straight from the bootloader,
+   without the system reset and second pass through clock setup that rebooting takes */
+#ifndef BL_LAUNCH
+#define BL_LAUNCH BL_FULL
+#endif
+
+/* Give up on a flash or patch session after this long without data from the host, going
+   back to taking commands with the checkpoint saying how far it got. 0 waits forever */
+#ifndef BL_SESSION_TIMEOUT_MS
+#define BL_SESSION_TIMEOUT_MS (BL_FULL ? 3000 : 0)
+#endif
+
+/* Boot a valid application after this long without anything from the host, so that a
+   board that entered the bootloader by accident doesn't sit there. 0 stays for good */
+#ifndef BL_IDLE_BOOT_MS
+#define BL_IDLE_BOOT_MS (BL_FULL ? 60000 : 0)
+#endif
+
+/* Serve every transfer pending when a USB interrupt is taken before leaving it. 0 goes back
+   to one transfer per interrupt, for comparing the two with the stats command */
+#ifndef BL_DRAIN_CTR
+#define BL_DRAIN_CTR 1
+#endif
+
+/* Both run off a 1ms SysTick interrupt */
+#define BL_TIMERS (BL_SESSION_TIMEOUT_MS || BL_IDLE_BOOT_MS)
+
+/* Queue flash erases and programming and carry them out from the FLASH interrupt, so that
+   a report is taken as soon as it is queued rather than once it is written */
+#ifndef BL_FLASH_ASYNC
+#define BL_FLASH_ASYNC BL_FULL
+#endif
+
+/* The SysTick interrupt runs the timers, and with queued flash jobs erasing ahead too */
+#define BL_TICK (BL_TIMERS || (BL_FLASH_ASYNC && BL_ERASE_AHEAD))
+
+/* SysTick counts milliseconds for the waits of erasing ahead and launching, even without
+   its interrupt */
+#define BL_SYSTICK (BL_TICK || BL_ERASE_AHEAD || BL_LAUNCH)
+
 #if defined(TARGET_GENERIC)
 #define VIAL_KEYBOARD_UID {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF}
 /* setup for bluepill */
@@ -0,0 +1,191 @@
+#include <stm32f1xx.h>
+
+#include "config.h"
+#include "flash.h"
+#include "stats.h"
+
+#define FLASH_ERRORS (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)
+
+static void flashUnlock(void) {
+    FLASH->KEYR = FLASH_KEY1;
+    FLASH->KEYR = FLASH_KEY2;
+}
+
+/* Clear the flags of the operation that just ended and turn them into an outcome */
+static uint8_t flashOutcome(void) {
+    uint32_t sr = FLASH->SR;
+
+    FLASH->SR = sr & (FLASH_SR_EOP | FLASH_ERRORS);
+    if (sr & FLASH_SR_PGERR)
+        return FLASH_ERR_PROGRAM;
+    if (sr & FLASH_SR_WRPRTERR)
+        return FLASH_ERR_PROTECT;
+    return FLASH_OK;
+}
+
+/* Account for a finished job of size bytes (0 for an erase) started at cycle count start,
+   and pass its outcome on */
+static void flashFinished(uint32_t size, flashDone done, uint32_t arg, uint32_t start, uint8_t error) {
+    uint32_t cycles = STATS_NOW() - start;
+
+    STATS_ADD(flashBusy, cycles);
+    STATS_MAX(flashBusyMax, cycles);
+    if (error)
+        STATS_ADD(flashErrors, 1);
+    else if (size)
+        STATS_ADD(programmed, size);
+    else
+        STATS_ADD(erases, 1);
+
+    if (done)
+        done(arg, error);
+}
+
+static void flashWriteHalfword(uint32_t address, const uint8_t *data) {
+    *(volatile uint16_t *) address = data[0] | (data[1] << 8);
+}
+
+#if BL_FLASH_ASYNC
+/* Jobs waiting or under way, from queue[head % FLASH_QUEUE_LEN] up to queue[tail % FLASH_QUEUE_LEN].
+   Only the interrupt moves head and only the queueing side moves tail, so neither needs
+   to keep the other out. */
+#define FLASH_QUEUE_LEN 4
+
+struct flashJob {
+    uint32_t address;
+    uint32_t size;     /* bytes to program, 0 for an erase */
+    flashDone done;
+    uint32_t arg;
+    uint8_t data[FLASH_JOB_DATA];
+};
+
+static struct flashJob queue[FLASH_QUEUE_LEN];
+static volatile uint8_t head, tail;
+static volatile uint8_t running;
+
+/* Progress of the job at the head */
+static uint32_t offset;
+static uint32_t started;
+
+void flashInit(void) {
+    /* above USB and SysTick, so that an interrupt waiting on a full queue gets its slot */
+    NVIC_SetPriority(FLASH_IRQn, 0);
+    NVIC_EnableIRQ(FLASH_IRQn);
+}
+
+/* Start the job at the head, the interrupt at the end of its first operation takes it on */
+static void flashStart(void) {
+    const struct flashJob *job = &queue[head % FLASH_QUEUE_LEN];
+
+    started = STATS_NOW();
+    offset = 0;
+    if (job->size) {
+        FLASH->CR = FLASH_CR_PG | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+        flashWriteHalfword(job->address, job->data);
+    } else {
+        FLASH->CR = FLASH_CR_PER | FLASH_CR_EOPIE | FLASH_CR_ERRIE;
+        FLASH->AR = job->address;
+        FLASH->CR |= FLASH_CR_STRT;
+    }
+}
+
+void FLASH_IRQHandler() {
+    const struct flashJob *job = &queue[head % FLASH_QUEUE_LEN];
+    uint8_t error;
+
+    if (!(FLASH->SR & (FLASH_SR_EOP | FLASH_ERRORS)))
+        return;
+
+    error = flashOutcome();
+    offset += 2;
+    if (!error && offset < job->size) {
+        flashWriteHalfword(job->address + offset, job->data + offset);
+        return;
+    }
+
+    /* the job is done, a failed one is dropped with what's left of it */
+    FLASH->CR = 0;
+    flashFinished(job->size, job->done, job->arg, started, error);
+    ++head;
+
+    if (head != tail) {
+        flashStart();
+    } else {
+        FLASH->CR = FLASH_CR_LOCK;
+        running = 0;
+    }
+}
+
+static void flashQueue(uint32_t address, const uint8_t *data, uint32_t size, flashDone done, uint32_t arg) {
+    struct flashJob *job;
+
+    while ((uint8_t) (tail - head) == FLASH_QUEUE_LEN) {}
+
+    job = &queue[tail % FLASH_QUEUE_LEN];
+    job->address = address;
+    job->size = size;
+    job->done = done;
+    job->arg = arg;
+    for (uint32_t i = 0; i < size; ++i)
+        job->data[i] = data[i];
+    /* the job must be complete in memory before the interrupt can see it queued */
+    __DMB();
+    ++tail;
+
+    /* the interrupt starts the next job itself, unless it found the queue empty already */
+    if (!running) {
+        running = 1;
+        flashUnlock();
+        flashStart();
+    }
+}
+
+void flashWait(void) {
+    while (running) {}
+}
+
+uint8_t flashRoom(void) {
+    return FLASH_QUEUE_LEN - (uint8_t) (tail - head);
+}
+#else
+void flashInit(void) {}
+
+/* Carry out the job right away, polling for the end of each operation */
+static void flashQueue(uint32_t address, const uint8_t *data, uint32_t size, flashDone done, uint32_t arg) {
+    uint32_t start = STATS_NOW();
+    uint8_t error = FLASH_OK;
+
+    flashUnlock();
+    if (size) {
+        FLASH->CR = FLASH_CR_PG;
+        for (uint32_t i = 0; i < size; i += 2) {
+            flashWriteHalfword(address + i, data + i);
+            while (FLASH->SR & FLASH_SR_BSY);
+            if ((error = flashOutcome()) != FLASH_OK)
+                break;
+        }
+    } else {
+        FLASH->CR = FLASH_CR_PER;
+        FLASH->AR = address;
+        FLASH->CR |= FLASH_CR_STRT;
+        while (FLASH->SR & FLASH_SR_BSY);
+        error = flashOutcome();
+    }
+    FLASH->CR = FLASH_CR_LOCK;
+
+    flashFinished(size, done, arg, start, error);
+}
+
+void flashWait(void) {}
+#endif
+
+void flashErase(uint32_t address, flashDone done, uint32_t arg) {
+    flashQueue(address, 0, 0, done, arg);
+}
+
+void flashProgram(uint32_t address, const uint8_t *data, uint32_t size, flashDone done, uint32_t arg) {
+    for (uint32_t chunk; size; address += chunk, data += chunk, size -= chunk) {
+        chunk = size < FLASH_JOB_DATA ? size : FLASH_JOB_DATA;
+        flashQueue(address, data, chunk, done, arg);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+
+/* Flash driver. Erases and programming are queued as jobs, each with a callback that gets
+   the outcome once the job is done. With BL_FLASH_ASYNC the FLASH interrupt carries them
+   out one operation at a time and calls the callbacks, and queueing only waits when the
+   queue is full; without it a job runs to completion, callback included, when queued.
+   Jobs are queued from the USB and SysTick interrupts, never from a callback. */
+
+/* Outcome of a job */
+enum {
+    FLASH_OK = 0,
+    FLASH_ERR_PROGRAM, /* a halfword that wasn't erased */
+    FLASH_ERR_PROTECT, /* a write protected page */
+};
+
+/* Most bytes a program job holds. The data is copied in, so the caller's buffer is free
+   again right away; longer writes become several jobs, each calling back on its own. */
+#define FLASH_JOB_DATA 64
+
+typedef void (*flashDone)(uint32_t arg, uint8_t error);
+
+void flashInit(void);
+
+/* Erase the page at address; done may be NULL */
+void flashErase(uint32_t address, flashDone done, uint32_t arg);
+
+/* Program size bytes (an even number) at address; done may be NULL */
+void flashProgram(uint32_t address, const uint8_t *data, uint32_t size, flashDone done, uint32_t arg);
+
+/* Wait for every job queued so far to be done.
+
+   A few callers block on purpose, in the USB interrupt: HIDUSB_PatchFlush queues a whole
+   erase page, more jobs than the queue holds, so it waits for room as the page is written,
+   and HIDUSB_CommitSlot waits for its entry so the record can be read back. Both are rare
+   (once per page of patch output, once per slot commit), and the host waits for their
+   outcome anyway, so they are left synchronous rather than split into callback steps. */
+void flashWait(void);
+
+#if BL_FLASH_ASYNC
+/* How many jobs can be queued right now without waiting */
+uint8_t flashRoom(void);
+#endif
@@ -24,26 +24,107 @@
 #include "bitwise.h"
 #include "boot.h"
 #include "config.h"
+#include "flash.h"
+#include "stats.h"
 
 // This should be <= MAX_EP_NUM defined in usb.h
-#define EP_NUM 2
+#if BL_VENDOR_INTERFACE
+#define EP_NUM 5
+#else
+#define EP_NUM 3
+#endif
 
 extern volatile uint8_t DeviceAddress;
 extern volatile uint16_t DeviceConfigured, DeviceStatus;
 
 static USB_SetupPacket *SetupPacket;
 
+enum {
+	STATE_INIT = 0,
+	STATE_FLASH,
+	STATE_PATCH,
+};
+
+/* Protocol state, dropped on bus reset so that a host reconnecting mid-session starts afresh */
+static int state = STATE_INIT;
+static uint32_t currentPageOffset;
+
+#if BL_TIMERS
+/* Milliseconds since the host last sent anything, and the state of the last session if
+   it was given up on, reported with the checkpoint until another one starts */
+static uint32_t idleMs;
+static uint8_t abandonedState;
+#endif
+
+#if BL_IDLE_BOOT_MS
+/* Set by the stay command: a host that keeps the bootloader around for later, such as
+   vibl-flashd waiting for jobs, doesn't want it booting the application meanwhile */
+static uint8_t stayInBootloader;
+#endif
+
+#if BL_ERASE_AHEAD && BL_FLASH_ASYNC
+/* Erasing ahead runs off the tick, which keeps the flash queue topped up with erases and
+   reports progress, so that no interrupt waits on the flash for the whole range */
+static struct {
+	uint32_t next;     /* next page to queue an erase for */
+	uint32_t end;
+	uint16_t total;
+	uint16_t reported; /* pages erased as of the last progress report */
+	uint8_t wait;      /* ms left for the host to collect it once all are erased */
+	uint8_t active;
+} eraseAhead;
+#endif
+
+/* Will flash 64 bytes at a time */
+static uint8_t pageData[64];
+
+#if BL_RESUME
+/* Image ID of the flash session, recorded with its checkpoint */
+static uint32_t imageId;
+#endif
+
+/* First flash error of the last flash or patch session, reported with the checkpoint */
+static volatile uint8_t sessionFlashError;
+
+/* IN endpoint answering the interface the last command came in on */
+static uint8_t replyEP = ENDP1;
+
 /* buffer table base address */
 #define BTABLE_ADDRESS      (0x00)
 
 /* EP0  */
-/* rx/tx buffer base address */
-#define ENDP0_RXADDR        (0x18)
-#define ENDP0_TXADDR        (0x58)
+/* rx/tx buffer base address, right after the buffer table of MAX_EP_NUM endpoints */
+#define ENDP0_RXADDR        (0x28)
+#define ENDP0_TXADDR        (0x30)
 
 /* EP1  */
 /* tx buffer base address */
-#define ENDP1_TXADDR        (0x100)
+#define ENDP1_TXADDR        (0x40)
+
+/* EP2  */
+/* double-buffered rx buffers base addresses */
+#define ENDP2_BUF0ADDR      (0x80)
+#define ENDP2_BUF1ADDR      (0xC0)
+
+/* EP3  */
+/* vendor interface bulk OUT, double buffered like EP2 */
+#define ENDP3_BUF0ADDR      (0x100)
+#define ENDP3_BUF1ADDR      (0x140)
+
+/* EP4  */
+/* vendor interface bulk IN */
+#define ENDP4_TXADDR        (0x180)
+
+/* unused end of the packet memory the copy benchmark goes through */
+#define PMA_SCRATCH_ADDR    (0x1C0)
+#define PMA_BENCH_ROUNDS    16
+
+/* Configuration descriptor layout, following the interfaces config.h enables */
+#define HID_INTERFACE_DESC_LENGTH (9 + 9 + 7 + 7)
+#define VENDOR_INTERFACE_DESC_LENGTH (9 + 7 + 7)
+#define CFG_DESC_LENGTH (9 + HID_INTERFACE_DESC_LENGTH + (BL_VENDOR_INTERFACE ? VENDOR_INTERFACE_DESC_LENGTH : 0))
+#define CFG_INTERFACES (1 + (BL_VENDOR_INTERFACE ? 1 : 0))
+#define HID_REPORT_DESC_LENGTH 38
 
 /* USB Descriptors */
 static const uint8_t USB_DEVICE_DESC[] = {
@@ -66,8 +147,8 @@ static const uint8_t USB_DEVICE_DESC[] = {
 static const uint8_t USBD_DEVICE_CFG_DESCRIPTOR[] = {
 	0x09,        // bLength
 	0x02,        // bDescriptorType (Configuration)
-	0x22, 0x00,  // wTotalLength 34
-	0x01,        // bNumInterfaces 1
+	CFG_DESC_LENGTH & 0xFF, CFG_DESC_LENGTH >> 8, // wTotalLength
+	CFG_INTERFACES, // bNumInterfaces
 	0x01,        // bConfigurationValue
 	0x00,        // iConfiguration (String Index)
 	0xC0,        // bmAttributes Self Powered
@@ -77,7 +158,7 @@ static const uint8_t USBD_DEVICE_CFG_DESCRIPTOR[] = {
 	0x04,        // bDescriptorType (Interface)
 	0x00,        // bInterfaceNumber 0
 	0x00,        // bAlternateSetting
-	0x01,        // bNumEndpoints 1
+	0x02,        // bNumEndpoints 2
 	0x03,        // bInterfaceClass
 	0x00,        // bInterfaceSubClass
 	0x00,        // bInterfaceProtocol
@@ -89,17 +170,87 @@ static const uint8_t USBD_DEVICE_CFG_DESCRIPTOR[] = {
 	0x00,        // bCountryCode
 	0x01,        // bNumDescriptors
 	0x22,        // bDescriptorType[0] (HID)
-	0x20, 0x00,  // wDescriptorLength[0] 32
+	HID_REPORT_DESC_LENGTH, 0x00, // wDescriptorLength[0]
 
 	0x07,        // bLength
 	0x05,        // bDescriptorType (Endpoint)
 	0x81,        // bEndpointAddress (IN/D2H)
 	0x03,        // bmAttributes (Interrupt)
-	0x08, 0x00,  // wMaxPacketSize 8
-	0x05         // bInterval 5 (unit depends on device speed)
+	0x40, 0x00,  // wMaxPacketSize 64
+	0x05,        // bInterval 5 (unit depends on device speed)
+
+	0x07,        // bLength
+	0x05,        // bDescriptorType (Endpoint)
+	0x02,        // bEndpointAddress (OUT/H2D)
+	0x03,        // bmAttributes (Interrupt)
+	0x40, 0x00,  // wMaxPacketSize 64
+	0x01,        // bInterval 1 (unit depends on device speed)
+
+#if BL_VENDOR_INTERFACE
+	/* Same command set over bulk endpoints, for hosts that can claim a vendor interface */
+	0x09,        // bLength
+	0x04,        // bDescriptorType (Interface)
+	0x01,        // bInterfaceNumber 1
+	0x00,        // bAlternateSetting
+	0x02,        // bNumEndpoints 2
+	0xFF,        // bInterfaceClass (Vendor Specific)
+	0x00,        // bInterfaceSubClass
+	0x00,        // bInterfaceProtocol
+	0x00,        // iInterface (String Index)
+
+	0x07,        // bLength
+	0x05,        // bDescriptorType (Endpoint)
+	0x03,        // bEndpointAddress (OUT/H2D)
+	0x02,        // bmAttributes (Bulk)
+	0x40, 0x00,  // wMaxPacketSize 64
+	0x00,        // bInterval 0
+
+	0x07,        // bLength
+	0x05,        // bDescriptorType (Endpoint)
+	0x84,        // bEndpointAddress (IN/D2H)
+	0x02,        // bmAttributes (Bulk)
+	0x40, 0x00,  // wMaxPacketSize 64
+	0x00,        // bInterval 0
+#endif
+};
+
+_Static_assert(sizeof(USBD_DEVICE_CFG_DESCRIPTOR) == CFG_DESC_LENGTH, "configuration descriptor length");
+
+#if BL_VENDOR_INTERFACE
+/* Microsoft OS 1.0 descriptors, so that Windows binds WinUSB to the vendor interface without
+   an INF and libusb can claim it there. Windows asks for string 0xEE once per VID, PID and
+   bcdDevice and remembers the answer, so a device it has seen without one needs bcdDevice
+   bumped or its usbflags registry entry removed first. MS OS 2.0 descriptors would need
+   bcdUSB 2.01 and a BOS descriptor, which a full speed 1.10 device doesn't have. */
+#define MS_VENDOR_CODE 0x56 /* bRequest of the vendor request fetching the descriptors, "V" */
+#define MS_EXTENDED_COMPAT_ID 0x0004
+
+static const uint8_t sdMSOS[] = {
+	0x12,        // bLength
+	0x03,        // bDescriptorType (String)
+	'M', 0, 'S', 0, 'F', 0, 'T', 0, '1', 0, '0', 0, '0', 0, // qwSignature "MSFT100"
+	MS_VENDOR_CODE, // bMS_VendorCode
+	0x00         // bPad
 };
 
-static const uint8_t usbHidReportDescriptor[32] = {
+static const uint8_t msExtendedCompatID[] = {
+	0x28, 0x00, 0x00, 0x00, // dwLength 40
+	0x00, 0x01,  // bcdVersion 1.00
+	MS_EXTENDED_COMPAT_ID & 0xFF, MS_EXTENDED_COMPAT_ID >> 8, // wIndex
+	0x01,        // bCount 1
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // reserved
+
+	0x01,        // bFirstInterfaceNumber 1, the vendor interface
+	0x01,        // reserved
+	'W', 'I', 'N', 'U', 'S', 'B', 0x00, 0x00, // compatibleID
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // subCompatibleID
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00 // reserved
+};
+
+_Static_assert(sizeof(msExtendedCompatID) == 40, "extended compat ID descriptor length");
+#endif
+
+static const uint8_t usbHidReportDescriptor[] = {
 		0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
 		0x09, 0x01,        // Usage (0x01)
 		0xA1, 0x01,        // Collection (Application)
@@ -107,7 +258,7 @@ static const uint8_t usbHidReportDescriptor[32] = {
 		0x15, 0x00,        //   Logical Minimum (0)
 		0x25, 0xFF,        //   Logical Maximum (-1)
 		0x75, 0x08,        //   Report Size (8)
-		0x95, 0x08,        //   Report Count (8)
+		0x95, 0x40,        //   Report Count (64)
 		0x81, 0x02,        //   Input (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position)
 		0x09, 0x03,        //   Usage (0x03)
 		0x15, 0x00,        //   Logical Minimum (0)
@@ -115,10 +266,57 @@ static const uint8_t usbHidReportDescriptor[32] = {
 		0x75, 0x08,        //   Report Size (8)
 		0x95, 0x40,        //   Report Count (64)
 		0x91, 0x02,        //   Output (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
+		0x09, 0x04,        //   Usage (0x04)
+		0x95, 0x01,        //   Report Count (1)
+		0xB1, 0x02,        //   Feature (Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile)
 		0xC0               // End Collection
 };
 
+_Static_assert(sizeof(usbHidReportDescriptor) == HID_REPORT_DESC_LENGTH, "report descriptor length");
+
+/* Drop whatever session is going on along with the half received report, and take
+   commands again. A flash session's checkpoint already records the pages that made it */
+static void HIDUSB_DropSession(void) {
+#if BL_TIMERS
+	if (state != STATE_INIT)
+		abandonedState = state;
+#endif
+	state = STATE_INIT;
+	currentPageOffset = 0;
+#if BL_ERASE_AHEAD && BL_FLASH_ASYNC
+	/* erases already queued still run, but nothing reports on them */
+	eraseAhead.next = eraseAhead.end;
+	eraseAhead.active = 0;
+#endif
+}
+
+/* Bytes of a control transfer's data stage that aren't protocol data */
+static uint16_t controlDiscard;
+
+/* Set up OUT endpoint EPn for 64-byte reports, in two packet memory buffers when double
+   buffered and in the first one otherwise */
+static void HIDUSB_SetupOut(uint8_t EPn, uint16_t Buf0Addr, uint16_t Buf1Addr) {
+#if BL_DBL_BUF
+	USB_SetupDblBufOut(EPn, Buf0Addr, Buf1Addr, 64);
+#else
+	(void) Buf1Addr;
+	_SetEPType(EPn, EP_BULK);
+	_SetEPRxAddr(EPn, Buf0Addr);
+	_SetEPRxCount(EPn, 64);
+	_SetEPRxStatus(EPn, EP_RX_VALID);
+	_SetEPTxStatus(EPn, EP_TX_DIS);
+#endif
+}
+
 void HIDUSB_Reset() {
+	/* a session cut short by the host starting over counts as given up on too */
+	HIDUSB_DropSession();
+#if BL_TIMERS
+	idleMs = 0;
+#endif
+	replyEP = ENDP1;
+	controlDiscard = 0;
+
 	_SetBTABLE(BTABLE_ADDRESS);
 
 	/* Initialize Endpoint 0 */
@@ -132,205 +330,832 @@ void HIDUSB_Reset() {
 	/* Initialize Endpoint 1 */
 	_SetEPType(ENDP1, EP_INTERRUPT);
 	_SetEPTxAddr(ENDP1, ENDP1_TXADDR);
-	_SetEPTxCount(ENDP1, 0x8);
+	_SetEPTxCount(ENDP1, 0x40);
 	_SetEPRxStatus(ENDP1, EP_RX_DIS);
 	_SetEPTxStatus(ENDP1, EP_TX_NAK);
 
+	/* Initialize Endpoint 2, output reports land here. Each one is copied out and its
+	   buffer handed back first, so that the next report is accepted while the current
+	   one is being flashed */
+	HIDUSB_SetupOut(ENDP2, ENDP2_BUF0ADDR, ENDP2_BUF1ADDR);
+
+#if BL_VENDOR_INTERFACE
+	/* Initialize Endpoints 3 and 4, the bulk pair of the vendor interface */
+	HIDUSB_SetupOut(ENDP3, ENDP3_BUF0ADDR, ENDP3_BUF1ADDR);
+
+	_SetEPType(ENDP4, EP_BULK);
+	_SetEPTxAddr(ENDP4, ENDP4_TXADDR);
+	_SetEPTxCount(ENDP4, 0x40);
+	_SetEPRxStatus(ENDP4, EP_RX_DIS);
+	_SetEPTxStatus(ENDP4, EP_TX_NAK);
+#endif
+
 	/* set address in every used endpoint */
 	for (int i = 0; i < EP_NUM; i++) {
 		_SetEPAddress((uint8_t )i, (uint8_t )i);
 		RxTxBuffer[i].MaxPacketSize = 8;
 	}
+	RxTxBuffer[ENDP1].MaxPacketSize = 64;
+	RxTxBuffer[ENDP2].MaxPacketSize = 64;
+#if BL_VENDOR_INTERFACE
+	RxTxBuffer[ENDP3].MaxPacketSize = 64;
+	RxTxBuffer[ENDP4].MaxPacketSize = 64;
+#endif
 
 	_SetDADDR(0 | DADDR_EF); /* set device address and enable function */
 }
 
+/* What GET_DESCRIPTOR serves, by type and index */
+static const struct {
+	uint8_t type;
+	uint8_t index;
+	uint8_t length;
+	const uint8_t *data;
+} descriptors[] = {
+	{USB_DEVICE_DESC_TYPE, 0, sizeof(USB_DEVICE_DESC), USB_DEVICE_DESC},
+	{USB_CFG_DESC_TYPE, 0, sizeof(USBD_DEVICE_CFG_DESCRIPTOR), USBD_DEVICE_CFG_DESCRIPTOR},
+	{USB_REPORT_DESC_TYPE, 0, sizeof(usbHidReportDescriptor), usbHidReportDescriptor},
+	{USB_STR_DESC_TYPE, 0x00, sizeof(sdLangID), sdLangID},
+	{USB_STR_DESC_TYPE, 0x01, sizeof(sdProduct), sdProduct},
+	{USB_STR_DESC_TYPE, 0x02, sizeof(sdSerial), sdSerial},
+#if BL_VENDOR_INTERFACE
+	{USB_STR_DESC_TYPE, 0xEE, sizeof(sdMSOS), sdMSOS},
+#endif
+};
+
 void HIDUSB_GetDescriptor(USB_SetupPacket *SPacket) {
+	for (size_t i = 0; i < sizeof(descriptors) / sizeof(descriptors[0]); ++i) {
+		if (descriptors[i].type == SPacket->wValue.H && descriptors[i].index == SPacket->wValue.L) {
+			USB_SendData(0, descriptors[i].data,
+					SPacket->wLength > descriptors[i].length ?
+							descriptors[i].length : SPacket->wLength);
+			return;
+		}
+	}
 
-	switch (SPacket->wValue.H) {
-		case USB_DEVICE_DESC_TYPE:
-			USB_SendData(0, USB_DEVICE_DESC,
-					SPacket->wLength > sizeof(USB_DEVICE_DESC) ?
-							sizeof(USB_DEVICE_DESC) : SPacket->wLength);
-			break;
+	USB_SendData(0, 0, 0);
+}
 
-		case USB_CFG_DESC_TYPE:
-			USB_SendData(0, USBD_DEVICE_CFG_DESCRIPTOR,
-					SPacket->wLength > sizeof(USBD_DEVICE_CFG_DESCRIPTOR) ?
-							sizeof(USBD_DEVICE_CFG_DESCRIPTOR) : SPacket->wLength);
-			break;
+#if BL_STATS
+struct blStats blStats;
+#endif
+
+/* Flash job callbacks, called as the jobs are done (from the FLASH interrupt when they
+   are queued). Commands wait for the flash to be done before anything else, so these
+   have the session state to themselves. */
+static void HIDUSB_FlashResult(uint32_t arg, uint8_t error) {
+	(void) arg;
+	if (error && !sessionFlashError)
+		sessionFlashError = error;
+}
 
-		case USB_REPORT_DESC_TYPE:
-			USB_SendData(0, usbHidReportDescriptor,
-					SPacket->wLength > sizeof(usbHidReportDescriptor) ?
-							sizeof(usbHidReportDescriptor) : SPacket->wLength);
-			break;
+#if BL_RESUME
+/* A page of the flash session is written: record it as committed so that an interrupted
+   session can pick up from here, unless the session already went wrong */
+static void HIDUSB_PageWritten(uint32_t page, uint8_t error) {
+	HIDUSB_FlashResult(page, error);
+	if (!sessionFlashError)
+		setFlashCheckpoint(imageId, page);
+}
+#endif
 
-		case USB_STR_DESC_TYPE:
+static uint8_t HIDUSB_PacketIsCommand(const uint8_t *page) {
+	return (page[0] == 'V' && page[1] == 'C');
+}
 
-			switch (SPacket->wValue.L) {
-			case 0x00:
-				USB_SendData(0, sdLangID,
-						SPacket->wLength > sizeof(sdLangID) ?
-								sizeof(sdLangID) : SPacket->wLength);
-				break;
-			case 0x01:
-				USB_SendData(0, sdProduct,
-						SPacket->wLength > sizeof(sdProduct) ?
-								sizeof(sdProduct) : SPacket->wLength);
-				break;
-			case 0x02:
-					USB_SendData(0, sdSerial,
-						SPacket->wLength > sizeof(sdSerial) ?
-								sizeof(sdSerial) : SPacket->wLength);
-				break;
-			default:
-				USB_SendData(0, 0, 0);
-			}
+/* Feature flags reported in the bootloader ident and capabilities */
+#define FEATURE_ERASE_AHEAD 0x01
+#define FEATURE_RESUME      0x02
+#define FEATURE_VERIFY      0x04
+#define FEATURE_DELTA       0x08
+#define FEATURE_AB_SLOTS    0x10
+#define FEATURE_STATS       0x20
+#define FEATURE_LAUNCH      0x40
+#define FEATURE_ABORT       0x80 /* the feature report calls off a session */
+
+#define FEATURES ((BL_ERASE_AHEAD ? FEATURE_ERASE_AHEAD : 0) | (BL_RESUME ? FEATURE_RESUME : 0) | \
+		(BL_VERIFY ? FEATURE_VERIFY : 0) | \
+		(BL_DELTA ? FEATURE_DELTA : 0) | (BL_AB_SLOTS ? FEATURE_AB_SLOTS : 0) | \
+		(BL_STATS ? FEATURE_STATS : 0) | (BL_LAUNCH ? FEATURE_LAUNCH : 0) | FEATURE_ABORT)
+
+#if BL_LAUNCH
+/* Application the main loop is to start, set once the launch command has been accepted */
+volatile uint32_t HIDUSB_LaunchBase;
+#endif
+
+/* Input report going out on EP1 (or EP4), answers to commands are written straight into it */
+static uint8_t report[64];
+
+#if BL_STATS
+_Static_assert(8 + sizeof(struct blStats) <= sizeof(report), "stats fit the report");
+#endif
+
+/* Send the first length bytes of the report, zero padded to the full report size */
+static void HIDUSB_SendReport(uint8_t length) {
+	for (uint8_t i = length; i < sizeof(report); ++i)
+		report[i] = 0;
+
+	USB_SendData(replyEP, report, sizeof(report));
+}
 
-			break;
-		default:
-			USB_SendData(0, 0, 0);
-			break;
-	}
+#if BL_LAUNCH
+void HIDUSB_WaitReplySent(uint32_t Ms) {
+	USB_WaitSent(replyEP, Ms);
+}
+#endif
+
+#if BL_ERASE_AHEAD
+/* Flags accepted in the sixth byte of the flash command */
+#define FLASH_FLAG_ERASE_AHEAD 0x01
+
+static void HIDUSB_SendEraseProgress(uint8_t done, uint16_t erased, uint16_t total) {
+	report[0] = 0x02;
+	report[1] = done;
+	report[2] = erased & 0xFF;
+	report[3] = erased >> 8;
+	report[4] = total & 0xFF;
+	report[5] = total >> 8;
+	HIDUSB_SendReport(6);
 }
 
-static void HIDUSB_FlashUnlock() {
-	FLASH->KEYR = FLASH_KEY1;
-	FLASH->KEYR = FLASH_KEY2;
+static volatile uint16_t pagesErasedAhead;
+
+static void HIDUSB_PageErased(uint32_t arg, uint8_t error) {
+	HIDUSB_FlashResult(arg, error);
+	++pagesErasedAhead;
 }
 
-static void HIDUSB_FlashLock() {
-	bit_set(FLASH->CR, FLASH_CR_LOCK);
+/* How long the completion report waits for the host to collect the last progress report
+   (it polls every 5ms) before it is dropped */
+#define ERASE_REPORT_WAIT_MS 20
+
+/* Erase every flash page from the start of the flash session up to its end before any
+   data arrives, so that the data phase only has to program. A page the session starts
+   in the middle of is left alone, it was already erased by the session being resumed.
+   Progress goes out whenever the previous report has been picked up by the host, and so
+   does completion. A report still waiting in the IN buffer is never overwritten, the host
+   could read it torn; one that sits there past ERASE_REPORT_WAIT_MS means a host that
+   stopped reading, which is left to time out and resume. */
+#if BL_FLASH_ASYNC
+/* Queue erases while there is room, or all that are left */
+static void HIDUSB_QueueErases(uint8_t all) {
+	while (eraseAhead.next < eraseAhead.end && (all || flashRoom())) {
+		flashErase(eraseAhead.next, HIDUSB_PageErased, 0);
+		eraseAhead.next += flashPageSize;
+	}
 }
 
-static void HIDUSB_FormatFlashPage(uint32_t page) {
-	while(FLASH->SR & FLASH_SR_BSY);
+static void HIDUSB_EraseAhead(uint32_t start, uint32_t end) {
+	start = (start + flashPageSize - 1) & ~(flashPageSize - 1);
+
+	pagesErasedAhead = 0;
+	eraseAhead.next = start;
+	eraseAhead.end = end;
+	eraseAhead.total = end > start ? (end - start + flashPageSize - 1) / flashPageSize : 0;
+	eraseAhead.reported = 0;
+	eraseAhead.wait = ERASE_REPORT_WAIT_MS;
+	eraseAhead.active = 1;
+	HIDUSB_QueueErases(0);
+}
 
-	bit_set(FLASH->CR, FLASH_CR_PER);
+static void HIDUSB_EraseAheadTick(void) {
+	uint16_t erased = pagesErasedAhead;
+	uint8_t busy = _GetEPTxStatus(replyEP) == EP_TX_VALID;
 
-	FLASH->AR = page;
+	HIDUSB_QueueErases(0);
 
-	bit_set(FLASH->CR, FLASH_CR_STRT);
+	if (erased < eraseAhead.total) {
+		if (!busy && erased != eraseAhead.reported) {
+			eraseAhead.reported = erased;
+			HIDUSB_SendEraseProgress(0, erased, eraseAhead.total);
+		}
+		return;
+	}
 
-	while(FLASH->SR & FLASH_SR_BSY);
+	if (busy && eraseAhead.wait) {
+		--eraseAhead.wait;
+		return;
+	}
 
-	bit_clear(FLASH->CR, FLASH_CR_PER);
+	if (!busy)
+		HIDUSB_SendEraseProgress(1, erased, eraseAhead.total);
+	eraseAhead.active = 0;
 }
+#else
+/* Without queued jobs each erase is done when flashErase returns */
+static void HIDUSB_EraseAhead(uint32_t start, uint32_t end) {
+	uint16_t total;
 
-static void HIDUSB_WriteFlash(uint32_t page, uint8_t *data, uint16_t size) {
-	while(FLASH->SR & FLASH_SR_BSY);
-
-	bit_set(FLASH->CR, FLASH_CR_PG);
+	start = (start + flashPageSize - 1) & ~(flashPageSize - 1);
+	total = end > start ? (end - start + flashPageSize - 1) / flashPageSize : 0;
 
-	for(uint16_t i = 0; i < size; i += 2) {
-		uint16_t tmp = data[i] | (data[i + 1] << 8);
-		*(volatile uint16_t *)(page + i) = tmp;
+	pagesErasedAhead = 0;
+	for (uint32_t page = start; page < end; page += flashPageSize) {
+		flashErase(page, HIDUSB_PageErased, 0);
 
-		while(FLASH->SR & FLASH_SR_BSY);
+		if (_GetEPTxStatus(replyEP) != EP_TX_VALID)
+			HIDUSB_SendEraseProgress(0, pagesErasedAhead, total);
 	}
 
-	bit_clear(FLASH->CR, FLASH_CR_PG);
+	USB_WaitSent(replyEP, ERASE_REPORT_WAIT_MS);
+	if (_GetEPTxStatus(replyEP) != EP_TX_VALID)
+		HIDUSB_SendEraseProgress(1, pagesErasedAhead, total);
+}
+#endif
+#endif
+
+#if BL_RESUME || BL_VERIFY || BL_CAPABILITIES || BL_DELTA || BL_AB_SLOTS || BL_STATS
+static void HIDUSB_PutU32(uint8_t *buf, uint32_t value) {
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+#endif
+
+/* Whether pages [first, end) of 64 bytes lie within the application area of this part */
+static int HIDUSB_PagesInFlash(uint32_t first, uint32_t end) {
+#if BL_AB_SLOTS
+	/* the slot record is only written through the slot command */
+	return first < end && USER_PROGRAM + end * 64 <= (uint32_t) slotRecord();
+#else
+	return first < end && USER_PROGRAM + end * 64 <= FLASH_BASE + flashSize;
+#endif
 }
 
-static uint8_t HIDUSB_PacketIsCommand(const uint8_t *page) {
-	return (page[0] == 'V' && page[1] == 'C');
+#if BL_AB_SLOTS
+/* Append an entry selecting slot to the slot record. A full page hands over to the other
+   one, which loses its older entries while the full page keeps the recent fallbacks.
+   Blocks until the entry is programmed, see flashWait */
+static void HIDUSB_CommitSlot(uint32_t slot, uint32_t size, uint32_t crc) {
+	volatile struct slotEntry *page = slotCurrentPage();
+	struct slotEntry entry = {SLOT_RECORD_MAGIC, slot, size, crc};
+	uint32_t count = flashPageSize / sizeof(entry);
+	uint32_t i = 1;
+
+	while (page && i < count && page[i].magic != 0xFFFFFFFF)
+		++i;
+
+	if (!page || i == count) {
+		uint32_t generation = page ? page->slot + 1 : 0;
+		struct slotEntry header = {SLOT_PAGE_MAGIC, generation, ~generation, SLOT_PAGE_MAGIC};
+
+		page = page ? slotOtherPage(page) : slotRecord();
+		flashErase((uint32_t) page, NULL, 0);
+		flashProgram((uint32_t) page, (uint8_t *) &header, sizeof(header), NULL, 0);
+		i = 1;
+	}
+	/* the CRC goes last, an entry cut short never validates */
+	flashProgram((uint32_t) &page[i], (uint8_t *) &entry, sizeof(entry), NULL, 0);
+	/* the caller reads the record back */
+	flashWait();
+	slotsChanged();
 }
+#endif
+
+#if BL_DELTA
+/* Delta patches: the new image is rebuilt from an op stream against the one in flash.
+   Each erase page of output is assembled in RAM first, so a page may copy from its own
+   old contents, but never from a page that has already been rewritten. */
+#define PATCH_OP_NOP    0x00 /* pads the last report */
+#define PATCH_OP_COPY   0x01 /* u32 source offset, u16 length: copy from the current image */
+#define PATCH_OP_INSERT 0x02 /* u8 length, followed by that many literal bytes */
 
 enum {
-	STATE_INIT = 0,
-	STATE_FLASH,
+	PATCH_OK = 0,
+	PATCH_ERR_RANGE,  /* copy from outside the image or from a page already rewritten */
+	PATCH_ERR_OP,     /* unknown op */
+	PATCH_ERR_SIZE,   /* output doesn't match the announced size */
+	PATCH_ERR_FLASH,  /* erasing or programming failed */
 };
 
-void HIDUSB_HandleData(uint8_t *data) {
-	static int state = STATE_INIT;
-	static uint32_t pagesToFlash;
-	static uint32_t currentPage;
-	static uint32_t currentPageOffset;
+static struct {
+	uint32_t out;      /* bytes of new image produced so far */
+	uint32_t end;      /* size of the new image */
+	uint16_t reports;  /* reports of op stream still to come */
+	uint8_t op;
+	uint8_t argc;      /* argument bytes of op collected so far */
+	uint8_t args[6];
+	uint8_t insert;    /* literal bytes of an insert still to come */
+	uint8_t error;
+} patch;
+
+static uint8_t patchPage[2048];
+
+/* The initial stack pointer of the new image, programmed only once the whole patch has
+   made it. Until then the application area holds no bootable image, so a patch that
+   fails or is given up on halfway doesn't leave a half rebuilt one for checkUserCode to
+   accept */
+static uint8_t patchHead[4];
+
+/* Program the erase page assembled so far, padding a partial one with the erased value.
+   Blocks until the last jobs of the page are queued, see flashWait */
+static void HIDUSB_PatchFlush(void) {
+	uint32_t fill = patch.out & (flashPageSize - 1);
+	uint32_t base = USER_PROGRAM + ((patch.out - 1) & ~(flashPageSize - 1));
+
+	if (fill)
+		for (uint32_t i = fill; i < flashPageSize; ++i)
+			patchPage[i] = 0xFF;
+
+	if (base == USER_PROGRAM)
+		for (uint32_t i = 0; i < sizeof(patchHead); ++i) {
+			patchHead[i] = patchPage[i];
+			patchPage[i] = 0xFF;
+		}
+
+	/* the jobs take copies, patchPage is free for the next page as soon as they are queued */
+	flashErase(base, HIDUSB_FlashResult, 0);
+	flashProgram(base, patchPage, flashPageSize, HIDUSB_FlashResult, 0);
+}
 
-	/* Will flash 64 bytes at a time */
-	static uint8_t pageData[64];
+static void HIDUSB_PatchOutput(uint8_t b) {
+	if (patch.out >= patch.end) {
+		patch.error = PATCH_ERR_SIZE;
+		return;
+	}
 
-	static uint8_t keyboard_id[8] = VIAL_KEYBOARD_UID;
+	patchPage[patch.out & (flashPageSize - 1)] = b;
+	if ((++patch.out & (flashPageSize - 1)) == 0)
+		HIDUSB_PatchFlush();
+}
 
-	static uint8_t bootloader_ident[8] = { 1 };
+static void HIDUSB_PatchCopy(uint32_t src, uint16_t length) {
+	uint32_t imageSize = FLASH_BASE + flashSize - USER_PROGRAM;
 
-	if (state == STATE_INIT) {
-		for (size_t i = 0; i < 8; ++i)
-			pageData[currentPageOffset + i] = data[i];
-		currentPageOffset += 8;
+	for (; length && !patch.error; --length, ++src) {
+		/* the page being assembled still has its old contents in flash, earlier ones don't */
+		if (src < (patch.out & ~(flashPageSize - 1)) || src >= imageSize) {
+			patch.error = PATCH_ERR_RANGE;
+			return;
+		}
+		HIDUSB_PatchOutput(*(const uint8_t *) (USER_PROGRAM + src));
+	}
+}
 
-		if (currentPageOffset == sizeof(pageData)) {
-			currentPageOffset = 0;
+static void HIDUSB_PatchByte(uint8_t b) {
+	if (patch.insert) {
+		--patch.insert;
+		HIDUSB_PatchOutput(b);
+		return;
+	}
 
-			if (HIDUSB_PacketIsCommand(pageData)) {
-				switch (pageData[2]) {
-				case 0x00:
-					/* Retrieve bootloader version, flags */
-					USB_SendData(ENDP1, bootloader_ident, sizeof(bootloader_ident));
-					break;
-				case 0x01:
-					/* Send vial keyboard ID */
-					USB_SendData(ENDP1, keyboard_id, sizeof(keyboard_id));
-					break;
-				case 0x02:
-					/* Flash */
-					currentPage = 0;
-					pagesToFlash = pageData[3] + 256 * pageData[4];
-					/* Don't allow to pass a ridiculous value. 10 megs max */
-					if (pagesToFlash < 10 * 1024 * 1024 / sizeof(pageData)) {
-						state = STATE_FLASH;
-						currentPageOffset = 0;
+	if (patch.argc == 0 && patch.op == PATCH_OP_NOP) {
+		if (b != PATCH_OP_NOP && b != PATCH_OP_COPY && b != PATCH_OP_INSERT)
+			patch.error = PATCH_ERR_OP;
+		patch.op = b;
+		return;
+	}
+
+	patch.args[patch.argc++] = b;
+	if (patch.op == PATCH_OP_INSERT) {
+		patch.insert = b;
+	} else if (patch.argc < 6) {
+		return;
+	} else {
+		HIDUSB_PatchCopy(patch.args[0] | (patch.args[1] << 8) | (patch.args[2] << 16) | ((uint32_t)patch.args[3] << 24),
+				patch.args[4] | (patch.args[5] << 8));
+	}
+	patch.op = PATCH_OP_NOP;
+	patch.argc = 0;
+}
+#endif
+
+/* A whole 64-byte report has been collected in pageData */
+static void HIDUSB_HandleReport(void) {
+	static uint32_t pagesToFlash;
+	static uint32_t currentPage;
+	static uint8_t erasedAhead;
+
+	static const uint8_t keyboard_id[8] = VIAL_KEYBOARD_UID;
+
+	if (state == STATE_INIT) {
+		/* commands see the flash as the last session left it */
+		flashWait();
+
+		if (HIDUSB_PacketIsCommand(pageData)) {
+			switch (pageData[2]) {
+			case 0x00:
+				/* Retrieve bootloader version, flags, flash size in K, erase page size,
+				   transfer unit and application offset in K */
+				report[0] = 1;
+				report[1] = FEATURES;
+				report[2] = (flashSize / 1024) & 0xFF;
+				report[3] = (flashSize / 1024) >> 8;
+				report[4] = flashPageSize & 0xFF;
+				report[5] = flashPageSize >> 8;
+				report[6] = sizeof(pageData);
+				report[7] = (USER_PROGRAM - FLASH_BASE) / 1024;
+				HIDUSB_SendReport(8);
+				break;
+			case 0x01:
+				/* Send vial keyboard ID */
+				for (size_t i = 0; i < sizeof(keyboard_id); ++i)
+					report[i] = keyboard_id[i];
+				HIDUSB_SendReport(sizeof(keyboard_id));
+				break;
+			case 0x02:
+				/* Flash count pages starting at the given one, recording progress for image ID */
+				currentPage = pageData[6] + 256 * pageData[7];
+				pagesToFlash = currentPage + pageData[3] + 256 * pageData[4];
+#if BL_RESUME
+				imageId = pageData[8] | (pageData[9] << 8) | (pageData[10] << 16) | ((uint32_t)pageData[11] << 24);
+#endif
+				/* Don't allow to write past the end of flash */
+				if (HIDUSB_PagesInFlash(currentPage, pagesToFlash)) {
+					state = STATE_FLASH;
+#if BL_TIMERS
+					abandonedState = STATE_INIT;
+#endif
+#if BL_AB_SLOTS
+					/* the pages written may belong to either slot */
+					slotsChanged();
+#endif
+					sessionFlashError = FLASH_OK;
+#if BL_DELTA
+					patch.error = PATCH_OK;
+#endif
+#if BL_ERASE_AHEAD
+					erasedAhead = pageData[5] & FLASH_FLAG_ERASE_AHEAD;
+					if (erasedAhead)
+						HIDUSB_EraseAhead(USER_PROGRAM + currentPage * sizeof(pageData),
+								USER_PROGRAM + pagesToFlash * sizeof(pageData));
+#endif
+				} else {
+					STATS_ADD(protocolErrors, 1);
+				}
+				break;
+			case 0x03:
+				/* Reboot */
+				NVIC_SystemReset();
+				break;
+			case 0x04:
+				/* set insecure so that on first boot we can restore layout */
+				setInsecureFlag();
+				break;
+#if BL_RESUME
+			case 0x05: {
+				/* Get the checkpoint of the last flash session: image ID and the next page to write,
+				   in [6] whether a flash (1) or patch (2) session was given up on since and in [7]
+				   the first flash error of the last session, if any */
+				uint32_t image;
+				uint16_t page = getFlashCheckpoint(&image);
+
+				HIDUSB_PutU32(report, image);
+				report[4] = page & 0xFF;
+				report[5] = page >> 8;
+#if BL_TIMERS
+				report[6] = abandonedState;
+#else
+				report[6] = 0;
+#endif
+				report[7] = sessionFlashError;
+				HIDUSB_SendReport(8);
+				break;
+			}
+#endif
+#if BL_VERIFY
+			case 0x06: {
+				/* CRC-32 of count pages starting at the given one */
+				uint32_t first = pageData[3] + 256 * pageData[4];
+				uint32_t count = pageData[5] + 256 * pageData[6];
+
+				if (!HIDUSB_PagesInFlash(first, first + count))
+					count = 0;
+				HIDUSB_PutU32(report, flashCRC((const uint8_t *) (USER_PROGRAM + first * sizeof(pageData)),
+						count * sizeof(pageData)));
+				HIDUSB_SendReport(4);
+				break;
+			}
+#endif
+#if BL_CAPABILITIES
+			case 0x07:
+				/* Everything the host needs to pick a flashing mode, in one report */
+				report[0] = 'V';
+				report[1] = 'C';
+				report[2] = 0x07;
+				report[3] = 1; /* protocol version */
+				report[4] = FEATURES & 0xFF;
+				report[5] = FEATURES >> 8;
+				report[6] = sizeof(pageData);
+				report[7] = 0;
+				HIDUSB_PutU32(&report[8], flashSize);
+				HIDUSB_PutU32(&report[12], USER_PROGRAM);
+				report[16] = flashPageSize & 0xFF;
+				report[17] = flashPageSize >> 8;
+				report[18] = 2; /* reports in flight: EP2 buffers two of them */
+				for (size_t i = 19; i < 24; ++i)
+					report[i] = 0;
+				for (size_t i = 0; i < sizeof(keyboard_id); ++i)
+					report[24 + i] = keyboard_id[i];
+				HIDUSB_SendReport(32);
+				break;
+#endif
+#if BL_DELTA
+			case 0x08:
+				/* Rebuild count pages of image from the op stream in the following reports */
+				patch.out = 0;
+				patch.end = (pageData[3] + 256 * pageData[4]) * sizeof(pageData);
+				patch.reports = pageData[5] + 256 * pageData[6];
+				patch.op = PATCH_OP_NOP;
+				patch.argc = 0;
+				patch.insert = 0;
+				patch.error = PATCH_OK;
+				if (HIDUSB_PagesInFlash(0, patch.end / sizeof(pageData)) && patch.reports) {
+#if BL_RESUME
+					/* whatever was being flashed before can't be resumed once the patch starts */
+					setFlashCheckpoint(0, 0);
+#endif
+					sessionFlashError = FLASH_OK;
+					state = STATE_PATCH;
+#if BL_TIMERS
+					abandonedState = STATE_INIT;
+#endif
+#if BL_AB_SLOTS
+					slotsChanged();
+#endif
+				} else {
+					STATS_ADD(protocolErrors, 1);
+				}
+				break;
+#endif
+#if BL_AB_SLOTS
+			case 0x09: {
+				/* Slots: [3] 0 queries the layout, 1 commits slot [4] holding size [8..11]
+				   bytes with CRC [12..15] so that it is booted from the next reset on */
+				uint32_t active = activeSlot();
+
+				report[0] = 'V';
+				report[1] = 'C';
+				report[2] = 0x09;
+				report[3] = 0;
+				if (pageData[3] == 1) {
+					uint32_t slot = pageData[4];
+					uint32_t size = pageData[8] | (pageData[9] << 8) | (pageData[10] << 16) | ((uint32_t)pageData[11] << 24);
+					uint32_t crc = pageData[12] | (pageData[13] << 8) | (pageData[14] << 16) | ((uint32_t)pageData[15] << 24);
+
+					int valid = slotValid(slot, size, crc);
+
+					if (valid && slot != active) {
+						HIDUSB_CommitSlot(slot, size, crc);
+						active = activeSlot();
 					}
-					break;
-				case 0x03:
-					/* Reboot */
-					NVIC_SystemReset();
-					break;
-				case 0x04:
-					/* set insecure so that on first boot we can restore layout */
-					setInsecureFlag();
-					break;
-				default:
-					break;
+					report[3] = !valid || active != slot;
 				}
+				report[4] = active;
+				report[5] = 2;
+				report[6] = 0;
+				report[7] = 0;
+				HIDUSB_PutU32(&report[8], slotBase(0));
+				HIDUSB_PutU32(&report[12], slotBase(1));
+				HIDUSB_PutU32(&report[16], slotSize());
+				HIDUSB_SendReport(20);
+				break;
 			}
-		}
-	} else if (state == STATE_FLASH) {
-		for (size_t i = 0; i < 8; ++i)
-			pageData[currentPageOffset + i] = data[i];
-		currentPageOffset += 8;
+#endif
+#if BL_STATS
+			case 0x0A: {
+				/* Performance counters, reset after reading when [3] bit 0 is set */
+				const uint32_t *counters = (const uint32_t *) &blStats;
+
+				report[0] = 'V';
+				report[1] = 'C';
+				report[2] = 0x0A;
+				report[3] = sizeof(blStats) / sizeof(uint32_t);
+				for (size_t i = 0; i < sizeof(blStats) / sizeof(uint32_t); ++i)
+					HIDUSB_PutU32(&report[4 + 4 * i], counters[i]);
+				HIDUSB_PutU32(&report[4 + sizeof(blStats)], SystemCoreClock);
+				HIDUSB_SendReport(8 + sizeof(blStats));
+				if (pageData[3] & 0x01)
+					for (size_t i = 0; i < sizeof(blStats); ++i)
+						((uint8_t *) &blStats)[i] = 0;
+				break;
+			}
+#endif
+#if BL_LAUNCH
+			case 0x0B: {
+				/* Launch: start the application without a system reset. [4..7] is the size of the
+				   image and [8..11] its CRC, a size of 0 only checks there is an application.
+				   [3] of the answer is 0 when it is being started, which the main loop does once
+				   the answer is out. */
+				uint32_t base = USER_PROGRAM;
+				uint32_t size = pageData[4] | (pageData[5] << 8) | (pageData[6] << 16) | ((uint32_t)pageData[7] << 24);
+				uint32_t crc = pageData[8] | (pageData[9] << 8) | (pageData[10] << 16) | ((uint32_t)pageData[11] << 24);
+
+#if BL_AB_SLOTS
+				base = slotBase(activeSlot());
+#endif
+				report[0] = 'V';
+				report[1] = 'C';
+				report[2] = 0x0B;
+				report[3] = checkUserCode(base) || size > FLASH_BASE + flashSize - base ||
+					(size && flashCRC((const uint8_t *) base, size) != crc);
+				HIDUSB_SendReport(4);
+				if (report[3])
+					STATS_ADD(protocolErrors, 1);
+				else
+					HIDUSB_LaunchBase = base;
+				break;
+			}
+#endif
+#if BL_STATS
+			case 0x0C: {
+				/* Packet memory copy cost: [3] copies of 64 bytes each way, [4..7] the cycles
+				   copying out of the packet memory took, [8..11] into it from a halfword aligned
+				   buffer and [12..15] into it from an odd address */
+				uint16_t scratch[33];
+				uint32_t start, cycles[3] = {0, 0, 0};
+
+				for (uint8_t i = 0; i < PMA_BENCH_ROUNDS; ++i) {
+					start = STATS_NOW();
+					USB_CopyFromPMA(scratch, PMA_SCRATCH_ADDR, 64);
+					cycles[0] += STATS_NOW() - start;
+					start = STATS_NOW();
+					USB_CopyToPMA(PMA_SCRATCH_ADDR, scratch, 64);
+					cycles[1] += STATS_NOW() - start;
+					start = STATS_NOW();
+					USB_CopyToPMA(PMA_SCRATCH_ADDR, (const uint8_t *) scratch + 1, 64);
+					cycles[2] += STATS_NOW() - start;
+				}
 
-		/* Flashing */
-		if (currentPageOffset == sizeof(pageData)) {
-			/* Received another page */
-			uint32_t pageAddress = USER_PROGRAM + (currentPage * sizeof(pageData));
-
-			HIDUSB_FlashUnlock();
-			/* If we're at page boundary, we have to erase this page */
-			if ((pageAddress & 0x3FF) == 0)
-				HIDUSB_FormatFlashPage(pageAddress);
-			/* Then proceed to write the data */
-			HIDUSB_WriteFlash(pageAddress, pageData, sizeof(pageData));
-			HIDUSB_FlashLock();
-
-			currentPage++;
-			currentPageOffset = 0;
+				report[0] = 'V';
+				report[1] = 'C';
+				report[2] = 0x0C;
+				report[3] = PMA_BENCH_ROUNDS;
+				for (size_t i = 0; i < 3; ++i)
+					HIDUSB_PutU32(&report[4 + 4 * i], cycles[i]);
+				HIDUSB_SendReport(16);
+				break;
+			}
+#endif
+#if BL_IDLE_BOOT_MS
+			case 0x0D:
+				/* Stay: don't boot the application for being idle until the next reset. No answer */
+				stayInBootloader = 1;
+				break;
+#endif
+			default:
+				STATS_ADD(protocolErrors, 1);
+				break;
+			}
+		} else {
+			STATS_ADD(protocolErrors, 1);
 		}
+	} else if (state == STATE_FLASH) {
+		/* Received another page */
+		uint32_t pageAddress = USER_PROGRAM + (currentPage * sizeof(pageData));
+
+#if BL_ERASE_AHEAD && BL_FLASH_ASYNC
+		/* a host that didn't wait for the erasing to be done gets its data queued behind it */
+		HIDUSB_QueueErases(1);
+#endif
+
+		/* If we're at page boundary, we have to erase this page (unless it already was) */
+		if ((pageAddress & (flashPageSize - 1)) == 0 && !erasedAhead)
+			flashErase(pageAddress, HIDUSB_FlashResult, 0);
+#if BL_RESUME
+		/* Then queue the data, the checkpoint moves on once it is written */
+		flashProgram(pageAddress, pageData, sizeof(pageData), HIDUSB_PageWritten, currentPage + 1);
+#else
+		flashProgram(pageAddress, pageData, sizeof(pageData), HIDUSB_FlashResult, 0);
+#endif
+
+		currentPage++;
 
 		/* Did we flash everything? */
 		if (currentPage == pagesToFlash) {
 			/* Back to processing commands */
 			state = STATE_INIT;
 		}
+#if BL_DELTA
+	} else if (state == STATE_PATCH) {
+		for (size_t i = 0; i < sizeof(pageData) && !patch.error; ++i)
+			HIDUSB_PatchByte(pageData[i]);
+
+		if (--patch.reports == 0) {
+			/* Program what's left and report the outcome with the CRC of the new image */
+			if (!patch.error && (patch.out != patch.end || patch.insert || patch.argc))
+				patch.error = PATCH_ERR_SIZE;
+			if (!patch.error && (patch.out & (flashPageSize - 1)))
+				HIDUSB_PatchFlush();
+			if (!patch.error)
+				flashProgram(USER_PROGRAM, patchHead, sizeof(patchHead), HIDUSB_FlashResult, 0);
+			flashWait();
+			if (!patch.error && sessionFlashError)
+				patch.error = PATCH_ERR_FLASH;
+
+			report[0] = 'V';
+			report[1] = 'C';
+			report[2] = 0x08;
+			report[3] = patch.error;
+			if (patch.error)
+				STATS_ADD(protocolErrors, 1);
+			HIDUSB_PutU32(&report[4], flashCRC((const uint8_t *) USER_PROGRAM, patch.end));
+			HIDUSB_SendReport(8);
+			state = STATE_INIT;
+		}
+#endif
 	}
 }
 
+/* Collect incoming data into 64-byte reports, whichever way it arrives: 8 bytes at
+   a time through SET_REPORT on the control endpoint or whole reports on EP2 */
+void HIDUSB_HandleData(const uint8_t *data, uint16_t length) {
+#if BL_TIMERS
+	idleMs = 0;
+#endif
+
+	while (length--) {
+		pageData[currentPageOffset++] = *data++;
+
+		if (currentPageOffset == sizeof(pageData)) {
+			currentPageOffset = 0;
+			HIDUSB_HandleReport();
+		}
+	}
+}
+
+#if BL_TICK
+/* Called from SysTick, which has the USB interrupt's priority so neither can preempt the
+   other and the protocol state is safe to touch here */
+void HIDUSB_Tick(void) {
+#if BL_ERASE_AHEAD && BL_FLASH_ASYNC
+	if (eraseAhead.active) {
+		HIDUSB_EraseAheadTick();
+#if BL_TIMERS
+		/* the host is waiting on us */
+		idleMs = 0;
+#endif
+	}
+#endif
+
+#if BL_TIMERS
+	if (idleMs != UINT32_MAX)
+		++idleMs;
+#endif
+
+#if BL_SESSION_TIMEOUT_MS
+	/* The host went away mid-session */
+	if (state != STATE_INIT && idleMs >= BL_SESSION_TIMEOUT_MS) {
+		HIDUSB_DropSession();
+		STATS_ADD(sessionTimeouts, 1);
+	}
+#endif
+
+#if BL_IDLE_BOOT_MS
+	/* Not after a session was given up on or failed: the application may be half written,
+	   only the launch command checks it against a CRC */
+	uint8_t failed = sessionFlashError;
+
+#if BL_DELTA
+	failed |= patch.error;
+#endif
+	if (state == STATE_INIT && idleMs == BL_IDLE_BOOT_MS && abandonedState == STATE_INIT && !failed &&
+			!stayInBootloader) {
+		uint32_t base = USER_PROGRAM;
+
+#if BL_AB_SLOTS
+		base = slotBase(activeSlot());
+#endif
+		/* Nothing to boot keeps the bootloader waiting for a host */
+		if (!checkUserCode(base)) {
+#if BL_LAUNCH
+			HIDUSB_LaunchBase = base;
+#else
+			/* The bootloader flag was cleared on the way in, so the reset ends up in the application */
+			NVIC_SystemReset();
+#endif
+		}
+	}
+#endif
+}
+#endif
+
 void HIDUSB_EPHandler(uint16_t Status) {
 
 	uint8_t EPn = Status & USB_ISTR_EP_ID;
 	uint16_t EP = _GetENDPOINT(EPn);
 
+	// Output reports on EP2 (or bulk EP3): take the packet and hand the buffer straight back
+	if (EPn == ENDP2 || EPn == ENDP3) {
+		if (EP & EP_CTR_RX) {
+			_ClearEP_CTR_RX(EPn);
+#if BL_DBL_BUF
+			USB_DblBufPMA2Buffer(EPn);
+#else
+			USB_PMA2Buffer(EPn);
+			_SetEPRxValid(EPn);
+#endif
+			replyEP = EPn == ENDP3 ? ENDP4 : ENDP1;
+			STATS_ADD(packets[EPn - 1], 1);
+			HIDUSB_HandleData((uint8_t *) RxTxBuffer[EPn].RXB, RxTxBuffer[EPn].RXL);
+			/* the host got the next packet in while this one was being handled */
+			if (_GetENDPOINT(EPn) & EP_CTR_RX)
+				STATS_ADD(waiting, 1);
+		}
+		return;
+	}
+
 	// OUT and SETUP packets (data reception)
 	if (EP & EP_CTR_RX) {
 
@@ -362,7 +1187,16 @@ void HIDUSB_EPHandler(uint16_t Status) {
 					break;
 
 				case USB_REQUEST_SET_CONFIGURATION:
-					DeviceConfigured = 1;
+					/* SET_REPORT has the same request code. The feature report is the host
+					   calling off the session: it comes in on the control endpoint, where
+					   nothing mistakes it for data of the session */
+					if ((SetupPacket->bmRequestType & USB_REQUEST_TYPE_MASK) == USB_REQUEST_TYPE_CLASS &&
+							SetupPacket->wValue.H == HID_REPORT_TYPE_FEATURE) {
+						HIDUSB_DropSession();
+						controlDiscard = SetupPacket->wLength;
+					} else {
+						DeviceConfigured = 1;
+					}
 					USB_SendData(0, 0, 0);
 					break;
 
@@ -370,6 +1204,22 @@ void HIDUSB_EPHandler(uint16_t Status) {
 					USB_SendData(0, 0, 0);
 					break;
 
+#if BL_VENDOR_INTERFACE
+				case MS_VENDOR_CODE:
+					/* The vendor request string 0xEE names, the extended compat ID is the only
+					   descriptor it is asked for */
+					if ((SetupPacket->bmRequestType & USB_REQUEST_TYPE_MASK) == USB_REQUEST_TYPE_VENDOR &&
+							SetupPacket->wIndex.L == (MS_EXTENDED_COMPAT_ID & 0xFF) && SetupPacket->wIndex.H == 0) {
+						USB_SendData(0, msExtendedCompatID,
+								SetupPacket->wLength > sizeof(msExtendedCompatID) ?
+										sizeof(msExtendedCompatID) : SetupPacket->wLength);
+					} else {
+						USB_SendData(0, 0, 0);
+						_SetEPTxStatus(0, EP_TX_STALL);
+					}
+					break;
+#endif
+
 				default:
 					USB_SendData(0, 0, 0);
 					_SetEPTxStatus(0, EP_TX_STALL);
@@ -377,8 +1227,12 @@ void HIDUSB_EPHandler(uint16_t Status) {
 				}
 
 			} else { // OUT packet
-				if(RxTxBuffer[EPn].RXL) {
-					HIDUSB_HandleData((uint8_t *) RxTxBuffer[EPn].RXB);
+				if (controlDiscard) {
+					controlDiscard -= RxTxBuffer[EPn].RXL < controlDiscard ? RxTxBuffer[EPn].RXL : controlDiscard;
+				} else if(RxTxBuffer[EPn].RXL) {
+					replyEP = ENDP1;
+					STATS_ADD(packets[0], 1);
+					HIDUSB_HandleData((uint8_t *) RxTxBuffer[EPn].RXB, RxTxBuffer[EPn].RXL);
 				}
 			}
 
@@ -407,8 +1261,9 @@ void HIDUSB_EPHandler(uint16_t Status) {
 		_SetEPTxValid(EPn);
 		_ClearEP_CTR_TX(EPn);
 
-		if (EPn == ENDP1) {
-			_SetEPTxStatus(ENDP1, EP_TX_NAK);
+		// Nothing further to say on the report endpoints until the next command
+		if (EPn != ENDP0) {
+			_SetEPTxStatus(EPn, EP_TX_NAK);
 		}
 	}
 }
@@ -21,8 +21,18 @@
 
 void HIDUSB_Reset();
 void HIDUSB_EPHandler(uint16_t Status);
+void HIDUSB_HandleData(const uint8_t *data, uint16_t length);
 
 __attribute__((weak)) void HIDUSB_DataReceivedHandler(uint16_t *Data,
 		uint16_t Length);
 
+/* Set to the application to start by the launch command */
+extern volatile uint32_t HIDUSB_LaunchBase;
+
+/* Wait up to Ms milliseconds for the host to pick up the last answer */
+void HIDUSB_WaitReplySent(uint32_t Ms);
+
+/* Advance the session and idle timers, and erasing ahead, by a millisecond */
+void HIDUSB_Tick(void);
+
 #endif /* HID_H_ */
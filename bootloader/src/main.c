@@ -17,7 +17,6 @@
  */
 
 #include <stm32f1xx.h>
-#include <stm32f1xx_ll_system.h>
 #include <stm32f1xx_ll_rcc.h>
 #include <stm32f1xx_ll_utils.h>
 
@@ -26,11 +25,13 @@
 #include "bitwise.h"
 #include "config.h"
 #include "boot.h"
+#include "flash.h"
+#include "stats.h"
 
 typedef void (*funct_ptr)(void);
 
-int want_bootloader(void) {
-	return checkAndClearBootloaderFlag() || checkUserCode() || checkKbMatrix();
+int want_bootloader(uint32_t userProgram) {
+	return checkAndClearBootloaderFlag() || checkUserCode(userProgram) || checkKbMatrix();
 }
 
 /**
@@ -50,59 +51,182 @@ int want_bootloader(void) {
   */
 void SystemClock_Config(void)
 {
-	/* Set FLASH latency */
-	LL_FLASH_SetLatency(LL_FLASH_LATENCY_2);
+	/* Set FLASH latency, keeping the prefetch buffer on */
+	FLASH->ACR = FLASH_ACR_PRFTBE | FLASH_ACR_LATENCY_1;
 
 	/* Enable HSE oscillator */
-	LL_RCC_HSE_Enable();
-	while(LL_RCC_HSE_IsReady() != 1)
+	RCC->CR |= RCC_CR_HSEON;
+	while(!(RCC->CR & RCC_CR_HSERDY))
 	{
 	};
 
-	/* Main PLL configuration and activation */
-	LL_RCC_PLL_ConfigDomain_SYS(LL_RCC_PLLSOURCE_HSE_DIV_1, LL_RCC_PLL_MUL_9);
-
-	LL_RCC_PLL_Enable();
-	while(LL_RCC_PLL_IsReady() != 1)
+	/* Main PLL configuration and activation, with the APB1 prescaler. USB takes the PLL
+	   divided by 1.5 out of reset, 48MHz */
+	RCC->CFGR = RCC_CFGR_PLLSRC | RCC_CFGR_PLLMULL9 | RCC_CFGR_PPRE1_DIV2;
+	RCC->CR |= RCC_CR_PLLON;
+	while(!(RCC->CR & RCC_CR_PLLRDY))
 	{
 	};
 
 	/* Sysclk activation on the main PLL */
-	LL_RCC_SetAHBPrescaler(LL_RCC_SYSCLK_DIV_1);
-	LL_RCC_SetSysClkSource(LL_RCC_SYS_CLKSOURCE_PLL);
-	while(LL_RCC_GetSysClkSource() != LL_RCC_SYS_CLKSOURCE_STATUS_PLL)
+	RCC->CFGR |= RCC_CFGR_SW_PLL;
+	while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL)
 	{
 	};
 
-	/* Set APB1 & APB2 prescaler*/
-	LL_RCC_SetAPB1Prescaler(LL_RCC_APB1_DIV_2);
-	LL_RCC_SetAPB2Prescaler(LL_RCC_APB2_DIV_1);
-
-	/* Set systick to 1ms in using frequency set to 72MHz */
-	LL_Init1msTick(72000000);
+#if BL_SYSTICK
+	/* Set systick to 1ms at 72MHz, for delays and timeouts and, with its interrupt on, the tick */
+	SysTick->LOAD = 72000000 / 1000 - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+#endif
 
 	/* Update CMSIS variable (which can be updated also through SystemCoreClockUpdate function) */
-	LL_SetSystemCoreClock(72000000);
+	SystemCoreClock = 72000000;
+}
+
+#if BL_LAUNCH
+/* how long D+ is held low after USB is shut down, for the host to see the device go */
+#define LAUNCH_DETACH_MS 10
+/* how long the host gets to pick up the launch command's answer */
+#define LAUNCH_REPLY_WAIT_MS 50
+
+/* Undo SystemClock_Config: back to the HSI with the PLL and HSE off, no prescalers and
+   no flash wait states, the way the application finds the clocks out of reset */
+static void SystemClock_Revert(void)
+{
+	RCC->CR |= RCC_CR_HSION;
+	while(!(RCC->CR & RCC_CR_HSIRDY))
+	{
+	};
+
+	RCC->CFGR &= ~RCC_CFGR_SW;
+	while((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI)
+	{
+	};
+
+	RCC->CR &= ~(RCC_CR_PLLON | RCC_CR_HSEON);
+	RCC->CFGR = 0;
+	FLASH->ACR = FLASH_ACR_PRFTBE;
+
+	SysTick->CTRL = 0;
+	SysTick->LOAD = 0;
+	SysTick->VAL = 0;
+
+	SystemCoreClock = HSI_VALUE;
 }
+#endif
+
+#if BL_TICK
+void SysTick_Handler() {
+	HIDUSB_Tick();
+}
+#endif
+
+static void jumpToApplication(uint32_t userProgram) {
+	uint32_t usrSp = *(volatile uint32_t *)userProgram;
+	uint32_t usrMain = *(volatile uint32_t *)(userProgram + 0x04); /* reset ptr in vector table */
+
+	SCB->VTOR = userProgram;
+
+	__asm__ volatile(
+		"msr msp, %0\n"
+		"bx %1\n"
+		:: "r" (usrSp), "r" (usrMain));
+}
+
+#if BL_LAUNCH
+/* Start the application the launch command accepted, leaving everything the way a reset
+   would so it doesn't have to go through the bootloader again */
+static void launchApplication(uint32_t userProgram) {
+	/* let the host pick up the answer first, on whichever interface it asked on */
+	HIDUSB_WaitReplySent(LAUNCH_REPLY_WAIT_MS);
+
+	USB_Shutdown();
+	LL_mDelay(LAUNCH_DETACH_MS);
+
+	/* GPIO ports, AFIO and USB back to their reset state with their clocks off, which
+	   releases D+ for the application to connect */
+	RCC->APB2RSTR = RCC_APB2RSTR_AFIORST | RCC_APB2RSTR_IOPARST | RCC_APB2RSTR_IOPBRST |
+		RCC_APB2RSTR_IOPCRST | RCC_APB2RSTR_IOPDRST
+#ifdef RCC_APB2RSTR_IOPERST
+		| RCC_APB2RSTR_IOPERST
+#endif
+#ifdef RCC_APB2RSTR_IOPGRST
+		| RCC_APB2RSTR_IOPFRST | RCC_APB2RSTR_IOPGRST
+#endif
+		;
+	RCC->APB2RSTR = 0;
+	RCC->APB1RSTR = RCC_APB1RSTR_USBRST;
+	RCC->APB1RSTR = 0;
+	RCC->APB2ENR = 0;
+	RCC->APB1ENR = 0;
+
+	/* no interrupt may be left enabled or pending for the application's vector table */
+	for (unsigned i = 0; i < sizeof(NVIC->ICER) / sizeof(NVIC->ICER[0]); ++i) {
+		NVIC->ICER[i] = 0xFFFFFFFF;
+		NVIC->ICPR[i] = 0xFFFFFFFF;
+	}
+
+#if BL_STATS
+	DWT->CTRL &= ~DWT_CTRL_CYCCNTENA_Msk;
+	CoreDebug->DEMCR &= ~CoreDebug_DEMCR_TRCENA_Msk;
+#endif
+
+	SystemClock_Revert();
+	SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+
+	jumpToApplication(userProgram);
+}
+#endif
 
 int main() {
-	uint32_t usrSp = *(volatile uint32_t *)USER_PROGRAM;
-	uint32_t usrMain = *(volatile uint32_t *)(USER_PROGRAM + 0x04); /* reset ptr in vector table */
+	uint32_t userProgram = USER_PROGRAM;
 
 	SystemClock_Config();
 
 	setupGPIO();
 
-	if(want_bootloader()) {
+#if BL_FLASH_GEOMETRY
+	detectFlashGeometry();
+#endif
+
+#if BL_AB_SLOTS
+	userProgram = slotBase(activeSlot());
+#endif
+
+	if(want_bootloader(userProgram)) {
+		statsInit();
+#if BL_FLASH_ASYNC
+		/* USB and SysTick share a priority below the FLASH interrupt's */
+		NVIC_SetPriority(USB_LP_CAN1_RX0_IRQn, 1);
+		NVIC_SetPriority(USB_HP_CAN1_TX_IRQn, 1);
+		NVIC_SetPriority(SysTick_IRQn, 1);
+#endif
+		flashInit();
 		USB_Init(HIDUSB_EPHandler, HIDUSB_Reset);
+#if BL_TICK
+		SysTick->CTRL |= SysTick_CTRL_TICKINT_Msk;
+#endif
 	} else {
-		SCB->VTOR = USER_PROGRAM;
-
-		__asm__ volatile(
-			"msr msp, %0\n"
-			"bx %1\n"
-			:: "r" (usrSp), "r" (usrMain));
+		jumpToApplication(userProgram);
 	}
 
-	for(;;);
+	/* all USB and flash work happens in interrupts, the main loop only waits for a launch
+	   and sleeps in between. With interrupts masked, one that comes in after the check
+	   still wakes the WFI and is taken right after. */
+	for(;;) {
+#if BL_LAUNCH
+		if (HIDUSB_LaunchBase)
+			launchApplication(HIDUSB_LaunchBase);
+#endif
+#if BL_FLASH_ASYNC
+		__disable_irq();
+#if BL_LAUNCH
+		if (!HIDUSB_LaunchBase)
+#endif
+			__WFI();
+		__enable_irq();
+#endif
+	}
 }
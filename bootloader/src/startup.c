@@ -43,32 +43,11 @@ __attribute__ ((weak, alias ("Default_Handler"))) int DMA1_Channel7_IRQHandler()
 __attribute__ ((weak, alias ("Default_Handler"))) int ADC1_2_IRQHandler();
 __attribute__ ((weak, alias ("Default_Handler"))) int USB_HP_CAN1_TX_IRQHandler();
 __attribute__ ((weak, alias ("Default_Handler"))) int USB_LP_CAN1_RX0_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int CAN1_RX1_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int CAN1_SCE_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int EXTI9_5_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM1_BRK_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM1_UP_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM1_TRG_COM_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM1_CC_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM2_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM3_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int TIM4_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int I2C1_EV_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int I2C1_ER_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int I2C2_EV_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int I2C2_ER_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int SPI1_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int SPI2_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int USART1_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int USART2_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int USART3_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int EXTI15_10_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int RTCAlarm_IRQHandler();
-__attribute__ ((weak, alias ("Default_Handler"))) int USBWakeUp_IRQHandler();
 
 /******************************************************************************
 *
-* The minimal vector table for a Cortex M3.  Note that the proper constructs
+* The minimal vector table for a Cortex M3, up to the USB interrupts: nothing
+* past them is ever enabled.  Note that the proper constructs
 * must be placed on this to ensure that it ends up at physical address
 * 0x0000.0000.
 *
@@ -111,28 +90,4 @@ static void* g_pfnVectors[] __attribute__((used, section (".isr_vector"))) = {
 	ADC1_2_IRQHandler,
 	USB_HP_CAN1_TX_IRQHandler,
 	USB_LP_CAN1_RX0_IRQHandler,
-	CAN1_RX1_IRQHandler,
-	CAN1_SCE_IRQHandler,
-	EXTI9_5_IRQHandler,
-	TIM1_BRK_IRQHandler,
-	TIM1_UP_IRQHandler,
-	TIM1_TRG_COM_IRQHandler,
-	TIM1_CC_IRQHandler,
-	TIM2_IRQHandler,
-	TIM3_IRQHandler,
-	TIM4_IRQHandler,
-	I2C1_EV_IRQHandler,
-	I2C1_ER_IRQHandler,
-	I2C2_EV_IRQHandler,
-	I2C2_ER_IRQHandler,
-	SPI1_IRQHandler,
-	SPI2_IRQHandler,
-	USART1_IRQHandler,
-	USART2_IRQHandler,
-	USART3_IRQHandler,
-	EXTI15_10_IRQHandler,
-	RTCAlarm_IRQHandler,
-	USBWakeUp_IRQHandler,
-	(void*)0xF108F85F          /* @0x108. This is for boot in RAM mode for
-				STM32F10x Medium Density devices. */
 };
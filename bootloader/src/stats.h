@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stm32f1xx.h>
+
+#include "config.h"
+
+#if BL_STATS
+/* Counters kept since power-up or the last read that asked for a reset, returned by the
+   stats command in this order, which cli/protocol.h mirrors as STAT_*. Cycle counts come
+   from the DWT cycle counter at the core clock. */
+struct blStats {
+	uint32_t packets[3];        /* packets received on EP0 (SET_REPORT data), EP2 and EP3 */
+	uint32_t waiting;           /* packets already queued when the one before was done with;
+	                               once both buffers hold one the host is NAKed */
+	uint32_t errors;            /* transaction errors, each one retried by the host */
+	uint32_t programmed;        /* bytes written to flash */
+	uint32_t erases;            /* flash pages erased */
+	uint32_t flashBusy;         /* cycles erases and programming took */
+	uint32_t flashBusyMax;      /* longest single erase or programming of up to 64 bytes */
+	uint32_t isrMax;            /* longest USB interrupt, flash work included */
+	uint32_t isrTotal;
+	uint32_t protocolErrors;    /* reports that were ignored or commands that were refused */
+	uint32_t sessionTimeouts;   /* flash or patch sessions given up on, the host gone quiet */
+	uint32_t flashErrors;       /* erases and programming that failed */
+};
+
+extern struct blStats blStats;
+
+#define STATS_NOW() (DWT->CYCCNT)
+#define STATS_ADD(field, n) (blStats.field += (n))
+#define STATS_MAX(field, n) do { uint32_t value_ = (n); if (value_ > blStats.field) blStats.field = value_; } while (0)
+
+static inline void statsInit(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+#else
+#define STATS_NOW() 0
+#define STATS_ADD(field, n) ((void) (n))
+#define STATS_MAX(field, n) ((void) (n))
+
+static inline void statsInit(void) {}
+#endif
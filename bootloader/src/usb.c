@@ -21,6 +21,7 @@
 
 #include "usb.h"
 #include "bitwise.h"
+#include "stats.h"
 
 USB_RxTxBuf_t RxTxBuffer[MAX_EP_NUM];
 
@@ -49,36 +50,134 @@ const uint8_t sdLangID[] = {
 		0x09, 0x04
 };
 
+/* The packet memory is 16 bits wide but mapped with a 32-bit stride: halfword n of a
+   buffer lives at PMAAddr + 4 * n and the upper half of every word is unused. Offsets
+   are in packet memory bytes, the way the buffer descriptor table stores them. */
+
+/* Copy Count bytes out of the packet memory, rounded up to whole halfwords */
+void USB_CopyFromPMA(uint16_t *Destination, uint16_t Offset, uint16_t Count) {
+	const volatile uint32_t *Source = (const volatile uint32_t *) (PMAAddr + Offset * 2);
+	uint16_t Words = (Count + 1) / 2;
+
+#if BL_FULL
+	for (; Words >= 4; Words -= 4) {
+		Destination[0] = Source[0];
+		Destination[1] = Source[1];
+		Destination[2] = Source[2];
+		Destination[3] = Source[3];
+		Destination += 4;
+		Source += 4;
+	}
+#endif
+
+	while (Words--) {
+		*Destination++ = *Source++;
+	}
+}
+
+/* Copy Count bytes into the packet memory, rounded up to whole halfwords */
+void USB_CopyToPMA(uint16_t Offset, const void *Data, uint16_t Count) {
+	volatile uint32_t *Destination = (volatile uint32_t *) (PMAAddr + Offset * 2);
+	uint16_t Words = (Count + 1) / 2;
+	const uint8_t *Source = Data;
+
+#if BL_FULL
+	if (((uintptr_t) Data & 1) == 0) {
+		/* halfword aligned source, move it as is */
+		const uint16_t *Aligned = Data;
+
+		for (; Words >= 4; Words -= 4) {
+			Destination[0] = Aligned[0];
+			Destination[1] = Aligned[1];
+			Destination[2] = Aligned[2];
+			Destination[3] = Aligned[3];
+			Destination += 4;
+			Aligned += 4;
+		}
+
+		while (Words--) {
+			*Destination++ = *Aligned++;
+		}
+		return;
+	}
+#endif
+
+	/* only the full build unrolls, the others take every source this way */
+	while (Words--) {
+		*Destination++ = Source[0] | (Source[1] << 8);
+		Source += 2;
+	}
+}
+
 void USB_PMA2Buffer(uint8_t EPn) {
 	uint8_t Count = RxTxBuffer[EPn].RXL = (_GetEPRxCount(EPn) & 0x3FF);
-	uint32_t *Address = (uint32_t *) (PMAAddr + _GetEPRxAddr(EPn) * 2);
-	uint16_t *Destination = (uint16_t *) RxTxBuffer[EPn].RXB;
 
-	for (uint8_t i = 0; i < Count; i++) {
-		*(uint16_t *) Destination = *(uint16_t *) Address;
-		Destination++;
-		Address++;
-	}
+	USB_CopyFromPMA(RxTxBuffer[EPn].RXB, _GetEPRxAddr(EPn), Count);
 }
 
 void USB_Buffer2PMA(uint8_t EPn) {
-	uint32_t *Destination;
 	uint8_t Count;
 
 	Count = RxTxBuffer[EPn].TXL <= RxTxBuffer[EPn].MaxPacketSize ? RxTxBuffer[EPn].TXL : RxTxBuffer[EPn].MaxPacketSize;
 	_SetEPTxCount(EPn, Count);
 
-	Destination = (uint32_t *) (PMAAddr + _GetEPTxAddr(EPn) * 2);
+	USB_CopyToPMA(_GetEPTxAddr(EPn), RxTxBuffer[EPn].TXB, Count);
 
-	for (uint8_t i = 0; i < (Count + 1) / 2; i++) {
-		const uint8_t *buf = RxTxBuffer[EPn].TXB;
-		uint16_t tmp = buf[0] | (buf[1] << 8);
-		*(uint32_t *) Destination = tmp;
-		Destination++;
-		RxTxBuffer[EPn].TXB = buf + 2;
+	RxTxBuffer[EPn].TXB = (const uint8_t *) RxTxBuffer[EPn].TXB + Count;
+	RxTxBuffer[EPn].TXL -= Count;
+}
+
+/* Turn EPn into a double-buffered OUT endpoint with two Size byte buffers. The
+   hardware only double-buffers bulk endpoints, but on the wire bulk and interrupt
+   transfers look the same, so this also serves endpoints described as interrupt. */
+void USB_SetupDblBufOut(uint8_t EPn, uint16_t Buf0Addr, uint16_t Buf1Addr, uint16_t Size) {
+	_SetEPType(EPn, EP_BULK);
+	_SetEPDoubleBuff(EPn);
+	_SetEPDblBuffAddr(EPn, Buf0Addr, Buf1Addr);
+	_SetEPDblBuffCount(EPn, EP_DBUF_OUT, Size);
+
+	/* The hardware fills the buffer selected by DTOG_RX, the application owns the one
+	   selected by SW_BUF (DTOG_TX), and the endpoint NAKs while the two are equal. Start
+	   with the hardware on buffer 0.
+
+	   ST's Cube HAL clears both bits instead, which lets the hardware take two packets
+	   before the application got to the first. Both would then be behind a single
+	   CTR_RX and the second one only noticed once a third arrived. Starting SW_BUF off
+	   opposite DTOG_RX NAKs the host after every packet until USB_DblBufPMA2Buffer has
+	   copied it out, so each packet raises its own CTR_RX and the one just filled is
+	   always the buffer SW_BUF doesn't select. The copy hands the buffer straight back,
+	   so the next packet still comes in while this one is being handled. */
+	_ClearDTOG_RX(EPn);
+	_ClearDTOG_TX(EPn);
+	_ToggleDTOG_TX(EPn);
+
+	_SetEPRxStatus(EPn, EP_RX_VALID);
+	_SetEPTxStatus(EPn, EP_TX_DIS);
+}
+
+/* Copy the packet the hardware just completed on a double-buffered OUT endpoint into
+   RxTxBuffer[EPn].RXB and hand its buffer straight back, so that the next packet can
+   be accepted while this one is being processed */
+void USB_DblBufPMA2Buffer(uint8_t EPn) {
+	uint16_t Addr, Count;
+
+	if (_GetENDPOINT(EPn) & EP_DTOG_TX) {
+		Addr = _GetEPDblBuf0Addr(EPn);
+		Count = _GetEPDblBuf0Count(EPn);
+	} else {
+		Addr = _GetEPDblBuf1Addr(EPn);
+		Count = _GetEPDblBuf1Count(EPn);
 	}
 
-	RxTxBuffer[EPn].TXL -= Count;
+	RxTxBuffer[EPn].RXL = Count;
+	USB_CopyFromPMA(RxTxBuffer[EPn].RXB, Addr, Count);
+
+	USB_FreeDblBuf(EPn);
+}
+
+/* Give the application's buffer of a double-buffered OUT endpoint back to the hardware */
+void USB_FreeDblBuf(uint8_t EPn) {
+	_ToggleDTOG_TX(EPn);
 }
 
 void USB_SendData(uint8_t EPn, const void *Data, uint16_t Length) {
@@ -100,11 +199,24 @@ void USB_SendData(uint8_t EPn, const void *Data, uint16_t Length) {
 	_SetEPTxValid(EPn);
 }
 
+/* Wait up to Ms milliseconds for the host to pick up what is waiting on IN endpoint EPn.
+   Counts SysTick wraps rather than its interrupts, so this works inside an interrupt too */
+void USB_WaitSent(uint8_t EPn, uint32_t Ms) {
+	/* reading COUNTFLAG clears it, start from the next wrap */
+	(void) SysTick->CTRL;
+
+	while (Ms && _GetEPTxStatus(EPn) == EP_TX_VALID) {
+		if (SysTick->CTRL & SysTick_CTRL_COUNTFLAG_Msk)
+			--Ms;
+	}
+}
+
 void USB_Shutdown() {
 	bit_set(RCC->APB2ENR, RCC_APB2ENR_IOPAEN);
 
 	// Disable USB IRQ
 	NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+	NVIC_DisableIRQ(USB_HP_CAN1_TX_IRQn);
 	_SetISTR(0);
 
 	DeviceConfigured = DeviceStatus = 0;
@@ -173,6 +285,7 @@ void USB_Init(void (*EPHandlerPtr)(uint16_t), void (*ResetHandlerPtr)(void)) {
 
 	bit_set(RCC->APB1ENR, RCC_APB1ENR_USBEN);
 	NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+	NVIC_EnableIRQ(USB_HP_CAN1_TX_IRQn);
 
 	/*** CNTR_PWDN = 0 ***/
 	_SetCNTR(CNTR_FRES);
@@ -192,76 +305,85 @@ void USB_Init(void (*EPHandlerPtr)(uint16_t), void (*ResetHandlerPtr)(void)) {
 	_SetISTR(0);
 
 	/*** Set interrupt mask ***/
-	_SetCNTR(CNTR_CTRM | CNTR_RESETM | CNTR_SUSPM | CNTR_WKUPM);
+	_SetCNTR(CNTR_CTRM | CNTR_RESETM | CNTR_SUSPM | CNTR_WKUPM | (BL_STATS ? CNTR_ERRM : 0));
 }
 
 uint16_t USB_IsDeviceConfigured() {
 	return DeviceConfigured;
 }
 
+/* Serve every pending correct transfer before returning, so that back-to-back
+   transactions on different endpoints don't each pay for an exception entry */
+static void USB_DrainCTR(void) {
+	uint16_t istr;
+
+#if BL_DRAIN_CTR
+	while ((istr = _GetISTR()) & ISTR_CTR) {
+		_EPHandler(istr);
+	}
+#else
+	// One transfer, the interrupt is taken again for the next one
+	if ((istr = _GetISTR()) & ISTR_CTR) {
+		_EPHandler(istr);
+	}
+#endif
+}
+
+/* Account for the time an interrupt took */
+static void USB_ISRDone(uint32_t start) {
+	uint32_t cycles = STATS_NOW() - start;
+
+	STATS_ADD(isrTotal, cycles);
+	STATS_MAX(isrMax, cycles);
+}
+
 void USB_LP_CAN1_RX0_IRQHandler() {
-	// Handle Reset
-	if (_GetISTR() & ISTR_RESET) {
-		_SetISTR(_GetISTR() & CLR_RESET);
+	uint32_t start = STATS_NOW();
+	uint16_t istr = _GetISTR();
+
+	// Handle Reset, anything else pending is stale after it
+	if (istr & ISTR_RESET) {
+		_SetISTR(CLR_RESET);
 		if(_USBResetHandler) {
 			_USBResetHandler();
 		}
+		USB_ISRDone(start);
 		return;
 	}
 
 	// Handle EP data
-	if (_GetISTR() & ISTR_CTR) { // Handle data on EP
-		if(_EPHandler) {
-			_EPHandler(_GetISTR());
-		}
-		_SetISTR(_GetISTR() & CLR_CTR);
-		return;
-	}
-
-	// Handle DOVR
-	if (_GetISTR() & ISTR_DOVR) {
-		_SetISTR(_GetISTR() & CLR_DOVR);
-		return;
+	if ((istr & ISTR_CTR) && _EPHandler) {
+		USB_DrainCTR();
 	}
 
 	// Handle Suspend
-	if (_GetISTR() & ISTR_SUSP) {
-		_SetISTR(_GetISTR() & CLR_SUSP);
-
+	if (istr & ISTR_SUSP) {
 		// If device address is assigned, then reset it
 		if (_GetDADDR() & 0x007f) {
 			_SetDADDR(0);
 			_SetCNTR(_GetCNTR() & ~CNTR_SUSPM);
 		}
-
-		return;
 	}
 
-	// Handle Error
-	if (_GetISTR() & ISTR_ERR) {
-		_SetISTR(_GetISTR() & CLR_ERR);
-		return;
+	// Errors are only counted, the host retries the transaction
+	if (istr & ISTR_ERR) {
+		STATS_ADD(errors, 1);
 	}
 
-	// Handle Wakeup
-	if (_GetISTR() & ISTR_WKUP) {
-		_SetISTR(_GetISTR() & CLR_WKUP);
-		return;
-	}
+	// DOVR, ERR, WKUP, SOF and ESOF need no handling. Clear the events seen on entry,
+	// writing 1 leaves the ones raised since then pending
+	_SetISTR(~(istr & (ISTR_DOVR | ISTR_ERR | ISTR_WKUP | ISTR_SUSP | ISTR_SOF | ISTR_ESOF)));
 
-	// Handle SOF
-	if (_GetISTR() & ISTR_SOF) {
-		_SetISTR(_GetISTR() & CLR_SOF);
-		return;
-	}
+	USB_ISRDone(start);
+}
 
-	// Handle ESOF
-	if (_GetISTR() & ISTR_ESOF) {
-		_SetISTR(_GetISTR() & CLR_ESOF);
-		return;
+/* Correct transfers on double-buffered bulk endpoints come in through the high priority vector */
+void USB_HP_CAN1_TX_IRQHandler() {
+	uint32_t start = STATS_NOW();
+
+	if (_EPHandler) {
+		USB_DrainCTR();
 	}
 
-	// Default to clear all interrupt flags
-	_SetISTR(0);
+	USB_ISRDone(start);
 }
-
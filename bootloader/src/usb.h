@@ -20,7 +20,7 @@
 #define USB_H_
 
 // Define here the max endpoint number for your USB device(s)
-#define MAX_EP_NUM 2
+#define MAX_EP_NUM 5
 
 // Define here the max buffer size for your USB devices(s) endpoints
 #define MAX_BUFFER_SIZE 64
@@ -52,6 +52,17 @@ extern const uint8_t sdLangID[0x04];
 #define USB_REQUEST_SET_INTERFACE		0x0B
 #define USB_REQUEST_SYNC_FRAME			0x0C
 
+/* Request types, bits 6..5 of bmRequestType */
+#define USB_REQUEST_TYPE_MASK			0x60
+#define USB_REQUEST_TYPE_STANDARD		0x00
+#define USB_REQUEST_TYPE_CLASS			0x20
+#define USB_REQUEST_TYPE_VENDOR			0x40
+
+/* HID report types, the high byte of wValue in GET_REPORT and SET_REPORT */
+#define HID_REPORT_TYPE_INPUT			0x01
+#define HID_REPORT_TYPE_OUTPUT			0x02
+#define HID_REPORT_TYPE_FEATURE			0x03
+
 /* USB Descriptor Types */
 #define USB_DEVICE_DESC_TYPE			0x01
 #define USB_CFG_DESC_TYPE			0x02
@@ -722,9 +733,15 @@ enum EP_BUF_NUM
 
 void USB_Init(void (*EPHandlerPtr)(uint16_t), void (*ResetHandlerPtr)(void));
 void USB_Shutdown();
+void USB_CopyFromPMA(uint16_t *Destination, uint16_t Offset, uint16_t Count);
+void USB_CopyToPMA(uint16_t Offset, const void *Data, uint16_t Count);
 void USB_PMA2Buffer(uint8_t EPn);
 void USB_Buffer2PMA(uint8_t EPn);
+void USB_SetupDblBufOut(uint8_t EPn, uint16_t Buf0Addr, uint16_t Buf1Addr, uint16_t Size);
+void USB_DblBufPMA2Buffer(uint8_t EPn);
+void USB_FreeDblBuf(uint8_t EPn);
 void USB_SendData(uint8_t EPn, const void *Data, uint16_t Length);
+void USB_WaitSent(uint8_t EPn, uint32_t Ms);
 uint16_t USB_IsDeviceConfigured();
 
 #endif /* USB_H_ */
@@ -0,0 +1,595 @@
+/*
+* vibl-bench, the benchmark suite of the flashing toolchain
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* nftw */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "bench.h"
+#include "flashd.h"
+#include "hidapi.h"
+#include "pacing.h"
+#include "protocol.h"
+#include "sha256.h"
+#include "util.h"
+#include "vfw.h"
+
+#ifndef _WIN32
+#define APP_BASE 0x08001000
+#define IMAGE_SIZE (60 * 1024)
+#define CHUNK_SIZE (16 * 1024)
+#define MAX_RUNS 10000
+#define MAX_SCENARIOS 10
+
+/* every this many made up hidraw nodes one is a bootloader */
+#define FAKE_BOOTLOADER_EVERY 64
+
+struct scenario {
+	const char *name;
+	long bytes;
+	int runs;
+	int failed;
+	double min, median, p99;
+};
+
+static struct {
+	char dir[32];
+	int runs;
+	int fast_runs;
+	int devices;
+	int fake_nodes;
+	char path[256];
+	char flasher[PATH_MAX];
+	uint8_t uid[8];
+	uint8_t image[IMAGE_SIZE];
+	double times[MAX_RUNS];
+	struct scenario scenarios[MAX_SCENARIOS];
+	int count;
+} bench;
+
+static void sha256(const void *data, size_t size, uint8_t *hash) {
+	SHA256_CTX ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, hash);
+}
+
+/* the path of a scratch file; a few can be in use at once */
+static const char *file_path(const char *name) {
+	static char paths[4][64];
+	static int next;
+	char *path = paths[next++ % 4];
+
+	snprintf(path, sizeof(paths[0]), "%s/%s", bench.dir, name);
+	return path;
+}
+
+static int write_file(const char *name, const void *data, size_t size) {
+	FILE *file = fopen(file_path(name), "wb");
+	int error = !file || fwrite(data, 1, size, file) != size;
+
+	if (file)
+		error |= fclose(file) != 0;
+	if (error)
+		fprintf(stderr, "Error: can't write %s\n", file_path(name));
+	return error;
+}
+
+/* run the flasher with these arguments, quietly; returns its exit status. Each run is a
+   program of its own like a real one, not a fork sharing this one's HID state */
+static int run_flasher(char **argv) {
+	int status, pid;
+
+	fflush(NULL);
+	if ((pid = fork()) < 0)
+		return -1;
+
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execv(bench.flasher, argv);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static int compare_times(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* sum up the runs timed into bench.times */
+static void record(const char *name, long bytes, int runs, int failed) {
+	struct scenario *scenario = &bench.scenarios[bench.count++];
+
+	scenario->name = name;
+	scenario->bytes = bytes;
+	scenario->runs = runs;
+	scenario->failed = failed;
+	if (failed || !runs) {
+		fprintf(stderr, "%-16s failed\n", name);
+		return;
+	}
+
+	qsort(bench.times, runs, sizeof(bench.times[0]), compare_times);
+	scenario->min = bench.times[0];
+	scenario->median = runs % 2 ? bench.times[runs / 2] : (bench.times[runs / 2 - 1] + bench.times[runs / 2]) / 2;
+	/* nearest rank */
+	scenario->p99 = bench.times[(runs * 99 + 99) / 100 - 1];
+	fprintf(stderr, "%-16s min %9.3fms  median %9.3fms  p99 %9.3fms  (%d runs)\n",
+		name, scenario->min, scenario->median, scenario->p99, runs);
+}
+
+/* time runs of the flasher with the default pacing, taking turns with the firmware files given */
+static void time_flash_paced(const char *name, long bytes, const char *first, const char *second, const char *pacing) {
+	int runs;
+
+	for (runs = 0; runs < bench.runs; ++runs) {
+		char *argv[] = {"vibl-flash", "--no-reboot", (char *) pacing, (char *) (runs % 2 && second ? second : first), NULL};
+		uint64_t start = pacing_now_us();
+
+		if (run_flasher(argv) != 0)
+			break;
+		bench.times[runs] = (pacing_now_us() - start) / 1e3;
+	}
+
+	record(name, bytes, runs, runs < bench.runs);
+}
+
+static void time_flash(const char *name, long bytes, const char *first, const char *second) {
+	time_flash_paced(name, bytes, first, second, "--pacing=adaptive");
+}
+
+static void bench_flash_full(void) {
+	if (write_file("full.bin", bench.image, IMAGE_SIZE))
+		return record("flash_full", IMAGE_SIZE, 0, 1);
+	time_flash("flash_full", IMAGE_SIZE, file_path("full.bin"), NULL);
+}
+
+/* the same with the write pacing of old, what the adaptive pacing is measured against */
+static void bench_flash_full_fixed(void) {
+	time_flash_paced("flash_full_fixed", IMAGE_SIZE, file_path("full.bin"), NULL, "--pacing=fixed");
+}
+
+/* patches back and forth between the image and one with three blocks changed, starting
+   from the image in flash */
+static void bench_flash_delta(void) {
+	static const long changed[] = {4 * 1024, 30 * 1024, 58 * 1024};
+	static uint8_t other[IMAGE_SIZE];
+	char *flash[] = {"vibl-flash", "--no-reboot", NULL, NULL};
+	char *forward[] = {"vibl-flash", "--make-patch", NULL, NULL, NULL, NULL};
+	char *back[] = {"vibl-flash", "--make-patch", NULL, NULL, NULL, NULL};
+	char a[64], b[64], ab[64], ba[64];
+
+	memcpy(other, bench.image, IMAGE_SIZE);
+	for (int i = 0; i < 3; ++i)
+		for (int j = 0; j < 64; ++j)
+			other[changed[i] + j] ^= 0x5A;
+
+	snprintf(a, sizeof(a), "%s", file_path("full.bin"));
+	snprintf(b, sizeof(b), "%s", file_path("other.bin"));
+	snprintf(ab, sizeof(ab), "%s", file_path("forward.vfw"));
+	snprintf(ba, sizeof(ba), "%s", file_path("back.vfw"));
+	forward[2] = back[3] = flash[2] = a;
+	forward[3] = back[2] = b;
+	forward[4] = ab;
+	back[4] = ba;
+
+	if (write_file("other.bin", other, IMAGE_SIZE) || run_flasher(forward) || run_flasher(back) || run_flasher(flash))
+		return record("flash_delta", 3 * 64, 0, 1);
+	time_flash("flash_delta", 3 * 64, ab, ba);
+}
+
+/* an Intel HEX record, 16 bytes of data or fewer */
+static int hex_record(FILE *file, int type, uint16_t address, const uint8_t *data, int count) {
+	int sum = count + (address >> 8) + (address & 0xFF) + type;
+
+	fprintf(file, ":%02X%04X%02X", count, address, type);
+	for (int i = 0; i < count; ++i) {
+		fprintf(file, "%02X", data[i]);
+		sum += data[i];
+	}
+	return fprintf(file, "%02X\n", -sum & 0xFF) < 0;
+}
+
+/* the vector table page and a 4K region in the middle of the image */
+static void bench_flash_sparse(void) {
+	static const long regions[][2] = {{0, 1024}, {32 * 1024, 4 * 1024}};
+	const uint8_t upper[2] = {APP_BASE >> 24, (APP_BASE >> 16) & 0xFF};
+	FILE *file = fopen(file_path("sparse.hex"), "w");
+	int error = !file;
+
+	error = error || hex_record(file, 0x04, 0, upper, 2);
+	for (int i = 0; i < 2 && !error; ++i)
+		for (long offset = regions[i][0]; offset < regions[i][0] + regions[i][1] && !error; offset += 16)
+			error = hex_record(file, 0x00, (APP_BASE + offset) & 0xFFFF, bench.image + offset, 16);
+	error = error || hex_record(file, 0x01, 0, NULL, 0);
+	if (file)
+		error |= fclose(file) != 0;
+
+	if (error)
+		return record("flash_sparse", 5 * 1024, 0, 1);
+	time_flash("flash_sparse", 5 * 1024, file_path("sparse.hex"), NULL);
+}
+
+/* VIALFW02 has no compressed chunks yet; the nearest is a package whose erased part
+   takes no room */
+static void bench_flash_chunked(void) {
+	static uint8_t package[VFW2_HEADER_SIZE + 2 * VFW2_ENTRY_SIZE + CHUNK_SIZE];
+	uint8_t *table = package + VFW2_HEADER_SIZE;
+
+	memset(package, 0, sizeof(package));
+	memcpy(package, VFW2_MAGIC, 8);
+	memcpy(package + 8, bench.uid, sizeof(bench.uid));
+	put_u32(package + 16, 2);
+
+	put_u32(table, 0);
+	put_u32(table + 4, CHUNK_SIZE);
+	put_u32(table + 8, CHUNK_SIZE);
+	table[12] = VFW2_RAW;
+	sha256(bench.image, CHUNK_SIZE, table + 16);
+
+	put_u32(table + VFW2_ENTRY_SIZE, CHUNK_SIZE);
+	put_u32(table + VFW2_ENTRY_SIZE + 4, IMAGE_SIZE - CHUNK_SIZE);
+	table[VFW2_ENTRY_SIZE + 12] = VFW2_ERASED;
+	sha256(NULL, 0, table + VFW2_ENTRY_SIZE + 16);
+
+	sha256(table, 2 * VFW2_ENTRY_SIZE, package + 32);
+	memcpy(table + 2 * VFW2_ENTRY_SIZE, bench.image, CHUNK_SIZE);
+
+	if (write_file("chunked.vfw", package, sizeof(package)))
+		return record("flash_chunked", IMAGE_SIZE, 0, 1);
+	time_flash("flash_chunked", IMAGE_SIZE, file_path("chunked.vfw"), NULL);
+}
+
+static void bench_identify(void) {
+	uint8_t uid[8];
+	char description[BOOTLOADER_DESCRIPTION_SIZE];
+	int runs;
+
+	for (runs = 0; runs < bench.fast_runs; ++runs) {
+		uint64_t start = pacing_now_us();
+
+		if (read_vial_uid(bench.path, uid, description, sizeof(description)))
+			break;
+		bench.times[runs] = (pacing_now_us() - start) / 1e3;
+	}
+
+	record("identify", 0, runs, runs < bench.fast_runs);
+}
+
+/* every HID device, or only those with the bootloader's IDs as the flasher asks for */
+static void bench_enumerate(const char *name, unsigned short vendor_id, unsigned short product_id) {
+	for (int run = 0; run < bench.fast_runs; ++run) {
+		uint64_t start = pacing_now_us();
+
+		hid_free_enumeration(hid_enumerate(vendor_id, product_id));
+		bench.times[run] = (pacing_now_us() - start) / 1e3;
+	}
+
+	record(name, 0, bench.fast_runs, 0);
+}
+
+#ifdef HID_HIDRAW
+static int write_attr(const char *dir, const char *name, const void *data, size_t size) {
+	char path[PATH_MAX];
+	FILE *file;
+	int error;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(file = fopen(path, "wb")))
+		return 1;
+	error = fwrite(data, 1, size, file) != size;
+	return (fclose(file) != 0) | error;
+}
+
+/* mkdir -p */
+static int make_dirs(char *path) {
+	for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		mkdir(path, 0755);
+		*slash = '/';
+	}
+	return mkdir(path, 0755) != 0;
+}
+
+/* a sysfs tree of this many hidraw nodes laid out the way the kernel does USB HID devices:
+   keyboards with two top-level usages, and a bootloader now and then */
+static int make_fake_sysfs(const char *root, int nodes) {
+	static const uint8_t keyboard_desc[] = {
+		0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+		0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0xC0, 0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x15, 0x00, 0x26,
+		0xFF, 0x03, 0x19, 0x00, 0x2A, 0xFF, 0x03, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00, 0xC0,
+	};
+	static const uint8_t bootloader_desc[] = {
+		0x06, 0x00, 0xFF, 0x09, 0x01, 0xA1, 0x01, 0x15, 0x00, 0x25, 0xFF, 0x75, 0x08, 0x95, 0x40, 0x81,
+		0x02, 0x95, 0x40, 0x91, 0x02, 0xC0,
+	};
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/class/hidraw", root);
+	if (make_dirs(path))
+		return 1;
+
+	for (int i = 0; i < nodes; ++i) {
+		int bootloader = i % FAKE_BOOTLOADER_EVERY == FAKE_BOOTLOADER_EVERY / 2;
+		unsigned vid = bootloader ? VIBL_VID : 0x046D, pid = bootloader ? VIBL_PID : 0xC300 + i % 256;
+		char usb[PATH_MAX / 2], intf[PATH_MAX / 2], hid[PATH_MAX / 2], raw[PATH_MAX / 2], text[256];
+		int len, error = 0;
+
+		if (snprintf(usb, sizeof(usb), "%s/devices/pci0000:00/usb1/1-%d", root, i) >= (int) sizeof(usb) ||
+				snprintf(intf, sizeof(intf), "%s/1-%d:1.0", usb, i) >= (int) sizeof(intf) ||
+				snprintf(hid, sizeof(hid), "%s/0003:%04X:%04X.%04X", intf, vid, pid, i) >= (int) sizeof(hid) ||
+				snprintf(raw, sizeof(raw), "%s/hidraw/hidraw%d", hid, i) >= (int) sizeof(raw) ||
+				make_dirs(raw))
+			return 1;
+
+		len = snprintf(text, sizeof(text), "%04x\n", vid);
+		error |= write_attr(usb, "idVendor", text, len);
+		len = snprintf(text, sizeof(text), "%04x\n", pid);
+		error |= write_attr(usb, "idProduct", text, len);
+		len = snprintf(text, sizeof(text), "%s\n", bootloader ? "Vial" : "Logitech");
+		error |= write_attr(usb, "manufacturer", text, len);
+		len = snprintf(text, sizeof(text), "%s\n", bootloader ? "vibl" : "Keyboard");
+		error |= write_attr(usb, "product", text, len);
+		error |= write_attr(usb, "bcdDevice", "0001\n", 5);
+		error |= write_attr(intf, "bInterfaceNumber", "00\n", 3);
+
+		len = snprintf(text, sizeof(text), "DRIVER=hid-generic\nHID_ID=0003:%08X:%08X\nHID_NAME=%s\n"
+			"HID_PHYS=usb-0000:00:14.0-%d/input0\nHID_UNIQ=%s\n", vid, pid,
+			bootloader ? "Vial vibl" : "Logitech Keyboard", i, bootloader ? VIBL_SERIAL_ASCII : "");
+		error |= write_attr(hid, "uevent", text, len);
+		error |= write_attr(hid, "report_descriptor", bootloader ? bootloader_desc : keyboard_desc,
+			bootloader ? sizeof(bootloader_desc) : sizeof(keyboard_desc));
+
+		snprintf(path, sizeof(path), "%s/device", raw);
+		error |= symlink("../..", path) != 0;
+		snprintf(path, sizeof(path), "%s/class/hidraw/hidraw%d", root, i);
+		error |= symlink(raw, path) != 0;
+		if (error)
+			return 1;
+	}
+
+	return 0;
+}
+#endif
+
+static void bench_sha256(void) {
+	uint8_t hash[SHA256_BLOCK_SIZE];
+
+	for (int run = 0; run < bench.fast_runs; ++run) {
+		uint64_t start = pacing_now_us();
+
+		sha256(bench.image, IMAGE_SIZE, hash);
+		bench.times[run] = (pacing_now_us() - start) / 1e3;
+	}
+
+	record("sha256", IMAGE_SIZE, bench.fast_runs, 0);
+}
+
+/* the first bootloader attached and its UID; returns 0 when there is one */
+static int find_bootloader(int *count) {
+	struct hid_device_info *devs = hid_enumerate(VIBL_VID, VIBL_PID);
+	char description[BOOTLOADER_DESCRIPTION_SIZE];
+
+	*count = 0;
+	for (struct hid_device_info *dev = devs; dev; dev = dev->next) {
+		if (!dev->serial_number || !wcsstr(dev->serial_number, VIBL_SERIAL))
+			continue;
+		if (!(*count)++)
+			snprintf(bench.path, sizeof(bench.path), "%s", dev->path);
+	}
+	hid_free_enumeration(devs);
+
+	return !*count || read_vial_uid(bench.path, bench.uid, description, sizeof(description));
+}
+
+static int remove_scratch(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	remove(path);
+	return 0;
+}
+
+static int write_results(FILE *out, const char *backend, int devices) {
+	char date[32];
+	time_t now = time(NULL);
+
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(out, "{\n  \"date\": \"%s\",\n  \"backend\": \"%s\",\n  \"devices\": %d,\n  \"uid\": \"", date, backend, devices);
+	for (int i = 0; i < 8; ++i)
+		fprintf(out, "%02X", bench.uid[i]);
+	fprintf(out, "\",\n  \"unit\": \"ms\",\n  \"scenarios\": [\n");
+
+	for (int i = 0; i < bench.count; ++i) {
+		const struct scenario *scenario = &bench.scenarios[i];
+
+		fprintf(out, "    {\"name\": \"%s\", \"bytes\": %ld, \"runs\": %d, ", scenario->name, scenario->bytes, scenario->runs);
+		if (scenario->failed)
+			fprintf(out, "\"failed\": true}");
+		else
+			fprintf(out, "\"min\": %.3f, \"median\": %.3f, \"p99\": %.3f}", scenario->min, scenario->median, scenario->p99);
+		fprintf(out, "%s\n", i == bench.count - 1 ? "" : ",");
+	}
+
+	fprintf(out, "  ]\n}\n");
+	return ferror(out);
+}
+
+int bench_main(int argc, char **argv) {
+	const char *out_path = NULL;
+	const char *backend = "hardware";
+	FILE *out = stdout;
+	int devices, error = 0;
+
+	bench.runs = 5;
+	bench.fast_runs = 200;
+	bench.devices = 8;
+	for (int arg = 1; arg < argc; ++arg) {
+		if (strncmp(argv[arg], "--runs=", 7) == 0) {
+			bench.runs = strtol(argv[arg] + 7, NULL, 0);
+		} else if (strncmp(argv[arg], "--fast-runs=", 12) == 0) {
+			bench.fast_runs = strtol(argv[arg] + 12, NULL, 0);
+		} else if (strncmp(argv[arg], "--devices=", 10) == 0) {
+			bench.devices = strtol(argv[arg] + 10, NULL, 0);
+		} else if (strncmp(argv[arg], "--out=", 6) == 0) {
+			out_path = argv[arg] + 6;
+#ifdef HID_HIDRAW
+		} else if (strncmp(argv[arg], "--fake-hidraw=", 14) == 0) {
+			bench.fake_nodes = strtol(argv[arg] + 14, NULL, 0);
+#endif
+		} else {
+			printf("Usage: vibl-bench [--runs=5] [--fast-runs=200] [--devices=8] [--out=<file>]\n");
+#ifdef HID_HIDRAW
+			printf("       vibl-bench [--fast-runs=200] --fake-hidraw=<nodes> [--out=<file>]\n");
+#endif
+			return 1;
+		}
+	}
+	if (bench.runs < 1 || bench.runs > MAX_RUNS || bench.fast_runs < 1 || bench.fast_runs > MAX_RUNS || bench.devices < 1 ||
+			bench.fake_nodes < 0) {
+		printf("Error: run and device counts go from 1 to %d\n", MAX_RUNS);
+		return 1;
+	}
+
+	if (!self_path() || strlen(self_path()) >= sizeof(bench.flasher)) {
+		printf("Error: can't tell where vibl-flash is to time it\n");
+		return 1;
+	}
+	strcpy(bench.flasher, self_path());
+
+	strcpy(bench.dir, "/tmp/vibl-bench-XXXXXX");
+	if (!mkdtemp(bench.dir)) {
+		printf("Error: can't make a scratch directory\n");
+		return 1;
+	}
+
+#ifdef HID_MOCK
+	/* the mock keeps its flash in a file, so that it lasts from one flash run to the next
+	   like a real device's */
+	{
+		char devices_text[16];
+
+		backend = "mock";
+		snprintf(devices_text, sizeof(devices_text), "%d", bench.devices);
+		setenv("VIBL_MOCK_IMAGE", file_path("mock.img"), 1);
+		setenv("VIBL_MOCK_DEVICES", devices_text, 1);
+	}
+#endif
+
+	/* the same image every time, with a stack pointer and reset vector that look right */
+	srand(1);
+	for (long i = 0; i < IMAGE_SIZE; ++i)
+		bench.image[i] = rand();
+	put_u32(bench.image, 0x20005000);
+	put_u32(bench.image + 4, APP_BASE + 0x101);
+
+#ifdef HID_HIDRAW
+	/* enumeration alone, over a made up sysfs with as many hidraw nodes as asked for */
+	if (bench.fake_nodes) {
+		char root[64];
+
+		snprintf(root, sizeof(root), "%s/sys", bench.dir);
+		if (make_fake_sysfs(root, bench.fake_nodes)) {
+			printf("Error: can't make a sysfs tree in %s\n", root);
+			error = 1;
+			goto exit;
+		}
+		setenv("VIBL_SYSFS_ROOT", root, 1);
+		backend = "hidraw, made up sysfs";
+		devices = bench.fake_nodes;
+
+		hid_init();
+		bench_enumerate("enumerate", 0, 0);
+		bench_enumerate("enumerate_vibl", VIBL_VID, VIBL_PID);
+		hid_exit();
+		goto results;
+	}
+#endif
+
+	/* flash runs open the HID backend themselves, in their own processes */
+	hid_init();
+	error = find_bootloader(&devices);
+	hid_exit();
+	if (error) {
+		printf("Error: no bootloader attached\n");
+		goto exit;
+	}
+
+	bench_flash_full();
+	bench_flash_full_fixed();
+	bench_flash_delta();
+	bench_flash_sparse();
+	bench_flash_chunked();
+
+	hid_init();
+	bench_identify();
+	bench_enumerate("enumerate", 0, 0);
+	bench_enumerate("enumerate_vibl", VIBL_VID, VIBL_PID);
+	hid_exit();
+
+	bench_sha256();
+
+#ifdef HID_HIDRAW
+	results:
+#endif
+	if (out_path && !(out = fopen(out_path, "w"))) {
+		printf("Error: can't write %s\n", out_path);
+		error = 1;
+		goto exit;
+	}
+	error = write_results(out, backend, devices);
+	if (out != stdout)
+		error |= fclose(out) != 0;
+	for (int i = 0; i < bench.count; ++i)
+		error |= bench.scenarios[i].failed;
+
+	exit:
+
+	nftw(bench.dir, remove_scratch, 16, FTW_DEPTH | FTW_PHYS);
+
+	return error;
+}
+#else
+int bench_main(int argc, char **argv) {
+	(void) argc;
+	(void) argv;
+	printf("Error: vibl-bench runs the flasher in forks, which Windows doesn't have\n");
+	return 1;
+}
+#endif
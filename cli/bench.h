@@ -0,0 +1,29 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* vibl-bench: a fixed set of scenarios timing the flashing toolchain, so that changes to
+   the flasher and the bootloader can be compared over time. It runs against whichever
+   HID backend it was built with, the mock bootloader or the first real one attached, and
+   writes min/median/p99 times of every scenario as JSON:
+
+     flash_full        a whole 60K image
+     flash_full_fixed  the same with --pacing=fixed, to compare the pacing against
+     flash_delta       a patch changing three 64 byte blocks of that image
+     flash_sparse      an Intel HEX populating 5K of it in two regions
+     flash_chunked     a VIALFW02 package of 16K of data and 44K erased
+     identify          opening the bootloader and reading its capabilities and UID
+     enumerate         listing HID devices, with --devices mock bootloaders on the mock
+     enumerate_vibl    listing only those with the bootloader's USB IDs, as the flasher does
+     sha256            hashing a 60K image
+
+   Flash scenarios run the flasher in a fork with --no-reboot, so that the bootloader is
+   still there for the next run. Against a real bootloader flash_full and flash_full_fixed
+   are the hardware numbers for the write pacing. Built with the hidraw backend,
+   --fake-hidraw=N times just the enumerate scenarios over a made up sysfs of N hidraw
+   nodes, one in 64 a bootloader. */
+
+/* run the suite; options --runs=N (flash scenarios), --fast-runs=N (the others),
+   --devices=N and --out=<file>, stdout by default */
+int bench_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,664 @@
+/*
+* vibl-flashd, a flashing daemon taking jobs over a Unix domain socket
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* struct ucred */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "flashd.h"
+#include "hidapi.h"
+#include "pacing.h"
+#include "protocol.h"
+#include "sha256.h"
+#include "util.h"
+#include "verify.h"
+
+#ifndef _WIN32
+#define VIAL_ID_SIZE 8
+#define MAX_PACKAGES 32
+#define MAX_BOARDS 32
+#define MAX_JOBS 64
+#define MAX_ARGS 32
+#define LINE_SIZE 4096
+
+/* how often to look for boards while a job waits for one, and otherwise */
+#define SCAN_BUSY_MS 20
+#define SCAN_IDLE_MS 500
+
+struct package {
+	char *path;
+	time_t mtime;
+	long size;
+	FILE *copy;       /* what was checked, which jobs read rather than the file */
+	uint8_t hash[SHA256_BLOCK_SIZE];
+	int has_uid;
+	uint8_t uid[VIAL_ID_SIZE];
+	int users;        /* jobs waiting to flash it */
+};
+
+struct board {
+	char *path;
+	uint8_t uid[VIAL_ID_SIZE];
+	char description[BOOTLOADER_DESCRIPTION_SIZE];
+	int job;          /* pid of the job flashing it, 0 when free */
+	int seen;
+};
+
+struct job {
+	int fd;
+	int id;
+	char line[LINE_SIZE];
+	size_t len;
+	int ready;        /* the job is in and waits for a board */
+	int told;         /* the submitter has been told it waits */
+	int argc;
+	char *argv[MAX_ARGS];
+	struct package *package;
+	int has_uid;
+	uint8_t uid[VIAL_ID_SIZE];
+	struct board *board;
+	int pid;
+	uint64_t start;
+};
+
+static struct {
+	struct package packages[MAX_PACKAGES];
+	struct board boards[MAX_BOARDS];
+	struct job jobs[MAX_JOBS];
+	int next_id;
+	char flasher[PATH_MAX];
+} flashd;
+
+static void free_package(struct package *package) {
+	free(package->path);
+	if (package->copy)
+		fclose(package->copy);
+	memset(package, 0, sizeof(*package));
+}
+
+/* read a package, hash it and check it the way verify-only does, keeping a copy of what
+   was checked in an unlinked file that only the jobs flashing it get to see */
+static int read_package(struct package *package, const char *path, const struct stat *st, char *error, size_t len) {
+	static const uint8_t no_uid[VIAL_ID_SIZE];
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = NULL;
+	SHA256_CTX ctx;
+	int failed = 1;
+
+	package->size = st->st_size;
+	package->mtime = st->st_mtime;
+	if (!file || !(data = malloc(package->size ? package->size : 1)) ||
+			fread(data, 1, package->size, file) != (size_t) package->size) {
+		snprintf(error, len, "can't read %s", path);
+		free(data);
+		if (file)
+			fclose(file);
+		return 1;
+	}
+	fclose(file);
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, package->size);
+	sha256_final(&ctx, package->hash);
+
+	/* ELF, HEX, UF2 and plain bins carry no hashes or UID to check */
+	if (package->size >= 16 && (memcmp(data, "VIALFW0", 7) == 0 || memcmp(data, "VIALPT00", 8) == 0)) {
+		if (verify_package(data, package->size, UINT32_MAX, error, len))
+			goto exit;
+		package->has_uid = memcmp(data + 8, no_uid, VIAL_ID_SIZE) != 0;
+		memcpy(package->uid, data + 8, VIAL_ID_SIZE);
+	}
+
+	if (!(package->path = strdup(path))) {
+		snprintf(error, len, "out of memory");
+		goto exit;
+	}
+	if (!(package->copy = tmpfile()) || fwrite(data, 1, package->size, package->copy) != (size_t) package->size ||
+			fflush(package->copy) != 0 || fcntl(fileno(package->copy), F_SETFD, FD_CLOEXEC) != 0) {
+		snprintf(error, len, "can't keep a copy of %s", path);
+		goto exit;
+	}
+	failed = 0;
+
+exit:
+	free(data);
+	return failed;
+}
+
+/* the package a job names, loaded and checked the first time and whenever the file changes */
+static struct package *get_package(const char *name, char *error, size_t len) {
+	struct package *free_slot = NULL;
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (strncmp(name, "sha256:", 7) == 0) {
+		uint8_t hash[SHA256_BLOCK_SIZE];
+
+		if (parse_hex(name + 7, hash, sizeof(hash))) {
+			snprintf(error, len, "bad hash %s", name + 7);
+			return NULL;
+		}
+		for (int i = 0; i < MAX_PACKAGES; ++i)
+			if (flashd.packages[i].path && memcmp(flashd.packages[i].hash, hash, sizeof(hash)) == 0)
+				return &flashd.packages[i];
+		snprintf(error, len, "no package with hash %s was loaded", name + 7);
+		return NULL;
+	}
+
+	if (!realpath(name, path) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		snprintf(error, len, "can't find %s", name);
+		return NULL;
+	}
+
+	for (int i = 0; i < MAX_PACKAGES; ++i) {
+		struct package *package = &flashd.packages[i];
+
+		if (!package->path) {
+			free_slot = free_slot ? free_slot : package;
+		} else if (strcmp(package->path, path) == 0) {
+			if (package->mtime == st.st_mtime && package->size == st.st_size)
+				return package;
+			if (package->users) {
+				snprintf(error, len, "%s changed while jobs wait to flash it", name);
+				return NULL;
+			}
+			free_package(package);
+			free_slot = package;
+			break;
+		}
+	}
+
+	/* make room by forgetting a package no job waits for */
+	for (int i = 0; i < MAX_PACKAGES && !free_slot; ++i) {
+		if (!flashd.packages[i].users) {
+			free_package(&flashd.packages[i]);
+			free_slot = &flashd.packages[i];
+		}
+	}
+	if (!free_slot) {
+		snprintf(error, len, "too many packages in use");
+		return NULL;
+	}
+
+	if (read_package(free_slot, path, &st, error, len)) {
+		free_package(free_slot);
+		return NULL;
+	}
+	printf("Loaded %s (%ld bytes)\n", path, free_slot->size);
+
+	return free_slot;
+}
+
+static void finish_job(struct job *job, const char *error) {
+	if (error)
+		dprintf(job->fd, "Error: %s\nEXIT 1\n", error);
+	if (job->package)
+		--job->package->users;
+	close(job->fd);
+	memset(job, 0, sizeof(*job));
+	job->fd = -1;
+}
+
+/* split the job's line into arguments and find its package; returns 0 when it can run */
+static int parse_job(struct job *job, char *error, size_t len) {
+	const char *firmware = NULL;
+	char *arg;
+
+	job->line[job->len] = 0;
+	job->line[strcspn(job->line, "\r\n")] = 0;
+
+	for (arg = strtok(job->line, "\t"); arg; arg = strtok(NULL, "\t")) {
+		if (strncmp(arg, "--uid=", 6) == 0) {
+			if (parse_hex(arg + 6, job->uid, VIAL_ID_SIZE)) {
+				snprintf(error, len, "a UID is 16 hex digits");
+				return 1;
+			}
+			job->has_uid = 1;
+		} else if (strncmp(arg, "--device=", 9) == 0 || strncmp(arg, "--package-fd=", 13) == 0 || strncmp(arg, "--bootloader=", 13) == 0 ||
+				strncmp(arg, "--replay", 8) == 0 || strcmp(arg, "--update") == 0 ||
+				strcmp(arg, "--verify-only") == 0 || strcmp(arg, "--make-patch") == 0 || strcmp(arg, "--import-usbmon") == 0) {
+			snprintf(error, len, "%s can't be used in a job", arg);
+			return 1;
+		} else if (strncmp(arg, "--", 2) == 0) {
+			if (job->argc == MAX_ARGS - 5) {
+				snprintf(error, len, "too many options");
+				return 1;
+			}
+			job->argv[job->argc++] = arg;
+		} else if (firmware) {
+			snprintf(error, len, "a job flashes one firmware");
+			return 1;
+		} else {
+			firmware = arg;
+		}
+	}
+
+	if (!firmware || strcmp(firmware, "-") == 0) {
+		snprintf(error, len, "no firmware named");
+		return 1;
+	}
+	if (!(job->package = get_package(firmware, error, len)))
+		return 1;
+	++job->package->users;
+
+	/* the firmware picks its board unless the job does */
+	if (!job->has_uid && job->package->has_uid) {
+		memcpy(job->uid, job->package->uid, VIAL_ID_SIZE);
+		job->has_uid = 1;
+	}
+
+	return 0;
+}
+
+/* keep the table of attached bootloaders and their UIDs current */
+static void scan_boards(void) {
+	struct hid_device_info *devs = hid_enumerate(VIBL_VID, VIBL_PID);
+
+	for (int i = 0; i < MAX_BOARDS; ++i)
+		flashd.boards[i].seen = 0;
+
+	for (struct hid_device_info *dev = devs; dev; dev = dev->next) {
+		struct board *board = NULL, *free_slot = NULL;
+
+		if (!dev->serial_number || !wcsstr(dev->serial_number, VIBL_SERIAL))
+			continue;
+
+		for (int i = 0; i < MAX_BOARDS && !board; ++i) {
+			if (flashd.boards[i].path && strcmp(flashd.boards[i].path, dev->path) == 0)
+				board = &flashd.boards[i];
+			else if (!flashd.boards[i].path && !free_slot)
+				free_slot = &flashd.boards[i];
+		}
+
+		if (!board) {
+			uint8_t uid[VIAL_ID_SIZE];
+			char description[BOOTLOADER_DESCRIPTION_SIZE];
+
+			/* one that isn't ready to answer yet is asked again on the next scan */
+			if (!free_slot || read_vial_uid(dev->path, uid, description, sizeof(description)) ||
+					!(free_slot->path = strdup(dev->path)))
+				continue;
+			board = free_slot;
+			memcpy(board->uid, uid, VIAL_ID_SIZE);
+			strcpy(board->description, description);
+			printf("Board attached at %s, Vial UID ", board->path);
+			for (int i = 0; i < VIAL_ID_SIZE; ++i)
+				printf("%02X", board->uid[i]);
+			printf("\n");
+		}
+		board->seen = 1;
+	}
+
+	hid_free_enumeration(devs);
+
+	for (int i = 0; i < MAX_BOARDS; ++i) {
+		struct board *board = &flashd.boards[i];
+
+		if (board->path && !board->seen && !board->job) {
+			printf("Board at %s detached\n", board->path);
+			free(board->path);
+			memset(board, 0, sizeof(*board));
+		}
+	}
+}
+
+/* run a job as a vibl-flash of its own, its output going to the submitter. It starts from
+   scratch rather than as a fork of the daemon, which would share the daemon's HID handles
+   and the state of the backend behind them. What the daemon knows already it is handed:
+   the copy of the package that was checked, to read without hashing it again, and the
+   board with what its bootloader said of itself, to open without asking again */
+static void start_job(struct job *job, struct board *board, int listener) {
+	char device[PATH_MAX + 16], package[32], description[BOOTLOADER_DESCRIPTION_SIZE + 16];
+	int pid;
+
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		finish_job(job, "can't start the job");
+		return;
+	}
+
+	if (pid == 0) {
+		char *argv[MAX_ARGS];
+		int argc = 0, fd;
+
+		close(listener);
+		for (int i = 0; i < MAX_JOBS; ++i)
+			if (flashd.jobs[i].fd >= 0 && &flashd.jobs[i] != job)
+				close(flashd.jobs[i].fd);
+		dup2(job->fd, STDOUT_FILENO);
+		dup2(job->fd, STDERR_FILENO);
+		close(job->fd);
+
+		/* the daemon's copy is closed on exec, a duplicate of it is the job's to read */
+		if ((fd = dup(fileno(job->package->copy))) < 0) {
+			printf("Error: can't hand the package over: %s\n", strerror(errno));
+			_exit(127);
+		}
+
+		snprintf(device, sizeof(device), "--device=%s", board->path);
+		snprintf(package, sizeof(package), "--package-fd=%d", fd);
+		snprintf(description, sizeof(description), "--bootloader=%s", board->description);
+		argv[argc++] = "vibl-flash";
+		argv[argc++] = device;
+		argv[argc++] = package;
+		argv[argc++] = description;
+		for (int i = 0; i < job->argc; ++i)
+			argv[argc++] = job->argv[i];
+		argv[argc++] = job->package->path;
+		argv[argc] = NULL;
+
+		execv(flashd.flasher, argv);
+		printf("Error: can't run %s: %s\n", flashd.flasher, strerror(errno));
+		_exit(127);
+	}
+
+	job->pid = pid;
+	job->board = board;
+	job->start = pacing_now_us();
+	board->job = pid;
+	printf("Job %d: flashing %s on %s\n", job->id, job->package->path, board->path);
+}
+
+/* give each waiting job a free board with its UID */
+static void dispatch_jobs(int listener) {
+	for (int i = 0; i < MAX_JOBS; ++i) {
+		struct job *job = &flashd.jobs[i];
+		struct board *board = NULL;
+
+		if (job->fd < 0 || !job->ready || job->pid)
+			continue;
+
+		for (int j = 0; j < MAX_BOARDS && !board; ++j)
+			if (flashd.boards[j].path && !flashd.boards[j].job &&
+					(!job->has_uid || memcmp(flashd.boards[j].uid, job->uid, VIAL_ID_SIZE) == 0))
+				board = &flashd.boards[j];
+
+		if (board) {
+			start_job(job, board, listener);
+		} else if (!job->told) {
+			dprintf(job->fd, "Waiting for a board...\n");
+			job->told = 1;
+		}
+	}
+}
+
+/* pass on the status of jobs that are done; their boards are gone or start over */
+static void reap_jobs(void) {
+	int status, pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (int i = 0; i < MAX_JOBS; ++i) {
+			struct job *job = &flashd.jobs[i];
+			int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+			if (job->fd < 0 || job->pid != pid)
+				continue;
+
+			printf("Job %d: finished with status %d in %.2fs\n", job->id, code, (pacing_now_us() - job->start) / 1e6);
+			dprintf(job->fd, "EXIT %d\n", code);
+			free(job->board->path);
+			memset(job->board, 0, sizeof(*job->board));
+			finish_job(job, NULL);
+		}
+	}
+}
+
+/* on top of the socket's mode, only the daemon's own user and root may submit jobs */
+static int peer_allowed(int fd) {
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return 0;
+	return cred.uid == 0 || cred.uid == getuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(fd, &uid, &gid) != 0)
+		return 0;
+	return uid == 0 || uid == getuid();
+#endif
+}
+
+/* wakes up poll when a job ends */
+static void child_exited(int signal) {
+	(void) signal;
+}
+
+int flashd_main(const char *path) {
+	struct pollfd fds[1 + MAX_JOBS];
+	struct job *polled[1 + MAX_JOBS];
+	struct sockaddr_un addr;
+	struct sigaction action;
+	uint64_t last_scan = 0;
+	const char *self = self_path();
+	mode_t mask;
+	int listener;
+
+	setbuf(stdout, NULL);
+
+	/* jobs run this same program */
+	if (!self || strlen(self) >= sizeof(flashd.flasher)) {
+		printf("Error: can't tell where vibl-flash is to run jobs with\n");
+		return 1;
+	}
+	strcpy(flashd.flasher, self);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf("Error: socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* a socket left behind by an earlier run is replaced. Whoever can connect can flash the
+	   boards, so the socket is the daemon's user's alone from the moment it exists */
+	unlink(path);
+	mask = umask(077);
+	if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+			chmod(path, 0600) != 0 || listen(listener, 16) != 0) {
+		printf("Error: can't listen on %s: %s\n", path, strerror(errno));
+		umask(mask);
+		return 1;
+	}
+	umask(mask);
+
+	/* a submitter going away must not take its job down mid-flash */
+	signal(SIGPIPE, SIG_IGN);
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = child_exited;
+	sigaction(SIGCHLD, &action, NULL);
+
+	for (int i = 0; i < MAX_JOBS; ++i)
+		flashd.jobs[i].fd = -1;
+
+	hid_init();
+	printf("vibl-flashd listening on %s\n", path);
+
+	for (;;) {
+		int waiting = 0, count = 1;
+		int interval;
+
+		reap_jobs();
+
+		for (int i = 0; i < MAX_JOBS; ++i)
+			waiting |= flashd.jobs[i].fd >= 0 && flashd.jobs[i].ready && !flashd.jobs[i].pid;
+		interval = waiting ? SCAN_BUSY_MS : SCAN_IDLE_MS;
+
+		if (pacing_now_us() - last_scan >= interval * 1000ULL) {
+			scan_boards();
+			last_scan = pacing_now_us();
+		}
+		dispatch_jobs(listener);
+
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (int i = 0; i < MAX_JOBS; ++i) {
+			/* running jobs write to their submitters themselves */
+			if (flashd.jobs[i].fd < 0 || flashd.jobs[i].pid)
+				continue;
+			fds[count].fd = flashd.jobs[i].fd;
+			fds[count].events = POLLIN;
+			polled[count++] = &flashd.jobs[i];
+		}
+
+		if (poll(fds, count, interval) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listener, NULL, NULL);
+			struct job *job = NULL;
+
+			if (fd >= 0 && !peer_allowed(fd)) {
+				printf("Refused a connection from another user\n");
+				dprintf(fd, "Error: not allowed\nEXIT 1\n");
+				close(fd);
+				fd = -1;
+			}
+			for (int i = 0; i < MAX_JOBS && !job && fd >= 0; ++i)
+				if (flashd.jobs[i].fd < 0)
+					job = &flashd.jobs[i];
+			if (job) {
+				job->fd = fd;
+				job->id = ++flashd.next_id;
+			} else if (fd >= 0) {
+				dprintf(fd, "Error: too many jobs\nEXIT 1\n");
+				close(fd);
+			}
+		}
+
+		for (int i = 1; i < count; ++i) {
+			struct job *job = polled[i];
+			char error[256];
+			ssize_t got;
+
+			if (!fds[i].revents)
+				continue;
+
+			/* a submitter that hangs up withdraws its job, and one only sends a line */
+			if (job->ready || (got = read(job->fd, job->line + job->len, sizeof(job->line) - 1 - job->len)) <= 0) {
+				finish_job(job, NULL);
+				continue;
+			}
+			job->len += got;
+			if (!memchr(job->line, '\n', job->len)) {
+				if (job->len == sizeof(job->line) - 1)
+					finish_job(job, "job too long");
+				continue;
+			}
+
+			if (parse_job(job, error, sizeof(error))) {
+				finish_job(job, error);
+				continue;
+			}
+			job->ready = 1;
+		}
+	}
+}
+
+int flashd_submit(const char *path, int argc, char **argv) {
+	struct sockaddr_un addr;
+	char line[LINE_SIZE], buffer[4096 + 64];
+	size_t len = 0, held = 0;
+	int fd, status = 1;
+	ssize_t got;
+
+	/* paths are the daemon's to open, from wherever it runs */
+	for (int i = 0; i < argc; ++i) {
+		char resolved[PATH_MAX];
+		const char *arg = argv[i];
+
+		if (strncmp(arg, "--", 2) != 0 && strncmp(arg, "sha256:", 7) != 0 && realpath(arg, resolved))
+			arg = resolved;
+		if (len + strlen(arg) + 2 > sizeof(line)) {
+			printf("Error: job too long\n");
+			return 1;
+		}
+		len += snprintf(line + len, sizeof(line) - len, "%s%s", arg, i == argc - 1 ? "\n" : "\t");
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		printf("Error: can't reach vibl-flashd at %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (write(fd, line, len) != (ssize_t) len) {
+		printf("Error: can't send the job\n");
+		close(fd);
+		return 1;
+	}
+
+	/* pass everything on but the last line, which may be the status */
+	while ((got = read(fd, buffer + held, sizeof(buffer) - 1 - held)) > 0) {
+		size_t end;
+
+		held += got;
+		for (end = held - 1; end > 0 && buffer[end - 1] != '\n' && buffer[end - 1] != '\r'; --end) {}
+		if (end == 0 && held > 64)
+			end = held;
+		fwrite(buffer, 1, end, stdout);
+		memmove(buffer, buffer + end, held - end);
+		held -= end;
+	}
+	close(fd);
+
+	buffer[held] = 0;
+	if (sscanf(buffer, "EXIT %d", &status) != 1) {
+		fwrite(buffer, 1, held, stdout);
+		printf("\nError: vibl-flashd went away\n");
+		return 1;
+	}
+
+	return status;
+}
+#else
+int flashd_main(const char *path) {
+	(void) path;
+	printf("Error: vibl-flashd needs Unix domain sockets\n");
+	return 1;
+}
+
+int flashd_submit(const char *path, int argc, char **argv) {
+	(void) path;
+	(void) argc;
+	(void) argv;
+	printf("Error: vibl-flashd needs Unix domain sockets\n");
+	return 1;
+}
+#endif
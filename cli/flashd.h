@@ -0,0 +1,38 @@
+#ifndef FLASHD_H
+#define FLASHD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* vibl-flashd: a flashing daemon for stations with many boards attached. It keeps the
+   packages it was given (checked when loaded, so a bad one is turned down before a board
+   is tied up) and a table of the bootloaders attached with their Vial UIDs and what they
+   can do, and takes jobs over a Unix domain socket that only its own user may use. Each
+   job runs vibl-flash afresh on a board of its own, so boards are flashed in parallel,
+   with its output streamed back to whoever submitted it. The job is handed the daemon's
+   checked copy of the package and the board's path and description, so all it repeats
+   is setting up a HID context of its own: it doesn't reopen or hash the package again,
+   look for the board or ask the board about itself.
+
+   A job is one line of tab separated vibl-flash arguments: options, then the firmware
+   as a path or as sha256:<hex> of a package the daemon already holds. --uid=<16 hex
+   digits> picks the board, the firmware's own Vial UID does otherwise. The daemon ends
+   the output with a line "EXIT <status>".
+
+   Bootloaders built with BL_IDLE_BOOT_MS would boot the application while waiting for a
+   job, so reading their Vial UID also tells them to stay until they are next reset. */
+
+/* serve jobs on the socket at path until killed; returns only on error */
+int flashd_main(const char *path);
+
+/* send a job to the daemon at path and print its output; returns the job's status */
+int flashd_submit(const char *path, int argc, char **argv);
+
+/* room for a bootloader's description as vibl-flash --bootloader takes it */
+#define BOOTLOADER_DESCRIPTION_SIZE 96
+
+/* provided by main.c: open the bootloader at path, read its Vial UID and description and
+   tell it to stay; returns 0 on success */
+int read_vial_uid(const char *path, uint8_t *uid, char *description, size_t len);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef HID_BULK_H__
+#define HID_BULK_H__
+
+#include "hidapi.h"
+
+/* Vendor-class bulk interface of the bootloader, only provided by the libusb backend
+   (build with BACKEND=libusb). It carries the same commands as the HID interface,
+   without a report ID in front, and lets several packets go out per frame. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* non-zero when the device opened with hid_open_path() has a claimed bulk interface */
+int HID_API_EXPORT hid_bulk_available(hid_device *dev);
+
+/* returns the number of bytes sent or -1 on error; a negative timeout waits forever */
+int HID_API_EXPORT hid_bulk_write(hid_device *dev, const unsigned char *data, size_t length, int milliseconds);
+
+/* returns the number of bytes read, 0 on timeout or -1 on error; length should be
+   a multiple of the endpoint's packet size */
+int HID_API_EXPORT hid_bulk_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
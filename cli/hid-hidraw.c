@@ -36,6 +36,8 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <dirent.h>
+#include <limits.h>
 
 /* Linux */
 #include <linux/hidraw.h>
@@ -164,11 +166,46 @@ static void register_device_error_format(hid_device *dev, const char *format, ..
 	register_device_error(dev, msg);
 }
 
-/* Get an attribute value from a udev_device and return it as a whar_t
-   string. The returned string must be freed with free() when done.*/
-static wchar_t *copy_udev_string(struct udev_device *dev, const char *udev_name)
+/* Root of the sysfs tree hid_enumerate() walks, VIBL_SYSFS_ROOT points it at a made up
+   one to measure enumeration with many devices */
+static const char *sysfs_root(void)
 {
-	return utf8_to_wchar_t(udev_device_get_sysattr_value(dev, udev_name));
+	const char *root = getenv("VIBL_SYSFS_ROOT");
+
+	return root ? root : "/sys";
+}
+
+/* Read a sysfs attribute of a hidraw node into buf, without the trailing newline.
+   Returns buf, NULL if the attribute isn't there. */
+static char *read_sysfs_attr(const char *node, const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", node, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return NULL;
+
+	while (len > 0 && buf[len - 1] == '\n')
+		--len;
+	buf[len] = '\0';
+	return buf;
+}
+
+/* Get a sysfs attribute of a hidraw node and return it as a wchar_t string. The
+   returned string must be freed with free() when done. */
+static wchar_t *copy_sysfs_string(const char *node, const char *attr)
+{
+	char buf[256];
+
+	return utf8_to_wchar_t(read_sysfs_attr(node, attr, buf, sizeof(buf)));
 }
 
 /*
@@ -410,6 +447,7 @@ static int get_hid_report_descriptor_from_sysfs(const char *sysfs_path, struct h
 /*
  * The caller is responsible for free()ing the (newly-allocated) character
  * strings pointed to by serial_number_utf8 and product_name_utf8 after use.
+ * Either can be NULL when only the IDs are wanted.
  */
 static int
 parse_uevent_info(const char *uevent, unsigned *bus_type,
@@ -448,11 +486,13 @@ parse_uevent_info(const char *uevent, unsigned *bus_type,
 			}
 		} else if (strcmp(key, "HID_NAME") == 0) {
 			/* The caller has to free the product name */
-			*product_name_utf8 = strdup(value);
+			if (product_name_utf8)
+				*product_name_utf8 = strdup(value);
 			found_name = 1;
 		} else if (strcmp(key, "HID_UNIQ") == 0) {
 			/* The caller has to free the serial number */
-			*serial_number_utf8 = strdup(value);
+			if (serial_number_utf8)
+				*serial_number_utf8 = strdup(value);
 			found_serial = 1;
 		}
 
@@ -611,9 +651,9 @@ int HID_API_EXPORT hid_exit(void)
 
 struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
 {
-	struct udev *udev;
-	struct udev_enumerate *enumerate;
-	struct udev_list_entry *devices, *dev_list_entry;
+	char class_path[PATH_MAX];
+	DIR *dir;
+	struct dirent *entry;
 
 	struct hid_device_info *root = NULL; /* return object */
 	struct hid_device_info *cur_dev = NULL;
@@ -621,28 +661,20 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 
 	hid_init();
 
-	/* Create the udev object */
-	udev = udev_new();
-	if (!udev) {
-		register_global_error("Couldn't create udev context");
+	/* Walk the hidraw class in sysfs directly: udev would build a device record, with
+	   all its attributes, for every node before we get to look at the IDs */
+	snprintf(class_path, sizeof(class_path), "%s/class/hidraw", sysfs_root());
+	dir = opendir(class_path);
+	if (!dir) {
+		register_global_error_format("Couldn't list %s: %s", class_path, strerror(errno));
 		return NULL;
 	}
 
-	/* Create a list of the devices in the 'hidraw' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-	udev_enumerate_scan_devices(enumerate);
-	devices = udev_enumerate_get_list_entry(enumerate);
-	/* For each item, see if it matches the vid/pid, and if so
-	   create a udev_device record for it */
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *sysfs_path;
-		const char *dev_path;
-		const char *str;
-		struct udev_device *raw_dev; /* The device's hidraw udev node. */
-		struct udev_device *hid_dev; /* The device's HID udev node. */
-		struct udev_device *usb_dev; /* The device's USB udev node. */
-		struct udev_device *intf_dev; /* The device's interface (in the USB sense). */
+	while ((entry = readdir(dir)) != NULL) {
+		char node[PATH_MAX];
+		char dev_path[PATH_MAX];
+		char uevent[4096];
+		char str[32];
 		unsigned short dev_vid;
 		unsigned short dev_pid;
 		char *serial_number_utf8 = NULL;
@@ -650,34 +682,21 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		unsigned bus_type;
 		int result;
 		struct hidraw_report_descriptor report_desc;
+		struct hid_device_info *tmp;
 
-		/* Get the filename of the /sys entry for the device
-		   and create a udev_device object (dev) representing it */
-		sysfs_path = udev_list_entry_get_name(dev_list_entry);
-		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
-		dev_path = udev_device_get_devnode(raw_dev);
-
-		hid_dev = udev_device_get_parent_with_subsystem_devtype(
-			raw_dev,
-			"hid",
-			NULL);
+		if (strncmp(entry->d_name, "hidraw", 6) != 0)
+			continue;
 
-		if (!hid_dev) {
-			/* Unable to find parent hid device. */
-			goto next;
-		}
+		/* <root>/class/hidraw/hidrawN links to the node, its device is the HID device
+		   and that one's parents the USB interface and device */
+		if (snprintf(node, sizeof(node), "%s/%s", class_path, entry->d_name) >= (int) sizeof(node))
+			continue;
+		snprintf(dev_path, sizeof(dev_path), "/dev/%s", entry->d_name);
 
-		result = parse_uevent_info(
-			udev_device_get_sysattr_value(hid_dev, "uevent"),
-			&bus_type,
-			&dev_vid,
-			&dev_pid,
-			&serial_number_utf8,
-			&product_name_utf8);
-
-		if (!result) {
-			/* parse_uevent_info() failed for at least one field. */
-			goto next;
+		/* The HID device's uevent is all that is read of nodes that don't match */
+		if (!read_sysfs_attr(node, "device/uevent", uevent, sizeof(uevent)) ||
+		    !parse_uevent_info(uevent, &bus_type, &dev_vid, &dev_pid, NULL, NULL)) {
+			continue;
 		}
 
 		/* Filter out unhandled devices right away */
@@ -688,150 +707,130 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 				break;
 
 			default:
-				goto next;
+				continue;
 		}
 
 		/* Check the VID/PID against the arguments */
-		if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-		    (product_id == 0x0 || product_id == dev_pid)) {
-			struct hid_device_info *tmp;
-
-			/* VID/PID match. Create the record. */
-			tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-			if (cur_dev) {
-				cur_dev->next = tmp;
-			}
-			else {
-				root = tmp;
-			}
-			prev_dev = cur_dev;
-			cur_dev = tmp;
-
-			/* Fill out the record */
-			cur_dev->next = NULL;
-			cur_dev->path = dev_path? strdup(dev_path): NULL;
+		if ((vendor_id != 0x0 && vendor_id != dev_vid) ||
+		    (product_id != 0x0 && product_id != dev_pid)) {
+			continue;
+		}
 
-			/* VID/PID */
-			cur_dev->vendor_id = dev_vid;
-			cur_dev->product_id = dev_pid;
+		/* VID/PID match, only now the strings and the report descriptor are worth getting */
+		parse_uevent_info(uevent, &bus_type, &dev_vid, &dev_pid, &serial_number_utf8, &product_name_utf8);
 
-			/* Serial Number */
-			cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
+		/* Create the record. */
+		tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
+		}
+		prev_dev = cur_dev;
+		cur_dev = tmp;
 
-			/* Release Number */
-			cur_dev->release_number = 0x0;
+		/* Fill out the record */
+		cur_dev->next = NULL;
+		cur_dev->path = strdup(dev_path);
 
-			/* Interface Number */
-			cur_dev->interface_number = -1;
+		/* VID/PID */
+		cur_dev->vendor_id = dev_vid;
+		cur_dev->product_id = dev_pid;
 
-			switch (bus_type) {
-				case BUS_USB:
-					/* The device pointed to by raw_dev contains information about
-					   the hidraw device. In order to get information about the
-					   USB device, get the parent device with the
-					   subsystem/devtype pair of "usb"/"usb_device". This will
-					   be several levels up the tree, but the function will find
-					   it. */
-					usb_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_device");
-
-					/* uhid USB devices
-					   Since this is a virtual hid interface, no USB information will
-					   be available. */
-					if (!usb_dev) {
-						/* Manufacturer and Product strings */
-						cur_dev->manufacturer_string = wcsdup(L"");
-						cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
-						break;
-					}
+		/* Serial Number */
+		cur_dev->serial_number = utf8_to_wchar_t(serial_number_utf8);
 
-					/* Manufacturer and Product strings */
-					cur_dev->manufacturer_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_MANUFACTURER]);
-					cur_dev->product_string = copy_udev_string(usb_dev, device_string_names[DEVICE_STRING_PRODUCT]);
-
-					/* Release Number */
-					str = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-					cur_dev->release_number = (str)? strtol(str, NULL, 16): 0x0;
-
-					/* Get a handle to the interface's udev node. */
-					intf_dev = udev_device_get_parent_with_subsystem_devtype(
-							raw_dev,
-							"usb",
-							"usb_interface");
-					if (intf_dev) {
-						str = udev_device_get_sysattr_value(intf_dev, "bInterfaceNumber");
-						cur_dev->interface_number = (str)? strtol(str, NULL, 16): -1;
-					}
+		/* Release Number */
+		cur_dev->release_number = 0x0;
 
-					break;
+		/* Interface Number */
+		cur_dev->interface_number = -1;
 
-				case BUS_BLUETOOTH:
-				case BUS_I2C:
+		switch (bus_type) {
+			case BUS_USB:
+				/* uhid USB devices
+				   Since this is a virtual hid interface, no USB information will
+				   be available. */
+				if (!read_sysfs_attr(node, "device/../../idVendor", str, sizeof(str))) {
 					/* Manufacturer and Product strings */
 					cur_dev->manufacturer_string = wcsdup(L"");
 					cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
-
 					break;
+				}
 
-				default:
-					/* Unknown device type - this should never happen, as we
-					 * check for USB and Bluetooth devices above */
-					break;
-			}
+				/* Manufacturer and Product strings */
+				cur_dev->manufacturer_string = copy_sysfs_string(node, "device/../../manufacturer");
+				cur_dev->product_string = copy_sysfs_string(node, "device/../../product");
 
-			/* Usage Page and Usage */
-			result = get_hid_report_descriptor_from_sysfs(sysfs_path, &report_desc);
-			if (result >= 0) {
-				unsigned short page = 0, usage = 0;
-				unsigned int pos = 0;
-				/*
-				 * Parse the first usage and usage page
-				 * out of the report descriptor.
-				 */
-				if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
+				/* Release Number */
+				cur_dev->release_number = read_sysfs_attr(node, "device/../../bcdDevice", str, sizeof(str)) ?
+					strtol(str, NULL, 16) : 0x0;
 
-				/*
-				 * Parse any additional usage and usage pages
-				 * out of the report descriptor.
-				 */
-				while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
-					/* Create new record for additional usage pairs */
-					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-					cur_dev->next = tmp;
-					prev_dev = cur_dev;
-					cur_dev = tmp;
-
-					/* Update fields */
-					cur_dev->path = strdup(dev_path);
-					cur_dev->vendor_id = dev_vid;
-					cur_dev->product_id = dev_pid;
-					cur_dev->serial_number = prev_dev->serial_number? wcsdup(prev_dev->serial_number): NULL;
-					cur_dev->release_number = prev_dev->release_number;
-					cur_dev->interface_number = prev_dev->interface_number;
-					cur_dev->manufacturer_string = prev_dev->manufacturer_string? wcsdup(prev_dev->manufacturer_string): NULL;
-					cur_dev->product_string = prev_dev->product_string? wcsdup(prev_dev->product_string): NULL;
-					cur_dev->usage_page = page;
-					cur_dev->usage = usage;
-				}
+				/* Interface Number */
+				if (read_sysfs_attr(node, "device/../bInterfaceNumber", str, sizeof(str)))
+					cur_dev->interface_number = strtol(str, NULL, 16);
+
+				break;
+
+			case BUS_BLUETOOTH:
+			case BUS_I2C:
+				/* Manufacturer and Product strings */
+				cur_dev->manufacturer_string = wcsdup(L"");
+				cur_dev->product_string = utf8_to_wchar_t(product_name_utf8);
+
+				break;
+
+			default:
+				/* Unknown device type - this should never happen, as we
+				 * check for USB and Bluetooth devices above */
+				break;
+		}
+
+		/* Usage Page and Usage */
+		result = get_hid_report_descriptor_from_sysfs(node, &report_desc);
+		if (result >= 0) {
+			unsigned short page = 0, usage = 0;
+			unsigned int pos = 0;
+			/*
+			 * Parse the first usage and usage page
+			 * out of the report descriptor.
+			 */
+			if (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+				cur_dev->usage_page = page;
+				cur_dev->usage = usage;
+			}
+
+			/*
+			 * Parse any additional usage and usage pages
+			 * out of the report descriptor.
+			 */
+			while (!get_next_hid_usage(report_desc.value, report_desc.size, &pos, &page, &usage)) {
+				/* Create new record for additional usage pairs */
+				tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+				cur_dev->next = tmp;
+				prev_dev = cur_dev;
+				cur_dev = tmp;
+
+				/* Update fields */
+				cur_dev->path = strdup(dev_path);
+				cur_dev->vendor_id = dev_vid;
+				cur_dev->product_id = dev_pid;
+				cur_dev->serial_number = prev_dev->serial_number? wcsdup(prev_dev->serial_number): NULL;
+				cur_dev->release_number = prev_dev->release_number;
+				cur_dev->interface_number = prev_dev->interface_number;
+				cur_dev->manufacturer_string = prev_dev->manufacturer_string? wcsdup(prev_dev->manufacturer_string): NULL;
+				cur_dev->product_string = prev_dev->product_string? wcsdup(prev_dev->product_string): NULL;
+				cur_dev->usage_page = page;
+				cur_dev->usage = usage;
 			}
 		}
 
-	next:
 		free(serial_number_utf8);
 		free(product_name_utf8);
-		udev_device_unref(raw_dev);
-		/* hid_dev, usb_dev and intf_dev don't need to be (and can't be)
-		   unref()d.  It will cause a double-free() error.  I'm not
-		   sure why.  */
 	}
-	/* Free the enumerator and udev objects. */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
+
+	closedir(dir);
 
 	return root;
 }
@@ -50,6 +50,7 @@
 #endif
 
 #include "hidapi.h"
+#include "hid-bulk.h"
 
 #if defined(__ANDROID__) && __ANDROID_API__ < __ANDROID_API_N__
 
@@ -154,6 +155,12 @@ struct hid_device_ {
 	/* The interface number of the HID */
 	int interface;
 
+	/* Vendor-class bulk interface of the same device, if it has one
+	   (bulk_out_endpoint is 0 otherwise) */
+	int bulk_interface;
+	int bulk_in_endpoint;
+	int bulk_out_endpoint;
+
 	/* Indexes of Strings */
 	int manufacturer_index;
 	int product_index;
@@ -885,6 +892,46 @@ static void *read_thread(void *param)
 }
 
 
+/* Look for a vendor-class interface with a bulk endpoint pair next to the HID one
+   and claim it, so that hid_bulk_write()/hid_bulk_read_timeout() can be used */
+static void claim_bulk_interface(hid_device *dev, const struct libusb_config_descriptor *conf_desc)
+{
+	int i, j;
+
+	for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		const struct libusb_interface_descriptor *intf_desc = &conf_desc->interface[j].altsetting[0];
+		int in = 0, out = 0;
+
+		if (conf_desc->interface[j].num_altsetting < 1 ||
+		    intf_desc->bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC)
+			continue;
+
+		for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *ep = &intf_desc->endpoint[i];
+
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+			if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
+				in = ep->bEndpointAddress;
+			else
+				out = ep->bEndpointAddress;
+		}
+
+		if (!in || !out)
+			continue;
+
+		if (libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber) < 0) {
+			LOG("can't claim bulk interface %d\n", intf_desc->bInterfaceNumber);
+			continue;
+		}
+
+		dev->bulk_interface = intf_desc->bInterfaceNumber;
+		dev->bulk_in_endpoint = in;
+		dev->bulk_out_endpoint = out;
+		return;
+	}
+}
+
 hid_device * HID_API_EXPORT hid_open_path(const char *path)
 {
 	hid_device *dev = NULL;
@@ -995,6 +1042,8 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
+						claim_bulk_interface(dev, conf_desc);
+
 						pthread_create(&dev->thread, NULL, read_thread, dev);
 
 						/* Wait here for the read thread to be initialized. */
@@ -1305,6 +1354,8 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
+	if (dev->bulk_out_endpoint)
+		libusb_release_interface(dev->device_handle, dev->bulk_interface);
 
 	/* reattach the kernel driver if it was detached */
 #ifdef DETACH_KERNEL_DRIVER
@@ -1329,6 +1380,43 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 }
 
 
+int HID_API_EXPORT hid_bulk_available(hid_device *dev)
+{
+	return dev->bulk_out_endpoint != 0;
+}
+
+int HID_API_EXPORT hid_bulk_write(hid_device *dev, const unsigned char *data, size_t length, int milliseconds)
+{
+	int res, actual_length;
+
+	if (!dev->bulk_out_endpoint)
+		return -1;
+
+	res = libusb_bulk_transfer(dev->device_handle, dev->bulk_out_endpoint,
+		(unsigned char *)data, length, &actual_length, milliseconds < 0 ? 0 : milliseconds);
+	if (res < 0 && res != LIBUSB_ERROR_TIMEOUT)
+		return -1;
+
+	return actual_length;
+}
+
+int HID_API_EXPORT hid_bulk_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	int res, actual_length;
+
+	if (!dev->bulk_in_endpoint)
+		return -1;
+
+	res = libusb_bulk_transfer(dev->device_handle, dev->bulk_in_endpoint,
+		data, length, &actual_length, milliseconds < 0 ? 0 : milliseconds);
+	if (res == LIBUSB_ERROR_TIMEOUT)
+		return 0;
+	if (res < 0)
+		return -1;
+
+	return actual_length;
+}
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
 	return hid_get_indexed_string(dev, dev->manufacturer_index, string, maxlen);
@@ -0,0 +1,897 @@
+/*
+* Mock hidapi backend: a simulated vibl bootloader, to try out vibl-flash and measure
+* its pacing without hardware. Build with BACKEND=mock.
+*
+* It can also play the keyboard firmware the bootloader was reached from: a Vial raw HID
+* interface that jumps to the bootloader when asked to, with the bootloader rebooting
+* back into it. The device is gone for a while whenever it resets.
+*
+* The simulated device keeps to real flash timing: programming a 64 byte page and
+* erasing a flash page take time, during which at most one more report is buffered.
+* Reports arriving while it is busy fail, like SET_REPORT does on older bootloaders,
+* or wait for room, like an interrupt OUT endpoint.
+*
+* Configured through the environment:
+*   VIBL_MOCK_FLASH_KB    flash size in K (64)
+*   VIBL_MOCK_PAGE_SIZE   erase page size (1024)
+*   VIBL_MOCK_PROGRAM_US  time to program 64 bytes (1700)
+*   VIBL_MOCK_ERASE_US    time to erase a page (20000)
+*   VIBL_MOCK_BUSY        "fail" or "block", what a report does while the device is busy (fail)
+*   VIBL_MOCK_FEATURES    feature flags to report (0xEF)
+*   VIBL_MOCK_UID         Vial keyboard UID as 16 hex digits (FFFFFFFFFFFFFFFF)
+*   VIBL_MOCK_IMAGE       file to load the application area from and save it back to
+*   VIBL_MOCK_VERBOSE     print what the device went through on exit
+*   VIBL_MOCK_FIRMWARE    start out running Vial firmware rather than the bootloader
+*   VIBL_MOCK_LOCKED      the firmware has to be unlocked first, the keys are taken as held
+*   VIBL_MOCK_RESET_MS    how long the device takes to show up again after a reset (400)
+*   VIBL_MOCK_LAUNCH_MS   the same after the launch command, which skips the reset (60)
+*   VIBL_MOCK_SESSION_MS  how long a flash or patch session waits for data before it is
+*                         given up on, 0 for ever (3000)
+*   VIBL_MOCK_DEVICES     how many bootloaders to list, "mock", "mock1"... each opening
+*                         the same device (1), for a fork to flash one while others do the rest
+*   VIBL_MOCK_BAD_PAGE    64-byte page of the application area that fails to program, -1 for
+*                         none (-1)
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "hidapi.h"
+#include "pacing.h"
+#include "protocol.h"
+#include "util.h"
+
+#define FLASH_BASE 0x08000000
+#define APP_BASE 0x08001000
+#define REPORT_SIZE 64
+#define MAX_REPLIES 8
+#define CYCLES_PER_US 72
+
+/* Vial firmware */
+#define RAW_REPORT_SIZE 32
+#define VIAL_PROTOCOL 6
+#define UNLOCK_POLLS 5
+
+enum {
+	STATE_INIT = 0,
+	STATE_FLASH,
+	STATE_PATCH,
+};
+
+struct hid_device_ {
+	int open;
+	int vial;
+};
+
+static struct {
+	/* configuration */
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint64_t program_us;
+	uint64_t erase_us;
+	int block;
+	int features;
+	uint8_t uid[8];
+	const char *image_path;
+	int verbose;
+	int firmware;
+	uint64_t reset_us;
+	uint64_t launch_us;
+	int devices;
+	uint64_t session_us;
+	long bad_page;
+
+	/* what the device is running, and when it is back after a reset */
+	int running_firmware;
+	uint64_t gone_until;
+	int locked;
+	int unlock_polls;
+	int launching;
+
+	/* the application area */
+	uint8_t *flash;
+	uint32_t app_size;
+
+	/* when the device is done with everything it was given */
+	uint64_t busy_until;
+
+	/* protocol */
+	int state;
+	uint32_t page, end;
+	int erased_ahead;
+	uint32_t image_id;
+	uint32_t checkpoint_image;
+	uint16_t checkpoint_page;
+	int abandoned_state;
+	uint8_t flash_error;
+	uint64_t last_report;
+
+	/* delta patches, see the bootloader */
+	struct {
+		uint32_t out, end;
+		uint16_t reports;
+		uint8_t op, argc, args[6], insert, error;
+		uint8_t page[2048];
+		uint8_t head[4];
+	} patch;
+
+	/* input reports waiting for the host, with the time they become available */
+	uint8_t replies[MAX_REPLIES][REPORT_SIZE];
+	uint64_t ready[MAX_REPLIES];
+	int head, count;
+
+	/* statistics */
+	long reports, rejected, erases;
+
+	/* the counters of the stats command, in its order, cycles at 72MHz */
+	uint32_t stats[STAT_COUNT];
+} mock;
+
+static struct hid_device_ device;
+static struct hid_device_ keyboard = {0, 1};
+
+static wchar_t serial[] = VIBL_SERIAL;
+static wchar_t product[] = L"vibl-HIDUSB (mock)";
+static wchar_t vial_serial[] = L"vial:f64c2b3c";
+static wchar_t vial_product[] = L"Vial keyboard (mock)";
+
+static long env_long(const char *name, long fallback) {
+	const char *value = getenv(name);
+
+	return value && *value ? strtol(value, NULL, 0) : fallback;
+}
+
+
+static void save_image(void) {
+	FILE *file;
+
+	if (!mock.image_path || !(file = fopen(mock.image_path, "wb")))
+		return;
+	fwrite(mock.flash, 1, mock.app_size, file);
+	fclose(file);
+}
+
+int HID_API_EXPORT hid_init(void) {
+	const char *uid = getenv("VIBL_MOCK_UID");
+	FILE *file;
+
+	if (mock.flash)
+		return 0;
+
+	mock.flash_size = env_long("VIBL_MOCK_FLASH_KB", 64) * 1024;
+	mock.page_size = env_long("VIBL_MOCK_PAGE_SIZE", 1024);
+	mock.program_us = env_long("VIBL_MOCK_PROGRAM_US", 1700);
+	mock.erase_us = env_long("VIBL_MOCK_ERASE_US", 20000);
+	mock.block = getenv("VIBL_MOCK_BUSY") && strcmp(getenv("VIBL_MOCK_BUSY"), "block") == 0;
+	mock.features = env_long("VIBL_MOCK_FEATURES", FEATURE_ERASE_AHEAD | FEATURE_RESUME | FEATURE_VERIFY |
+		FEATURE_DELTA | FEATURE_STATS | FEATURE_LAUNCH | FEATURE_ABORT);
+	mock.image_path = getenv("VIBL_MOCK_IMAGE");
+	mock.verbose = getenv("VIBL_MOCK_VERBOSE") != NULL;
+	mock.firmware = getenv("VIBL_MOCK_FIRMWARE") != NULL;
+	mock.running_firmware = mock.firmware;
+	mock.locked = getenv("VIBL_MOCK_LOCKED") != NULL;
+	mock.reset_us = env_long("VIBL_MOCK_RESET_MS", 400) * 1000;
+	mock.launch_us = env_long("VIBL_MOCK_LAUNCH_MS", 60) * 1000;
+	mock.devices = env_long("VIBL_MOCK_DEVICES", 1);
+	mock.session_us = env_long("VIBL_MOCK_SESSION_MS", 3000) * 1000;
+	mock.bad_page = env_long("VIBL_MOCK_BAD_PAGE", -1);
+
+	memset(mock.uid, 0xFF, sizeof(mock.uid));
+	for (int i = 0; uid && i < 8 && uid[2 * i] && uid[2 * i + 1]; ++i) {
+		char byte[3] = {uid[2 * i], uid[2 * i + 1], 0};
+
+		mock.uid[i] = strtol(byte, NULL, 16);
+	}
+
+	if (mock.page_size < REPORT_SIZE || mock.page_size > sizeof(mock.patch.page) || mock.flash_size <= APP_BASE - FLASH_BASE) {
+		fprintf(stderr, "mock: bad flash geometry\n");
+		return -1;
+	}
+
+	mock.app_size = mock.flash_size - (APP_BASE - FLASH_BASE);
+	if (!(mock.flash = malloc(mock.app_size)))
+		return -1;
+	memset(mock.flash, 0xFF, mock.app_size);
+
+	if (mock.image_path && (file = fopen(mock.image_path, "rb"))) {
+		if (fread(mock.flash, 1, mock.app_size, file) == 0)
+			fprintf(stderr, "mock: %s is empty\n", mock.image_path);
+		fclose(file);
+	}
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void) {
+	if (!mock.flash)
+		return 0;
+
+	if (mock.verbose)
+		fprintf(stderr, "mock: %ld reports, %ld rejected while busy, %ld pages erased\n",
+			mock.reports, mock.rejected, mock.erases);
+
+	save_image();
+	free(mock.flash);
+	mock.flash = NULL;
+	return 0;
+}
+
+struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id) {
+	struct hid_device_info *info;
+
+	if (hid_init() < 0 || pacing_now_us() < mock.gone_until || !(info = calloc(1, sizeof(*info))))
+		return NULL;
+
+	if (mock.running_firmware) {
+		info->path = strdup("mock-vial");
+		info->vendor_id = 0xFEED;
+		info->product_id = 0x0000;
+		info->serial_number = wcsdup(vial_serial);
+		info->manufacturer_string = wcsdup(vial_product);
+		info->product_string = wcsdup(vial_product);
+		info->usage_page = 0xFF60;
+		info->usage = 0x61;
+	} else {
+		info->path = strdup("mock");
+		info->vendor_id = VIBL_VID;
+		info->product_id = VIBL_PID;
+		info->serial_number = wcsdup(serial);
+		info->manufacturer_string = wcsdup(product);
+		info->product_string = wcsdup(product);
+		info->usage_page = 0xFF00;
+		info->usage = 0x01;
+
+		for (int i = mock.devices - 1; i > 0; --i) {
+			struct hid_device_info *more = calloc(1, sizeof(*more));
+			char path[16];
+
+			if (!more)
+				break;
+			*more = *info;
+			snprintf(path, sizeof(path), "mock%d", i);
+			more->path = strdup(path);
+			more->serial_number = wcsdup(serial);
+			more->manufacturer_string = wcsdup(product);
+			more->product_string = wcsdup(product);
+			more->next = info->next;
+			info->next = more;
+		}
+	}
+
+	if ((vendor_id && vendor_id != info->vendor_id) || (product_id && product_id != info->product_id)) {
+		hid_free_enumeration(info);
+		return NULL;
+	}
+
+	return info;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs) {
+	while (devs) {
+		struct hid_device_info *next = devs->next;
+
+		free(devs->path);
+		free(devs->serial_number);
+		free(devs->manufacturer_string);
+		free(devs->product_string);
+		free(devs);
+		devs = next;
+	}
+}
+
+HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path) {
+	hid_device *dev = mock.running_firmware ? &keyboard : &device;
+	int index = 0;
+
+	if (hid_init() < 0 || pacing_now_us() < mock.gone_until || dev->open)
+		return NULL;
+
+	if (mock.running_firmware ? strcmp(path, "mock-vial") != 0 :
+			strcmp(path, "mock") != 0 && (sscanf(path, "mock%d", &index) != 1 || index < 1 || index >= mock.devices))
+		return NULL;
+
+	dev->open = 1;
+	return dev;
+}
+
+void HID_API_EXPORT HID_API_CALL hid_close(hid_device *dev) {
+	if (dev)
+		dev->open = 0;
+}
+
+static void reply(const uint8_t *data, size_t len, uint64_t ready) {
+	int slot;
+
+	if (mock.count == MAX_REPLIES)
+		return;
+
+	slot = (mock.head + mock.count++) % MAX_REPLIES;
+	memset(mock.replies[slot], 0, REPORT_SIZE);
+	memcpy(mock.replies[slot], data, len);
+	mock.ready[slot] = ready;
+}
+
+/* the device resets at time at into the firmware or the bootloader, dropping whatever it
+   was doing, and is gone for gone_us */
+static void reset(int firmware, uint64_t at, uint64_t gone_us) {
+	mock.running_firmware = firmware;
+	mock.gone_until = at + gone_us;
+	mock.state = STATE_INIT;
+	mock.count = 0;
+}
+
+/* a raw HID report to the Vial firmware, which answers all of them with a report of its own */
+static void vial_report(const uint8_t *report, uint64_t now) {
+	uint8_t answer[RAW_REPORT_SIZE];
+
+	memcpy(answer, report, sizeof(answer));
+
+	/* VIA's bootloader jump, refused while Vial is locked */
+	if (report[0] == 0x0B) {
+		if (!mock.locked)
+			reset(0, now, mock.reset_us);
+		return;
+	}
+
+	if (report[0] == 0xFE) {
+		switch (report[1]) {
+		case 0x00:
+			memset(answer, 0, sizeof(answer));
+			put_u32(answer, VIAL_PROTOCOL);
+			memcpy(&answer[4], mock.uid, sizeof(mock.uid));
+			break;
+		case 0x05:
+			/* the keys to hold for unlocking follow, a single one at row 0, column 0 here */
+			memset(answer, 0xFF, sizeof(answer));
+			answer[0] = !mock.locked;
+			answer[1] = mock.unlock_polls > 0;
+			answer[2] = answer[3] = 0;
+			break;
+		case 0x06:
+			mock.unlock_polls = UNLOCK_POLLS;
+			break;
+		case 0x07:
+			if (mock.unlock_polls && --mock.unlock_polls == 0)
+				mock.locked = 0;
+			answer[0] = !mock.locked;
+			answer[1] = mock.unlock_polls > 0;
+			answer[2] = mock.unlock_polls;
+			break;
+		}
+	}
+
+	reply(answer, sizeof(answer), now);
+}
+
+/* A/B slots as the bootloader lays them out, offsets into the application area. The
+   record takes two pages, each starting with a header holding its generation. */
+#define SLOT_RECORD_MAGIC 0x42415653
+#define SLOT_PAGE_MAGIC 0x50415653
+
+static uint32_t slot_size(void) {
+	return ((mock.app_size - 2 * mock.page_size) / 2) & ~(mock.page_size - 1);
+}
+
+static uint32_t record_offset(void) {
+	return mock.app_size - 2 * mock.page_size;
+}
+
+static int slot_valid(uint32_t slot, uint32_t size, uint32_t crc) {
+	uint32_t base = slot * slot_size();
+
+	return slot < 2 && size && size <= slot_size() && (get_u32(mock.flash + base) & 0x2FFE0000) == 0x20000000 &&
+		crc32(mock.flash + base, size) == crc;
+}
+
+static int record_page_started(uint32_t page) {
+	const uint8_t *header = mock.flash + record_offset() + page * mock.page_size;
+
+	return get_u32(header) == SLOT_PAGE_MAGIC && get_u32(header + 8) == ~get_u32(header + 4) &&
+		get_u32(header + 12) == SLOT_PAGE_MAGIC;
+}
+
+/* the record page entries go to, -1 before the first one is written */
+static int current_record_page(void) {
+	const uint8_t *record = mock.flash + record_offset();
+
+	if (!record_page_started(0))
+		return record_page_started(1) ? 1 : -1;
+	if (!record_page_started(1))
+		return 0;
+	return (int32_t)(get_u32(record + mock.page_size + 4) - get_u32(record + 4)) > 0;
+}
+
+static int search_record_page(int page, uint32_t *slot) {
+	const uint8_t *record = mock.flash + record_offset() + page * mock.page_size;
+	int count = 1;
+
+	if (!record_page_started(page))
+		return 0;
+
+	while (count < (int)(mock.page_size / 16) && get_u32(record + count * 16) != 0xFFFFFFFF)
+		++count;
+
+	while (--count > 0) {
+		const uint8_t *entry = record + count * 16;
+
+		if (get_u32(entry) == SLOT_RECORD_MAGIC && slot_valid(get_u32(entry + 4), get_u32(entry + 8), get_u32(entry + 12))) {
+			*slot = get_u32(entry + 4);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t select_slot(void) {
+	int page = current_record_page();
+	uint32_t slot = 0;
+
+	if (page >= 0 && !search_record_page(page, &slot))
+		search_record_page(!page, &slot);
+
+	return slot;
+}
+
+static int pages_in_flash(uint32_t first, uint32_t end) {
+	uint32_t limit = (mock.features & FEATURE_AB_SLOTS) ? record_offset() : mock.app_size;
+
+	return first < end && end * REPORT_SIZE <= limit;
+}
+
+static uint64_t erase(uint32_t offset) {
+	memset(mock.flash + offset, 0xFF, mock.page_size);
+	++mock.erases;
+	++mock.stats[STAT_ERASES];
+	return mock.erase_us;
+}
+
+static uint64_t patch_flush(void) {
+	uint32_t fill = mock.patch.out & (mock.page_size - 1);
+	uint32_t base = (mock.patch.out - 1) & ~(mock.page_size - 1);
+
+	if (fill)
+		memset(mock.patch.page + fill, 0xFF, mock.page_size - fill);
+	/* the stack pointer is programmed last, once the whole patch made it */
+	if (base == 0) {
+		memcpy(mock.patch.head, mock.patch.page, sizeof(mock.patch.head));
+		memset(mock.patch.page, 0xFF, sizeof(mock.patch.head));
+	}
+	memcpy(mock.flash + base, mock.patch.page, mock.page_size);
+	++mock.erases;
+	++mock.stats[STAT_ERASES];
+	mock.stats[STAT_PROGRAMMED] += mock.page_size;
+
+	return mock.erase_us + mock.page_size / REPORT_SIZE * mock.program_us;
+}
+
+static uint64_t patch_output(uint8_t b) {
+	if (mock.patch.out >= mock.patch.end) {
+		mock.patch.error = 3;
+		return 0;
+	}
+
+	mock.patch.page[mock.patch.out & (mock.page_size - 1)] = b;
+	return (++mock.patch.out & (mock.page_size - 1)) == 0 ? patch_flush() : 0;
+}
+
+static uint64_t patch_byte(uint8_t b) {
+	uint64_t cost = 0;
+
+	if (mock.patch.insert) {
+		--mock.patch.insert;
+		return patch_output(b);
+	}
+
+	if (mock.patch.argc == 0 && mock.patch.op == 0) {
+		if (b > 2)
+			mock.patch.error = 2;
+		mock.patch.op = b;
+		return 0;
+	}
+
+	mock.patch.args[mock.patch.argc++] = b;
+	if (mock.patch.op == 2) {
+		mock.patch.insert = b;
+	} else if (mock.patch.argc < 6) {
+		return 0;
+	} else {
+		uint32_t src = mock.patch.args[0] | (mock.patch.args[1] << 8) | (mock.patch.args[2] << 16) | ((uint32_t)mock.patch.args[3] << 24);
+		uint16_t length = mock.patch.args[4] | (mock.patch.args[5] << 8);
+
+		for (; length && !mock.patch.error; --length, ++src) {
+			if (src < (mock.patch.out & ~(mock.page_size - 1)) || src >= mock.app_size) {
+				mock.patch.error = 1;
+				break;
+			}
+			cost += patch_output(mock.flash[src]);
+		}
+	}
+	mock.patch.op = 0;
+	mock.patch.argc = 0;
+
+	return cost;
+}
+
+/* act on a report arriving at start; returns how long the device is busy with it */
+static uint64_t handle_report(const uint8_t *report, uint64_t start) {
+	uint8_t answer[REPORT_SIZE];
+	uint64_t cost = 0;
+
+	memset(answer, 0, sizeof(answer));
+
+	if (mock.state == STATE_FLASH) {
+		uint32_t offset = mock.page * REPORT_SIZE;
+
+		if ((offset & (mock.page_size - 1)) == 0 && !mock.erased_ahead)
+			cost += erase(offset);
+		memcpy(mock.flash + offset, report, REPORT_SIZE);
+		cost += mock.program_us;
+		mock.stats[STAT_PROGRAMMED] += REPORT_SIZE;
+
+		/* like the bootloader, the checkpoint stops at the first page that failed */
+		if (mock.page == mock.bad_page && !mock.flash_error) {
+			mock.flash_error = 1;
+			++mock.stats[STAT_FLASH_ERRORS];
+		}
+		++mock.page;
+		if (!mock.flash_error) {
+			mock.checkpoint_image = mock.image_id;
+			mock.checkpoint_page = mock.page;
+		}
+		if (mock.page == mock.end)
+			mock.state = STATE_INIT;
+		return cost;
+	}
+
+	if (mock.state == STATE_PATCH) {
+		for (int i = 0; i < REPORT_SIZE && !mock.patch.error; ++i)
+			cost += patch_byte(report[i]);
+
+		if (--mock.patch.reports == 0) {
+			if (!mock.patch.error && (mock.patch.out != mock.patch.end || mock.patch.insert || mock.patch.argc))
+				mock.patch.error = 3;
+			if (!mock.patch.error && (mock.patch.out & (mock.page_size - 1)))
+				cost += patch_flush();
+			if (!mock.patch.error)
+				memcpy(mock.flash, mock.patch.head, sizeof(mock.patch.head));
+
+			answer[0] = 'V';
+			answer[1] = 'C';
+			answer[2] = VIBL_CMD_PATCH;
+			answer[3] = mock.patch.error;
+			put_u32(&answer[4], crc32(mock.flash, mock.patch.end));
+			reply(answer, 8, start + cost);
+			mock.state = STATE_INIT;
+		}
+		return cost;
+	}
+
+	if (report[0] != 'V' || report[1] != 'C')
+		return 0;
+
+	switch (report[2]) {
+	case VIBL_CMD_IDENT:
+		answer[0] = 1;
+		answer[1] = mock.features;
+		answer[2] = (mock.flash_size / 1024) & 0xFF;
+		answer[3] = (mock.flash_size / 1024) >> 8;
+		answer[4] = mock.page_size & 0xFF;
+		answer[5] = mock.page_size >> 8;
+		answer[6] = REPORT_SIZE;
+		answer[7] = (APP_BASE - FLASH_BASE) / 1024;
+		reply(answer, 8, start);
+		break;
+	case VIBL_CMD_GET_VIAL_ID:
+		reply(mock.uid, sizeof(mock.uid), start);
+		break;
+	case VIBL_CMD_FLASH:
+		mock.page = report[6] | (report[7] << 8);
+		mock.end = mock.page + (report[3] | (report[4] << 8));
+		mock.image_id = report[8] | (report[9] << 8) | (report[10] << 16) | ((uint32_t)report[11] << 24);
+		if (!pages_in_flash(mock.page, mock.end))
+			break;
+		mock.state = STATE_FLASH;
+		mock.abandoned_state = STATE_INIT;
+		mock.flash_error = 0;
+		mock.erased_ahead = (mock.features & FEATURE_ERASE_AHEAD) && (report[5] & FLASH_FLAG_ERASE_AHEAD);
+		if (mock.erased_ahead) {
+			uint32_t first = (mock.page * REPORT_SIZE + mock.page_size - 1) & ~(mock.page_size - 1);
+			uint32_t last = mock.end * REPORT_SIZE;
+			uint16_t total = first < last ? (last - first + mock.page_size - 1) / mock.page_size : 0;
+			/* progress goes out while erasing, spread over what the host can have waiting */
+			uint16_t every = total / (MAX_REPLIES - 1) + 1;
+			uint16_t erased = 0;
+
+			answer[0] = 0x02;
+			answer[4] = total & 0xFF;
+			answer[5] = total >> 8;
+			for (uint32_t offset = first; offset < last; offset += mock.page_size) {
+				cost += erase(offset);
+				if (++erased % every == 0 && erased < total) {
+					answer[2] = erased & 0xFF;
+					answer[3] = erased >> 8;
+					reply(answer, 6, start + cost);
+				}
+			}
+			answer[1] = 1;
+			answer[2] = erased & 0xFF;
+			answer[3] = erased >> 8;
+			reply(answer, 6, start + cost);
+		}
+		break;
+	case VIBL_CMD_STAY:
+		/* there's no idle boot here to hold off */
+		break;
+	case VIBL_CMD_REBOOT:
+		save_image();
+		if (mock.firmware)
+			reset(1, start, mock.reset_us);
+		break;
+	case VIBL_CMD_GET_CHECKPOINT:
+		put_u32(answer, mock.checkpoint_image);
+		answer[4] = mock.checkpoint_page & 0xFF;
+		answer[5] = mock.checkpoint_page >> 8;
+		answer[6] = mock.abandoned_state;
+		answer[7] = mock.flash_error;
+		reply(answer, 8, start);
+		break;
+	case VIBL_CMD_GET_CRC: {
+		uint32_t first = report[3] | (report[4] << 8);
+		uint32_t count = report[5] | (report[6] << 8);
+
+		if (!pages_in_flash(first, first + count))
+			count = 0;
+		put_u32(answer, crc32(mock.flash + first * REPORT_SIZE, count * REPORT_SIZE));
+		/* the CPU reads flash at about a byte per cycle of the CRC loop */
+		cost = count * REPORT_SIZE / 8;
+		reply(answer, 4, start + cost);
+		break;
+	}
+	case VIBL_CMD_GET_CAPABILITIES:
+		answer[0] = 'V';
+		answer[1] = 'C';
+		answer[2] = VIBL_CMD_GET_CAPABILITIES;
+		answer[3] = 1;
+		answer[4] = mock.features & 0xFF;
+		answer[5] = mock.features >> 8;
+		answer[6] = REPORT_SIZE;
+		put_u32(&answer[8], mock.flash_size);
+		put_u32(&answer[12], APP_BASE);
+		answer[16] = mock.page_size & 0xFF;
+		answer[17] = mock.page_size >> 8;
+		answer[18] = 2;
+		memcpy(&answer[24], mock.uid, sizeof(mock.uid));
+		reply(answer, 32, start);
+		break;
+	case VIBL_CMD_SLOTS: {
+		uint32_t active;
+
+		if (!(mock.features & FEATURE_AB_SLOTS))
+			break;
+		active = select_slot();
+		answer[0] = 'V';
+		answer[1] = 'C';
+		answer[2] = VIBL_CMD_SLOTS;
+		if (report[3] == 1) {
+			uint32_t slot = report[4];
+			int valid = slot_valid(slot, get_u32(&report[8]), get_u32(&report[12]));
+
+			cost = get_u32(&report[8]) / 8;
+			if (valid && slot != active) {
+				int page = current_record_page();
+				uint8_t *record = mock.flash + record_offset() + (page > 0) * mock.page_size;
+				uint32_t i = 1;
+
+				while (page >= 0 && i < mock.page_size / 16 && get_u32(record + i * 16) != 0xFFFFFFFF)
+					++i;
+				if (page < 0 || i == mock.page_size / 16) {
+					uint32_t generation = page >= 0 ? get_u32(record + 4) + 1 : 0;
+
+					record = mock.flash + record_offset() + (page == 0) * mock.page_size;
+					cost += erase(record - mock.flash);
+					put_u32(record, SLOT_PAGE_MAGIC);
+					put_u32(record + 4, generation);
+					put_u32(record + 8, ~generation);
+					put_u32(record + 12, SLOT_PAGE_MAGIC);
+					i = 1;
+				}
+				put_u32(record + i * 16, SLOT_RECORD_MAGIC);
+				put_u32(record + i * 16 + 4, slot);
+				memcpy(record + i * 16 + 8, &report[8], 8);
+				active = select_slot();
+			}
+			answer[3] = !valid || active != slot;
+		}
+		answer[4] = active;
+		answer[5] = 2;
+		put_u32(&answer[8], APP_BASE);
+		put_u32(&answer[12], APP_BASE + slot_size());
+		put_u32(&answer[16], slot_size());
+		reply(answer, 20, start + cost);
+		break;
+	}
+	case VIBL_CMD_STATS:
+		if (!(mock.features & FEATURE_STATS))
+			break;
+		answer[0] = 'V';
+		answer[1] = 'C';
+		answer[2] = VIBL_CMD_STATS;
+		answer[3] = STAT_COUNT;
+		for (int i = 0; i < STAT_COUNT; ++i)
+			put_u32(&answer[4 + 4 * i], mock.stats[i]);
+		put_u32(&answer[60], CYCLES_PER_US * 1000000);
+		reply(answer, 64, start);
+		if (report[3] & 0x01)
+			memset(mock.stats, 0, sizeof(mock.stats));
+		break;
+	case VIBL_CMD_PMA_BENCH:
+		/* there's no packet memory to time here, no copies were made */
+		if (!(mock.features & FEATURE_STATS))
+			break;
+		answer[0] = 'V';
+		answer[1] = 'C';
+		answer[2] = VIBL_CMD_PMA_BENCH;
+		reply(answer, 16, start);
+		break;
+	case VIBL_CMD_LAUNCH: {
+		/* the application starts once the answer has been read */
+		uint32_t base = (mock.features & FEATURE_AB_SLOTS) ? select_slot() * slot_size() : 0;
+		uint32_t size = get_u32(&report[4]);
+
+		if (!(mock.features & FEATURE_LAUNCH))
+			break;
+		answer[0] = 'V';
+		answer[1] = 'C';
+		answer[2] = VIBL_CMD_LAUNCH;
+		answer[3] = (get_u32(mock.flash + base) & 0x2FFE0000) != 0x20000000 || size > mock.app_size - base ||
+			(size && crc32(mock.flash + base, size) != get_u32(&report[8]));
+		reply(answer, 4, start);
+		mock.launching = !answer[3];
+		break;
+	}
+	case VIBL_CMD_PATCH:
+		if (!(mock.features & FEATURE_DELTA))
+			break;
+		memset(&mock.patch, 0, sizeof(mock.patch));
+		mock.patch.end = (report[3] | (report[4] << 8)) * REPORT_SIZE;
+		mock.patch.reports = report[5] | (report[6] << 8);
+		if (pages_in_flash(0, mock.patch.end / REPORT_SIZE) && mock.patch.reports) {
+			mock.checkpoint_image = 0;
+			mock.checkpoint_page = 0;
+			mock.state = STATE_PATCH;
+			mock.abandoned_state = STATE_INIT;
+			mock.flash_error = 0;
+		}
+		break;
+	}
+
+	return cost;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_write(hid_device *dev, const unsigned char *data, size_t length) {
+	uint8_t report[REPORT_SIZE];
+	uint64_t now = pacing_now_us();
+	uint64_t cost, quiet_since;
+
+	if (!dev || !dev->open || length < 1 || now < mock.gone_until || dev->vial != mock.running_firmware)
+		return -1;
+
+	if (dev->vial) {
+		memset(report, 0, sizeof(report));
+		memcpy(report, data + 1, length - 1 < RAW_REPORT_SIZE ? length - 1 : RAW_REPORT_SIZE);
+		vial_report(report, now);
+		return length;
+	}
+
+	/* one report may still be in the works while the next one waits in the other buffer */
+	if (mock.busy_until > now + mock.program_us) {
+		++mock.stats[STAT_WAITING];
+		if (!mock.block) {
+			++mock.rejected;
+			return -1;
+		}
+		usleep(mock.busy_until - mock.program_us - now);
+		now = pacing_now_us();
+	}
+
+	memset(report, 0, sizeof(report));
+	memcpy(report, data + 1, length - 1 < REPORT_SIZE ? length - 1 : REPORT_SIZE);
+	++mock.reports;
+
+	/* a session the host left alone for too long was given up on in the meantime; the
+	   device only starts waiting once its own work is done */
+	quiet_since = mock.last_report > mock.busy_until ? mock.last_report : mock.busy_until;
+	if (mock.state != STATE_INIT && mock.session_us && now > quiet_since && now - quiet_since > mock.session_us) {
+		mock.abandoned_state = mock.state;
+		mock.state = STATE_INIT;
+		++mock.stats[STAT_SESSION_TIMEOUTS];
+	}
+	mock.last_report = now;
+
+	if (mock.busy_until < now)
+		mock.busy_until = now;
+	++mock.stats[STAT_PACKETS_EP2];
+	cost = handle_report(report, mock.busy_until);
+	mock.busy_until += cost;
+
+	/* all the work is flash work here, done in the interrupt as on the device */
+	mock.stats[STAT_FLASH_BUSY] += cost * CYCLES_PER_US;
+	mock.stats[STAT_ISR_TOTAL] += cost * CYCLES_PER_US;
+	if (cost * CYCLES_PER_US > mock.stats[STAT_FLASH_BUSY_MAX])
+		mock.stats[STAT_FLASH_BUSY_MAX] = mock.stats[STAT_ISR_MAX] = cost * CYCLES_PER_US;
+
+	return length;
+}
+
+/* the only feature report is the one calling off the session, which the device takes on
+   the control endpoint whatever state it is in */
+int HID_API_EXPORT HID_API_CALL hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length) {
+	if (!dev || !dev->open || length < 1 || pacing_now_us() < mock.gone_until || dev->vial
+			|| !(mock.features & FEATURE_ABORT))
+		return -1;
+
+	if (mock.state != STATE_INIT) {
+		mock.abandoned_state = mock.state;
+		mock.state = STATE_INIT;
+	}
+	return length;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds) {
+	uint64_t now = pacing_now_us();
+	uint64_t ready;
+	size_t n = length < REPORT_SIZE ? length : REPORT_SIZE;
+
+	if (!dev || !dev->open || dev->vial != mock.running_firmware)
+		return -1;
+
+	if (mock.count == 0) {
+		/* nothing is ever coming, don't hang a blocking read */
+		if (milliseconds < 0)
+			return -1;
+		usleep(milliseconds * 1000);
+		return 0;
+	}
+
+	ready = mock.ready[mock.head];
+	if (ready > now) {
+		if (milliseconds >= 0 && ready > now + milliseconds * 1000ULL) {
+			usleep(milliseconds * 1000);
+			return 0;
+		}
+		usleep(ready - now);
+	}
+
+	memcpy(data, mock.replies[mock.head], n);
+	mock.head = (mock.head + 1) % MAX_REPLIES;
+	mock.count--;
+
+	if (mock.launching && mock.count == 0) {
+		mock.launching = 0;
+		save_image();
+		reset(mock.firmware, pacing_now_us(), mock.launch_us);
+	}
+
+	return n;
+}
+
+int HID_API_EXPORT HID_API_CALL hid_read(hid_device *dev, unsigned char *data, size_t length) {
+	return hid_read_timeout(dev, data, length, -1);
+}
@@ -0,0 +1,317 @@
+/*
+* ELF, Intel HEX and UF2 loaders
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "loaders.h"
+
+#define ELF_PT_LOAD 1
+
+#define UF2_BLOCK_SIZE 512
+#define UF2_MAGIC_START0 0x0A324655
+#define UF2_MAGIC_START1 0x9E5D5157
+#define UF2_MAGIC_END 0x0AB16F30
+#define UF2_FLAG_NOT_MAIN_FLASH 0x00000001
+#define UF2_FLAG_FAMILY_ID 0x00002000
+#define UF2_FAMILY_STM32F1 0x5EE21072
+
+static uint16_t get_u16(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* append a copy of length bytes at address; returns 0 on success */
+static int add_segment(struct segment_list *list, uint32_t address, const uint8_t *data, uint32_t length) {
+	struct segment *segment;
+
+	if (length == 0)
+		return 0;
+
+	if ((uint64_t)address + length > 0x100000000ULL) {
+		printf("Error: data at 0x%08X runs past the end of the address space\n", address);
+		return 1;
+	}
+
+	if (list->count == list->capacity) {
+		int capacity = list->capacity ? list->capacity * 2 : 16;
+		struct segment *segments = realloc(list->segments, capacity * sizeof(*segments));
+
+		if (!segments)
+			goto nomem;
+		list->segments = segments;
+		list->capacity = capacity;
+	}
+
+	segment = &list->segments[list->count];
+	if (!(segment->data = malloc(length)))
+		goto nomem;
+	memcpy(segment->data, data, length);
+	segment->address = address;
+	segment->length = length;
+	list->count++;
+	return 0;
+
+nomem:
+	printf("Failed to allocate memory for firmware data.\n");
+	return 1;
+}
+
+static int compare_segments(const void *a, const void *b) {
+	const struct segment *x = a, *y = b;
+
+	return x->address < y->address ? -1 : x->address > y->address;
+}
+
+/* sort the segments and merge the ones that touch; returns 0 on success, 1 when any overlap */
+static int merge_segments(struct segment_list *list) {
+	int out = 0;
+	int i;
+
+	qsort(list->segments, list->count, sizeof(*list->segments), compare_segments);
+
+	for (i = 1; i < list->count; ++i) {
+		struct segment *prev = &list->segments[out];
+		struct segment *cur = &list->segments[i];
+		uint8_t *data;
+
+		if (cur->address < prev->address + prev->length) {
+			printf("Error: firmware data overlaps at 0x%08X\n", cur->address);
+			goto error;
+		}
+
+		if (cur->address > prev->address + prev->length) {
+			list->segments[++out] = *cur;
+			continue;
+		}
+
+		if (!(data = realloc(prev->data, prev->length + cur->length))) {
+			printf("Failed to allocate memory for firmware data.\n");
+			goto error;
+		}
+		memcpy(data + prev->length, cur->data, cur->length);
+		free(cur->data);
+		prev->data = data;
+		prev->length += cur->length;
+	}
+	if (list->count)
+		list->count = out + 1;
+
+	return 0;
+
+error:
+	/* keep the list owning each buffer exactly once, so that it can be freed */
+	memmove(&list->segments[out + 1], &list->segments[i], (list->count - i) * sizeof(*list->segments));
+	list->count = out + 1 + list->count - i;
+	return 1;
+}
+
+/* 32-bit little-endian ELF: every PT_LOAD program header with file contents goes to its physical address */
+static int load_elf(const uint8_t *file, long size, struct segment_list *list) {
+	uint32_t phoff;
+	uint16_t phentsize, phnum;
+
+	if (size < 52 || file[4] != 1 || file[5] != 1) {
+		printf("Error: only 32-bit little-endian ELF files are supported\n");
+		return 1;
+	}
+
+	phoff = get_u32(&file[28]);
+	phentsize = get_u16(&file[42]);
+	phnum = get_u16(&file[44]);
+	if (phentsize < 32 || phoff + (uint64_t)phentsize * phnum > (uint64_t)size) {
+		printf("Error: ELF program headers are truncated\n");
+		return 1;
+	}
+
+	for (int i = 0; i < phnum; ++i) {
+		const uint8_t *ph = file + phoff + (size_t)i * phentsize;
+		uint32_t offset = get_u32(&ph[4]);
+		uint32_t paddr = get_u32(&ph[12]);
+		uint32_t filesz = get_u32(&ph[16]);
+
+		if (get_u32(&ph[0]) != ELF_PT_LOAD || filesz == 0)
+			continue;
+
+		if (offset + (uint64_t)filesz > (uint64_t)size) {
+			printf("Error: ELF segment %d is truncated\n", i);
+			return 1;
+		}
+
+		if (add_segment(list, paddr, file + offset, filesz))
+			return 1;
+	}
+
+	return 0;
+}
+
+static int hex_byte(const uint8_t *text) {
+	int value = 0;
+
+	for (int i = 0; i < 2; ++i) {
+		uint8_t c = text[i];
+
+		value <<= 4;
+		if (c >= '0' && c <= '9')
+			value |= c - '0';
+		else if (c >= 'A' && c <= 'F')
+			value |= c - 'A' + 10;
+		else if (c >= 'a' && c <= 'f')
+			value |= c - 'a' + 10;
+		else
+			return -1;
+	}
+
+	return value;
+}
+
+static int load_ihex(const uint8_t *file, long size, struct segment_list *list) {
+	uint32_t base = 0;
+	int line = 0;
+	long pos = 0;
+
+	while (pos < size) {
+		uint8_t record[5 + 255];
+		int count, type, sum = 0;
+
+		/* skip line endings and blank lines */
+		if (file[pos] == '\r' || file[pos] == '\n' || file[pos] == ' ' || file[pos] == '\t') {
+			line += file[pos] == '\n';
+			++pos;
+			continue;
+		}
+
+		if (file[pos] != ':' || pos + 11 > size || (count = hex_byte(&file[pos + 1])) < 0 || pos + 11 + 2 * count > size)
+			goto bad;
+
+		/* count, address, type, data and checksum */
+		for (int i = 0; i < count + 5; ++i) {
+			int value = hex_byte(&file[pos + 1 + 2 * i]);
+
+			if (value < 0)
+				goto bad;
+			record[i] = value;
+			sum += value;
+		}
+		if (sum & 0xFF)
+			goto bad;
+		pos += 11 + 2 * count;
+
+		type = record[3];
+		switch (type) {
+		case 0x00: /* data */
+			if (add_segment(list, base + (record[1] << 8 | record[2]), &record[4], count))
+				return 1;
+			break;
+		case 0x01: /* end of file */
+			return 0;
+		case 0x02: /* extended segment address */
+			if (count != 2)
+				goto bad;
+			base = (record[4] << 8 | record[5]) << 4;
+			break;
+		case 0x04: /* extended linear address */
+			if (count != 2)
+				goto bad;
+			base = (uint32_t)(record[4] << 8 | record[5]) << 16;
+			break;
+		case 0x03: /* start segment address */
+		case 0x05: /* start linear address */
+			break;
+		default:
+			goto bad;
+		}
+	}
+
+	printf("Error: Intel HEX file has no end of file record\n");
+	return 1;
+
+bad:
+	printf("Error: bad Intel HEX record on line %d\n", line + 1);
+	return 1;
+}
+
+static int load_uf2(const uint8_t *file, long size, struct segment_list *list) {
+	if (size % UF2_BLOCK_SIZE) {
+		printf("Error: UF2 file isn't made of whole blocks\n");
+		return 1;
+	}
+
+	for (long pos = 0; pos < size; pos += UF2_BLOCK_SIZE) {
+		const uint8_t *block = file + pos;
+		uint32_t flags = get_u32(&block[8]);
+		uint32_t payload = get_u32(&block[16]);
+
+		if (get_u32(&block[0]) != UF2_MAGIC_START0 || get_u32(&block[4]) != UF2_MAGIC_START1
+				|| get_u32(&block[UF2_BLOCK_SIZE - 4]) != UF2_MAGIC_END || payload > 476) {
+			printf("Error: bad UF2 block %ld\n", pos / UF2_BLOCK_SIZE);
+			return 1;
+		}
+
+		if (flags & UF2_FLAG_NOT_MAIN_FLASH)
+			continue;
+
+		if ((flags & UF2_FLAG_FAMILY_ID) && get_u32(&block[28]) != UF2_FAMILY_STM32F1) {
+			printf("Error: UF2 file is for another chip family (0x%08X)\n", get_u32(&block[28]));
+			return 1;
+		}
+
+		if (add_segment(list, get_u32(&block[12]), &block[32], payload))
+			return 1;
+	}
+
+	return 0;
+}
+
+int load_segments(const uint8_t *file, long size, struct segment_list *list) {
+	int error;
+
+	memset(list, 0, sizeof(*list));
+
+	if (size >= 4 && memcmp(file, "\x7F" "ELF", 4) == 0)
+		error = load_elf(file, size, list);
+	else if (size >= 8 && get_u32(&file[0]) == UF2_MAGIC_START0 && get_u32(&file[4]) == UF2_MAGIC_START1)
+		error = load_uf2(file, size, list);
+	/* a flat binary starts with the initial stack pointer, which can't look like this */
+	else if (size >= 1 && file[0] == ':')
+		error = load_ihex(file, size, list);
+	else
+		return 0;
+
+	if (!error && list->count == 0) {
+		printf("Error: the firmware file has nothing to flash\n");
+		error = 1;
+	}
+
+	if (error || merge_segments(list)) {
+		free_segments(list);
+		return -1;
+	}
+
+	return 1;
+}
+
+void free_segments(struct segment_list *list) {
+	for (int i = 0; i < list->count; ++i)
+		free(list->segments[i].data);
+	free(list->segments);
+	memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,28 @@
+#ifndef LOADERS_H
+#define LOADERS_H
+
+#include <stdint.h>
+
+/* Firmware formats that describe where each piece of the image goes: ELF (the program
+   headers), Intel HEX and UF2. They load into a list of segments at absolute addresses,
+   sorted and with touching pieces merged, so that gaps between them need not be sent. */
+
+struct segment {
+	uint32_t address;
+	uint32_t length;
+	uint8_t *data;
+};
+
+struct segment_list {
+	struct segment *segments;
+	int count;
+	int capacity;
+};
+
+/* load file if it is in one of the formats above; returns 1 on success, 0 if the file
+   isn't in any of them and -1 after printing why it couldn't be loaded */
+int load_segments(const uint8_t *file, long size, struct segment_list *list);
+
+void free_segments(struct segment_list *list);
+
+#endif
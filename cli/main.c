@@ -21,212 +21,1574 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <sys/stat.h>
+#endif
 
 #include "hidapi.h"
+#ifdef HID_BULK
+#include "hid-bulk.h"
+#endif
 #include "sha256.h"
+#include "patch.h"
+#include "vfw.h"
+#include "loaders.h"
+#include "pacing.h"
+#include "verify.h"
+#include "trace.h"
+#include "vial.h"
+#include "flashd.h"
+#include "bench.h"
+#include "util.h"
+#include "protocol.h"
 
 #define VIAL_ID_SIZE 8
 #define FLASH_PAGE_SIZE 64
 
-static const uint8_t CMD_BOOTLOADER_IDENT[8] = {'V','C',0x00};
-static const uint8_t CMD_GET_VIAL_ID[8] = {'V','C',0x01};
-static const uint8_t CMD_FLASH[8] = {'V','C',0x02};
-static const uint8_t CMD_REBOOT[8] = {'V','C',0x03};
+/* images coming through a pipe are read and flashed in blocks of this size, a multiple of every erase page */
+#define STREAM_BLOCK 8192
+
+/* formats that have to be read whole from a pipe are buffered up to this size */
+#define MAX_STREAM_SIZE (16L * 1024 * 1024)
+
+/* where the application lives on bootloaders that don't say */
+#define DEFAULT_APP_BASE 0x08001000
+
+static const uint8_t CMD_BOOTLOADER_IDENT[8] = {'V','C',VIBL_CMD_IDENT};
+static const uint8_t CMD_GET_VIAL_ID[8] = {'V','C',VIBL_CMD_GET_VIAL_ID};
+static const uint8_t CMD_FLASH[8] = {'V','C',VIBL_CMD_FLASH};
+static const uint8_t CMD_REBOOT[8] = {'V','C',VIBL_CMD_REBOOT};
+static const uint8_t CMD_GET_CHECKPOINT[8] = {'V','C',VIBL_CMD_GET_CHECKPOINT};
+static const uint8_t CMD_GET_CRC[8] = {'V','C',VIBL_CMD_GET_CRC};
+static const uint8_t CMD_GET_CAPABILITIES[8] = {'V','C',VIBL_CMD_GET_CAPABILITIES};
+static const uint8_t CMD_PATCH[8] = {'V','C',VIBL_CMD_PATCH};
+static const uint8_t CMD_SLOTS[8] = {'V','C',VIBL_CMD_SLOTS};
+static const uint8_t CMD_STATS[8] = {'V','C',VIBL_CMD_STATS};
+static const uint8_t CMD_LAUNCH[8] = {'V','C',VIBL_CMD_LAUNCH};
+static const uint8_t CMD_PMA_BENCH[8] = {'V','C',VIBL_CMD_PMA_BENCH};
+static const uint8_t CMD_STAY[8] = {'V','C',VIBL_CMD_STAY};
+
+/* how long to wait for an answer to the capabilities command before assuming an older bootloader */
+#define CAPABILITIES_TIMEOUT_MS 250
+
+/* how many times to reconnect and resume after the device dropped off mid-flash */
+#define RESUME_ATTEMPTS 5
+
+/* how often to look for the bootloader, it shows up a few hundred ms after the keyboard resets */
+#define SEARCH_POLL_US 20000
+
+/* how long the keyboard may take to come back running the new firmware */
+#define FIRMWARE_TIMEOUT_MS 10000
+
+/* over the vendor bulk interface firmware goes out this many pages per transfer */
+#define BULK_BATCH_PAGES 16
+
+/* a bulk transfer may have to wait out flash erases on the device */
+#define BULK_TIMEOUT_MS 5000
+
+/* what the bootloader found by the last check_vial_uid call can do; geometry is 0 when not reported */
+static struct {
+	int version;
+	int features;
+	int transfer_unit;
+	long flash_size;
+	long app_base;
+	int page_size;
+	int window;
+	uint8_t vial_id[VIAL_ID_SIZE];
+} bootloader;
 
 static int usb_write(hid_device *device, uint8_t *buffer, int len) {
-	int retries = 20;
-	int retval;
+#ifdef HID_BULK
+	/* the bulk interface takes the same commands, just without the report ID */
+	if (hid_bulk_available(device)) {
+		if (hid_bulk_write(device, buffer + 1, len - 1, BULK_TIMEOUT_MS) != len - 1)
+			return 0;
+		trace_report(0, buffer + 1, len - 1);
+		return 1;
+	}
+#endif
+
+	// Flash is unavailable when writing to it, so USB interrupt may fail here
+	if (!pacing_write(device, buffer, len))
+		return 0;
+	trace_report(0, buffer + 1, len - 1);
+	return 1;
+}
+
+/* read len bytes, waiting at most timeout_ms for each report (-1 waits forever); returns 0 on success */
+static int usb_read_timeout(hid_device *device, uint8_t *buffer, size_t len, int timeout_ms) {
+	while (len > 0) {
+		int ret;
+
+#ifdef HID_BULK
+		if (hid_bulk_available(device)) {
+			/* answers are always whole 64 byte packets, keep as much of one as was asked for */
+			uint8_t packet[64];
+
+			ret = hid_bulk_read_timeout(device, packet, sizeof(packet), timeout_ms);
+			if (ret > (int)len)
+				ret = len;
+			if (ret > 0)
+				memcpy(buffer, packet, ret);
+		} else
+#endif
+		ret = hid_read_timeout(device, buffer, len, timeout_ms);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			return -1;
+		trace_report(1, buffer, ret);
+		len -= ret;
+		buffer += ret;
+	}
+
+	return 0;
+}
+
+static int usb_read(hid_device *device, uint8_t *buffer, size_t len) {
+	return usb_read_timeout(device, buffer, len, -1);
+}
+
+
+#define NON_SILENT if (!silent)
+
+/* ask for the capabilities descriptor, which answers everything check_vial_uid needs in one round trip;
+   returns 0 on success, 1 if the bootloader doesn't know the command */
+static int get_capabilities(hid_device *dev) {
+	uint8_t hid_buffer[65];
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_GET_CAPABILITIES, sizeof(CMD_GET_CAPABILITIES));
+	if (!usb_write(dev, hid_buffer, 65))
+		return 1;
+
+	/* older bootloaders stay silent */
+	if (usb_read_timeout(dev, hid_buffer, 64, CAPABILITIES_TIMEOUT_MS) != 0 || memcmp(hid_buffer, CMD_GET_CAPABILITIES, 3) != 0)
+		return 1;
+
+	bootloader.version = hid_buffer[3];
+	bootloader.features = hid_buffer[4] | (hid_buffer[5] << 8);
+	bootloader.transfer_unit = hid_buffer[6] | (hid_buffer[7] << 8);
+	bootloader.flash_size = get_u32(&hid_buffer[8]);
+	bootloader.app_base = get_u32(&hid_buffer[12]);
+	bootloader.page_size = hid_buffer[16] | (hid_buffer[17] << 8);
+	bootloader.window = hid_buffer[18];
+	memcpy(bootloader.vial_id, &hid_buffer[24], VIAL_ID_SIZE);
+
+	return 0;
+}
+
+/* the two round trip way of getting the same information from bootloaders without the capabilities command */
+static int get_ident(hid_device *dev, int silent) {
+	uint8_t hid_buffer[65];
+
+	/* get bootloader version and feature flags */
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_BOOTLOADER_IDENT, sizeof(CMD_BOOTLOADER_IDENT));
+	if(!usb_write(dev, hid_buffer, 65)) {
+		NON_SILENT printf("Error while asking for bootloader ident\n");
+		return 1;
+	}
+
+	if (usb_read(dev, hid_buffer, 8) != 0) {
+		NON_SILENT printf("Error while retrieving bootloader ident\n");
+		return 1;
+	}
+
+	/* version, feature flags, flash size in K, erase page size, transfer unit and application offset in K */
+	bootloader.version = hid_buffer[0];
+	bootloader.features = hid_buffer[1];
+	bootloader.flash_size = (hid_buffer[2] | (hid_buffer[3] << 8)) * 1024L;
+	bootloader.page_size = hid_buffer[4] | (hid_buffer[5] << 8);
+	bootloader.transfer_unit = hid_buffer[6];
+	bootloader.app_base = 0x08000000 + hid_buffer[7] * 1024L;
+	bootloader.window = 1;
+
+	/* get keyboard ID */
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_GET_VIAL_ID, sizeof(CMD_GET_VIAL_ID));
+	if(!usb_write(dev, hid_buffer, 65)) {
+		NON_SILENT printf("Error while asking for Vial ID\n");
+		return 1;
+	}
+
+	if (usb_read(dev, hid_buffer, 8) != 0) {
+		NON_SILENT printf("Error while retrieving Vial ID\n");
+		return 1;
+	}
+	memcpy(bootloader.vial_id, hid_buffer, VIAL_ID_SIZE);
+
+	return 0;
+}
+
+/* return 0 if all checks pass and device matches */
+int check_vial_uid(hid_device *dev, void *vial_id, int silent) {
+	memset(&bootloader, 0, sizeof(bootloader));
+
+	if (get_capabilities(dev) && get_ident(dev, silent))
+		return 1;
+
+	/* check supported bootloader version */
+	if (bootloader.version != 0 && bootloader.version != 1) {
+		NON_SILENT printf("Error: unsupported bootloader version: %d\n", bootloader.version);
+		return 1;
+	}
+
+	if (vial_id && memcmp(vial_id, bootloader.vial_id, VIAL_ID_SIZE) != 0) {
+		NON_SILENT printf("Error: Vial UID does not match\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* get the CRC-32 of count pages of flash starting at first; returns 0 on success */
+static int get_flash_crc(hid_device *dev, int first, int count, uint32_t *crc) {
+	uint8_t hid_buffer[65];
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_GET_CRC, sizeof(CMD_GET_CRC));
+	hid_buffer[4] = first % 256;
+	hid_buffer[5] = first / 256;
+	hid_buffer[6] = count % 256;
+	hid_buffer[7] = count / 256;
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 8) != 0)
+		return 1;
+
+	*crc = get_u32(hid_buffer);
+	return 0;
+}
+
+/* returns the page to resume flashing image from: where an interrupted session of the same image stopped,
+   provided what was written so far still matches, 0 otherwise */
+static int find_resume_page(hid_device *dev, const uint8_t *image, int pages, uint32_t image_id) {
+	uint8_t hid_buffer[65];
+	uint32_t crc;
+	int page;
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_GET_CHECKPOINT, sizeof(CMD_GET_CHECKPOINT));
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 8) != 0)
+		return 0;
+
+	/* the page the checkpoint names may have been cut off half written, so the erase page
+	   it lies in is written again from its start, which has the bootloader erase it first */
+	page = hid_buffer[4] | (hid_buffer[5] << 8);
+	if (bootloader.page_size >= FLASH_PAGE_SIZE)
+		page -= page % (bootloader.page_size / FLASH_PAGE_SIZE);
+	/* bootloaders with session timeouts say when the last session was given up on */
+	if (hid_buffer[6] == 1 || hid_buffer[6] == 2)
+		printf("The bootloader gave up on an unfinished %s session\n", hid_buffer[6] == 1 ? "flash" : "patch");
+	/* and bootloaders that catch flash errors the first one of the last session */
+	if (hid_buffer[7] == 1 || hid_buffer[7] == 2)
+		printf("The last session hit a flash %s error\n", hid_buffer[7] == 1 ? "programming" : "write protection");
+	if (get_u32(hid_buffer) != image_id || page == 0 || page > pages)
+		return 0;
+
+	/* make sure the already written prefix is really there */
+	if (get_flash_crc(dev, 0, page, &crc) || crc != crc32(image, (size_t)page * FLASH_PAGE_SIZE))
+		return 0;
+
+	printf("Resuming from page %d/%d\n", page, pages);
+	return page;
+}
+
+/* flash pages [start, pages) of the image, data holding just those; returns 0 on success,
+   FLASH_FAILED when the bootloader says writing the flash went wrong and 1 on other errors */
+#define FLASH_FAILED 2
+
+static int flash_pages(hid_device *dev, const uint8_t *data, int start, int pages, uint32_t image_id) {
+	uint8_t hid_buffer[65];
+	int count = pages - start;
+
+	if (count == 0) {
+		printf("Firmware is already flashed.\n");
+		return 0;
+	}
+
+	// Send flash command to put HID bootloader in initial stage...
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_FLASH, sizeof(CMD_FLASH));
+	/* number of pages to flash as little-endian */
+	hid_buffer[4] = count % 256;
+	hid_buffer[5] = count / 256;
+	/* if the bootloader can, have it erase everything up front so the data phase doesn't stall */
+	if (bootloader.features & FEATURE_ERASE_AHEAD)
+		hid_buffer[6] = FLASH_FLAG_ERASE_AHEAD;
+	/* first page and image ID for the bootloader to record progress against */
+	hid_buffer[7] = start % 256;
+	hid_buffer[8] = start / 256;
+	hid_buffer[9] = image_id & 0xFF;
+	hid_buffer[10] = (image_id >> 8) & 0xFF;
+	hid_buffer[11] = (image_id >> 16) & 0xFF;
+	hid_buffer[12] = (image_id >> 24) & 0xFF;
+
+	printf("Sending flash pages command...\n");
+
+	// Flash is unavailable when writing to it, so USB interrupt may fail here
+	if(!usb_write(dev, hid_buffer, 65)) {
+		printf("Error while sending flash pages command.\n");
+		return 1;
+	}
+
+	if (bootloader.features & FEATURE_ERASE_AHEAD) {
+		/* progress reports are [0x02, done, erased lo, erased hi, total lo, total hi] */
+		do {
+			if (usb_read(dev, hid_buffer, 8) != 0 || hid_buffer[0] != 0x02) {
+				printf("\nError while erasing flash.\n");
+				return 1;
+			}
+			printf("\rErasing [%d/%d]", hid_buffer[2] | hid_buffer[3] << 8, hid_buffer[4] | hid_buffer[5] << 8);
+		} while (!hid_buffer[1]);
+		printf("\n");
+	}
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+
+	// Send Firmware File data
+	printf("Flashing firmware...\n");
+
+	for (int page = start; page < pages; ) {
+		int batch = 1;
+
+#ifdef HID_BULK
+		/* bulk transfers aren't limited to a packet per frame, hand over several pages at once */
+		if (hid_bulk_available(dev)) {
+			batch = pages - page < BULK_BATCH_PAGES ? pages - page : BULK_BATCH_PAGES;
+			if (hid_bulk_write(dev, data + (size_t)(page - start) * FLASH_PAGE_SIZE, batch * FLASH_PAGE_SIZE,
+					BULK_TIMEOUT_MS) != batch * FLASH_PAGE_SIZE) {
+				printf("\nError while flashing firmware data.\n");
+				return 1;
+			}
+			for (int i = 0; i < batch; ++i)
+				trace_report(0, data + (size_t)(page - start + i) * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+		} else
+#endif
+		{
+			memcpy(&hid_buffer[1], data + (size_t)(page - start) * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+
+			/* lets the pacing learn which pages the device stalls on */
+			pacing_set_page(page);
+			if(!usb_write(dev, hid_buffer, 1 + FLASH_PAGE_SIZE)) {
+				pacing_set_page(-1);
+				printf("\nError while flashing firmware data.\n");
+				return 1;
+			}
+		}
+		page += batch;
+
+		printf("\r[%d/%d]: %d%%", page * FLASH_PAGE_SIZE, pages * FLASH_PAGE_SIZE, 100 * page / pages);
+	}
+	pacing_set_page(-1);
+	printf("\n");
+
+	/* the last pages are still being written, the checkpoint answer waits for them and
+	   says whether any of the session's failed */
+	if (bootloader.features & FEATURE_RESUME) {
+		memset(hid_buffer, 0, sizeof(hid_buffer));
+		memcpy(&hid_buffer[1], CMD_GET_CHECKPOINT, sizeof(CMD_GET_CHECKPOINT));
+		if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 8) != 0) {
+			printf("Error while reading back the checkpoint.\n");
+			return 1;
+		}
+		if (hid_buffer[7]) {
+			printf("Flash %s error, the firmware is incomplete.\n",
+				hid_buffer[7] == 1 ? "programming" : "write protection");
+			return FLASH_FAILED;
+		}
+	}
+
+	return 0;
+}
+
+/* slot layout as reported by the bootloader */
+struct slots {
+	int active;
+	uint32_t base[2];
+	uint32_t size;
+};
+
+/* query the slots, or with size set make slot the one booted from the next reset on;
+   returns 0 on success */
+static int slot_command(hid_device *dev, int slot, uint32_t size, uint32_t crc, struct slots *slots) {
+	uint8_t hid_buffer[65];
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_SLOTS, sizeof(CMD_SLOTS));
+	if (size) {
+		hid_buffer[4] = 1;
+		hid_buffer[5] = slot;
+		put_u32(&hid_buffer[9], size);
+		put_u32(&hid_buffer[13], crc);
+	}
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 20) != 0 || memcmp(hid_buffer, CMD_SLOTS, 3) != 0)
+		return 1;
+
+	slots->active = hid_buffer[4];
+	slots->base[0] = get_u32(&hid_buffer[8]);
+	slots->base[1] = get_u32(&hid_buffer[12]);
+	slots->size = get_u32(&hid_buffer[16]);
+
+	return hid_buffer[3] != 0;
+}
+
+/* write the image into the slot that isn't running and switch to it; the image has to be
+   linked for that slot. Returns 0 on success */
+static int flash_slot(hid_device *dev, const uint8_t *image, int pages, uint32_t image_id) {
+	struct slots slots;
+	uint32_t size = (uint32_t)pages * FLASH_PAGE_SIZE;
+	uint32_t entry = get_u32(image + 4) & ~1;
+	int target, start;
+
+	if (!(bootloader.features & FEATURE_AB_SLOTS)) {
+		printf("Error: this bootloader wasn't built with A/B slots\n");
+		return 1;
+	}
+
+	if (slot_command(dev, 0, 0, 0, &slots)) {
+		printf("Error while asking for the slot layout.\n");
+		return 1;
+	}
+
+	target = !slots.active;
+	printf("Slot %c is running, writing slot %c at 0x%08x\n", 'A' + slots.active, 'A' + target, slots.base[target]);
+
+	if (size > slots.size) {
+		printf("Error: firmware is %u bytes but a slot only holds %u\n", size, slots.size);
+		return 1;
+	}
+
+	/* the vector table has absolute addresses, firmware only runs from where it was linked */
+	if (entry < slots.base[target] || entry >= slots.base[target] + slots.size) {
+		printf("Error: firmware is linked to start at 0x%08x, outside of slot %c\n", entry, 'A' + target);
+		return 1;
+	}
+
+	start = (slots.base[target] - bootloader.app_base) / FLASH_PAGE_SIZE;
+	if (flash_pages(dev, image, start, start + pages, image_id))
+		return 1;
+
+	if (slot_command(dev, target, size, crc32(image, size), &slots)) {
+		printf("Error: slot %c doesn't hold the firmware that was sent, still booting slot %c\n",
+			'A' + target, 'A' + slots.active);
+		return 1;
+	}
+
+	printf("Slot %c will boot from the next reset on\n", 'A' + target);
+	return 0;
+}
+
+/* read the counters and the core clock they count cycles of, optionally resetting them;
+   returns 0 on success */
+static int get_stats(hid_device *dev, int reset, uint32_t *stats, uint32_t *clock) {
+	uint8_t hid_buffer[65];
+	int count;
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_STATS, sizeof(CMD_STATS));
+	hid_buffer[4] = reset;
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 64) != 0 || memcmp(hid_buffer, CMD_STATS, 3) != 0
+			|| 8 + 4 * hid_buffer[3] > 64)
+		return 1;
+
+	/* newer bootloaders may count more, older ones less */
+	count = hid_buffer[3] < STAT_COUNT ? hid_buffer[3] : STAT_COUNT;
+	memset(stats, 0, STAT_COUNT * sizeof(*stats));
+	for (int i = 0; i < count; ++i)
+		stats[i] = get_u32(&hid_buffer[4 + 4 * i]);
+	*clock = get_u32(&hid_buffer[4 + 4 * hid_buffer[3]]);
+
+	return *clock == 0;
+}
+
+/* print the counters of a session that took elapsed_us on this side */
+static void print_stats(const uint32_t *stats, uint32_t clock, uint64_t elapsed_us) {
+	double mhz = clock / 1e6;
+	double isr_ms = stats[STAT_ISR_TOTAL] / mhz / 1000;
+	double flash_ms = stats[STAT_FLASH_BUSY] / mhz / 1000;
+	uint32_t packets = stats[STAT_PACKETS_EP0] + stats[STAT_PACKETS_EP2] + stats[STAT_PACKETS_EP3];
+
+	printf("Bootloader statistics:\n");
+	printf("  packets received:   EP0 %u, EP2 %u, EP3 %u\n", stats[STAT_PACKETS_EP0], stats[STAT_PACKETS_EP2], stats[STAT_PACKETS_EP3]);
+	printf("  packets held up:    %u\n", stats[STAT_WAITING]);
+	printf("  USB errors:         %u\n", stats[STAT_ERRORS]);
+	printf("  protocol errors:    %u\n", stats[STAT_PROTOCOL_ERRORS]);
+	printf("  sessions timed out: %u\n", stats[STAT_SESSION_TIMEOUTS]);
+	printf("  programmed:         %u bytes, %u pages erased\n", stats[STAT_PROGRAMMED], stats[STAT_ERASES]);
+	printf("  flash errors:       %u\n", stats[STAT_FLASH_ERRORS]);
+	printf("  flash busy:         %.1fms, at most %.2fms at a time\n", flash_ms, stats[STAT_FLASH_BUSY_MAX] / mhz / 1000);
+	printf("  USB interrupts:     %.1fms, the longest %.2fms\n", isr_ms, stats[STAT_ISR_MAX] / mhz / 1000);
+	if (packets)
+		printf("  per packet:         %.0f cycles of USB interrupt\n", (double)stats[STAT_ISR_TOTAL] / packets);
+
+	/* the device does all its work in interrupts, what's left of the session it spent waiting on the host */
+	if (elapsed_us) {
+		double total_ms = elapsed_us / 1000.0;
+
+		printf("  of %.1fms: %.0f%% flash, %.0f%% other device work, %.0f%% waiting on the host or the bus\n",
+			total_ms, 100 * flash_ms / total_ms, 100 * (isr_ms - flash_ms) / total_ms,
+			isr_ms < total_ms ? 100 * (total_ms - isr_ms) / total_ms : 0);
+	}
+}
+
+/* have the bootloader time copying a report in and out of its packet memory and print the
+   cost per byte; bootloaders that can't measure it report no copies and print nothing */
+static void print_pma_bench(hid_device *dev, uint32_t clock) {
+	uint8_t hid_buffer[65];
+	double bytes;
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_PMA_BENCH, sizeof(CMD_PMA_BENCH));
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 16) != 0 || memcmp(hid_buffer, CMD_PMA_BENCH, 3) != 0) {
+		printf("Error while timing the packet memory copies\n");
+		return;
+	}
+	if (!hid_buffer[3])
+		return;
+
+	bytes = hid_buffer[3] * 64.0;
+	printf("  packet memory copy: %.2f cycles/byte out, %.2f in, %.2f in from an odd address (%.0fMHz)\n",
+		get_u32(&hid_buffer[4]) / bytes, get_u32(&hid_buffer[8]) / bytes, get_u32(&hid_buffer[12]) / bytes, clock / 1e6);
+}
+
+/* have the bootloader start the application without a reset, once it has checked the
+   first size bytes of it against data (just that there is one when size is 0);
+   returns 0 when the application is being started */
+static int launch_application(hid_device *dev, const uint8_t *data, uint32_t size) {
+	uint8_t hid_buffer[65];
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_LAUNCH, sizeof(CMD_LAUNCH));
+	put_u32(&hid_buffer[5], size);
+	put_u32(&hid_buffer[9], size ? crc32(data, size) : 0);
+	if (!usb_write(dev, hid_buffer, 65) || usb_read(dev, hid_buffer, 4) != 0 || memcmp(hid_buffer, CMD_LAUNCH, 3) != 0)
+		return 1;
+
+	return hid_buffer[3] != 0;
+}
+
+/* searches for a compatible vial device in infinite loop, setting path (when given) to a
+   malloc'd copy of where it was found */
+hid_device *search_device(void *vial_uid, char **path) {
+	hid_device *found = NULL;
+
+	printf("Looking for devices...\n");
+
+	while (1) {
+		struct hid_device_info *devs;
+
+		devs = hid_enumerate(VIBL_VID, VIBL_PID);
+		for (struct hid_device_info *dev = devs; dev && !found; dev = dev->next) {
+			if (dev->serial_number && wcsstr(dev->serial_number, VIBL_SERIAL)) {
+				/* ok got a potential vibl candidate. now check if UID is what we're expecting,
+				   a device that has only just appeared may not open yet */
+				if (!(found = hid_open_path(dev->path)))
+					continue;
+
+				if (check_vial_uid(found, vial_uid, 1)) {
+					/* didn't match, discard this device and try another */
+					hid_close(found);
+					found = NULL;
+				} else if (path) {
+					*path = strdup(dev->path);
+				}
+			}
+		}
+
+		hid_free_enumeration(devs);
+
+		if (found)
+			return found;
+
+		usleep(SEARCH_POLL_US);
+	}
+}
+
+/* the name the program was run under, without its directory */
+static const char *program_name(const char *argv0) {
+	const char *slash = strrchr(argv0, '/');
+
+	return slash ? slash + 1 : argv0;
+}
+
+/* the bootloader at device_path when one is named, otherwise the first one found; path is
+   set to a malloc'd copy of where it was opened */
+static hid_device *open_device(const char *device_path, void *vial_id, char **path) {
+	if (!device_path)
+		return search_device(vial_id, path);
+
+	*path = strdup(device_path);
+	return hid_open_path(device_path);
+}
+
+/* call off whatever session the bootloader is in. The feature report goes to the control
+   endpoint, so it gets through even when the bootloader takes what comes in on the others
+   for flash data; returns 0 on success */
+static int abort_session(hid_device *dev) {
+	uint8_t feature[2] = {0, 0};
+
+	return hid_send_feature_report(dev, feature, sizeof(feature)) < 0;
+}
+
+/* open the bootloader that a failed transfer left behind, without it mistaking commands
+   for data of the session it may still be in. The same path still opening means it
+   stayed on the bus and has to be told to give the session up, while one that dropped
+   off went through a bus reset, which does that, and is searched for again */
+static hid_device *reopen_device(const char *device_path, void *vial_id, char **path) {
+	hid_device *dev = *path ? hid_open_path(*path) : NULL;
+
+	if (dev) {
+		if (!abort_session(dev))
+			return dev;
+		hid_close(dev);
+	}
+
+	free(*path);
+	*path = NULL;
+	return open_device(device_path, vial_id, path);
+}
+
+/* what check_vial_uid found as text, the way --bootloader takes it: version, features,
+   transfer unit, flash size, application base, erase page size, window and Vial UID */
+static void describe_bootloader(char *description, size_t len) {
+	int used = snprintf(description, len, "%d,%d,%d,%ld,%ld,%d,%d,", bootloader.version, bootloader.features,
+		bootloader.transfer_unit, bootloader.flash_size, bootloader.app_base, bootloader.page_size, bootloader.window);
+
+	for (int i = 0; i < VIAL_ID_SIZE && used > 0 && (size_t)used < len; ++i)
+		used += snprintf(description + used, len - used, "%02X", bootloader.vial_id[i]);
+}
+
+/* take a description of the bootloader instead of asking it; returns 0 on success */
+static int parse_bootloader(const char *description) {
+	int used = 0;
+
+	memset(&bootloader, 0, sizeof(bootloader));
+	if (sscanf(description, "%d,%d,%d,%ld,%ld,%d,%d,%n", &bootloader.version, &bootloader.features, &bootloader.transfer_unit,
+			&bootloader.flash_size, &bootloader.app_base, &bootloader.page_size, &bootloader.window, &used) != 7 || !used)
+		return 1;
+	return parse_hex(description + used, bootloader.vial_id, VIAL_ID_SIZE);
+}
+
+/* open the bootloader at path and read its Vial UID and description; returns 0 on success.
+   The bootloader is told to stay, rather than boot the application once idle, while it
+   waits for a job; one that doesn't boot when idle counts the command as a protocol error
+   and carries on */
+int read_vial_uid(const char *path, uint8_t *uid, char *description, size_t len) {
+	hid_device *dev = hid_open_path(path);
+	uint8_t hid_buffer[65];
+	int error;
+
+	if (!dev)
+		return 1;
+
+	if (!(error = check_vial_uid(dev, NULL, 1))) {
+		memcpy(uid, bootloader.vial_id, VIAL_ID_SIZE);
+		describe_bootloader(description, len);
+		memset(hid_buffer, 0, sizeof(hid_buffer));
+		memcpy(&hid_buffer[1], CMD_STAY, sizeof(CMD_STAY));
+		usb_write(dev, hid_buffer, 65);
+	}
+	hid_close(dev);
+
+	return error;
+}
+
+/* read a whole file into a malloc'd buffer; returns NULL after saying why on failure */
+static uint8_t *load_file(const char *path, long *size) {
+	FILE *file = fopen(path, "rb");
+	uint8_t *buffer = NULL;
+
+	if (!file) {
+		printf("Error opening file: %s\n", path);
+		return NULL;
+	}
+
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	if (*size <= 0 || !(buffer = malloc(*size))) {
+		printf("Failed to allocate memory for %s.\n", path);
+	} else if (fread(buffer, 1, *size, file) != (size_t)*size) {
+		printf("Failed to read %s.\n", path);
+		free(buffer);
+		buffer = NULL;
+	}
+
+	fclose(file);
+	return buffer;
+}
+
+#ifndef _WIN32
+/* read the copy of a package that vibl-flashd hands a job as fd. Every job of the package
+   shares the descriptor, and with it the file position, so it is read at offsets */
+static uint8_t *load_package_fd(int fd, long *size) {
+	uint8_t *buffer = NULL;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || !(buffer = malloc(st.st_size))) {
+		printf("Failed to read the package from vibl-flashd.\n");
+		return NULL;
+	}
+
+	*size = st.st_size;
+	for (long done = 0, got; done < *size; done += got) {
+		if ((got = pread(fd, buffer + done, *size - done, done)) <= 0) {
+			printf("Failed to read the package from vibl-flashd.\n");
+			free(buffer);
+			return NULL;
+		}
+	}
+
+	return buffer;
+}
+#endif
+
+/* locate the firmware in a .vfw package, checking its hash unless that was done already,
+   or take a plain bin as a whole; vial_id is left NULL for plain bins. returns 0 on success */
+static int unwrap_firmware(uint8_t *file, long file_size, int checked, uint8_t **firmware, long *firmware_size, uint8_t **vial_id) {
+	if (file_size < 64) {
+		printf("Firmware file is too small to be valid!\n");
+		return 1;
+	}
+
+	*vial_id = NULL;
+	if (memcmp(file, "VIALFW00", 8) == 0 || memcmp(file, "VIALFW01", 8) == 0) {
+		/* is this a vial firmware package? if so, check hash and keep track of vial UID */
+		*vial_id = file + 8;
+		*firmware = file + 64;
+		*firmware_size = file_size - 64;
+		if (!checked && check_hash(*firmware, *firmware_size, file + 32)) {
+			printf("Firmware doesn't pass hash check. The file is corrupt.\n");
+			return 1;
+		}
+	} else {
+		/* otherwise it's a plain bin containing the entire firmware package */
+		*firmware = file;
+		*firmware_size = file_size;
+	}
+
+	return 0;
+}
+
+/* copy the firmware into a malloc'd image padded to whole pages with the erased flash value */
+static uint8_t *pad_image(const uint8_t *firmware, long size, int *pages) {
+	uint8_t *image;
+
+	*pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	if (!(image = malloc((size_t)*pages * FLASH_PAGE_SIZE))) {
+		printf("Failed to allocate memory for firmware data.\n");
+		return NULL;
+	}
+	memset(image, 0xFF, (size_t)*pages * FLASH_PAGE_SIZE);
+	memcpy(image, firmware, size);
+
+	return image;
+}
+
+/* read the rest of a stream after the head already taken from it into a malloc'd buffer */
+static uint8_t *read_all(FILE *file, const uint8_t *head, size_t head_len, long *size) {
+	size_t len = head_len, cap = head_len + STREAM_BLOCK;
+	uint8_t *buffer = malloc(cap);
+	size_t got;
+
+	if (!buffer)
+		goto nomem;
+	memcpy(buffer, head, head_len);
+
+	while ((got = fread(buffer + len, 1, cap - len, file)) > 0) {
+		len += got;
+		if (len == cap) {
+			uint8_t *bigger;
+
+			if (cap >= MAX_STREAM_SIZE || !(bigger = realloc(buffer, cap * 2)))
+				goto nomem;
+			buffer = bigger;
+			cap *= 2;
+		}
+	}
+
+	if (ferror(file)) {
+		printf("Failed to read the firmware.\n");
+		free(buffer);
+		return NULL;
+	}
+
+	*size = len;
+	return buffer;
+
+nomem:
+	printf("Failed to allocate memory for firmware data.\n");
+	free(buffer);
+	return NULL;
+}
+
+/* formats that can only be made sense of as a whole */
+static int needs_whole_file(const uint8_t *header, size_t len) {
+	static const uint8_t uf2_magic[8] = {0x55, 0x46, 0x32, 0x0A, 0x57, 0x51, 0x5D, 0x9E};
+
+	return (len >= 4 && memcmp(header, "\x7F" "ELF", 4) == 0)
+		|| (len >= 8 && memcmp(header, uf2_magic, 8) == 0)
+		|| (len >= 8 && memcmp(header, "VIALPT00", 8) == 0)
+		|| (len >= 1 && header[0] == ':');
+}
+
+/* write a patch package turning the firmware in old_path into the one in new_path; returns 0 on success */
+static int make_patch(const char *old_path, const char *new_path, const char *out_path) {
+	uint8_t *old_file = NULL, *new_file = NULL, *old_image = NULL, *new_image = NULL, *ops = NULL;
+	uint8_t *old_fw, *new_fw, *old_id, *new_id;
+	long old_file_size, new_file_size, old_size, new_size;
+	int old_pages, new_pages;
+	uint8_t header[PATCH_HEADER_SIZE];
+	size_t ops_size;
+	SHA256_CTX ctx;
+	FILE *out = NULL;
+	int error = 1;
+
+	if (!(old_file = load_file(old_path, &old_file_size)) || !(new_file = load_file(new_path, &new_file_size))
+			|| unwrap_firmware(old_file, old_file_size, 0, &old_fw, &old_size, &old_id)
+			|| unwrap_firmware(new_file, new_file_size, 0, &new_fw, &new_size, &new_id))
+		goto exit;
+
+	if (old_id && new_id && memcmp(old_id, new_id, VIAL_ID_SIZE) != 0) {
+		printf("Error: the two firmwares are for different keyboards\n");
+		goto exit;
+	}
+
+	/* the patch applies to flash as vibl-flash leaves it, padded to whole pages */
+	if (!(old_image = pad_image(old_fw, old_size, &old_pages)) || !(new_image = pad_image(new_fw, new_size, &new_pages)))
+		goto exit;
+
+	if (!(ops = patch_make(old_image, (size_t)old_pages * FLASH_PAGE_SIZE, new_image, (size_t)new_pages * FLASH_PAGE_SIZE, &ops_size))) {
+		printf("Failed to allocate memory for the patch.\n");
+		goto exit;
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "VIALPT00", 8);
+	if (new_id || old_id)
+		memcpy(&header[8], new_id ? new_id : old_id, VIAL_ID_SIZE);
+	put_u32(&header[16], old_size);
+	put_u32(&header[20], new_size);
+	put_u32(&header[24], crc32(old_image, (size_t)old_pages * FLASH_PAGE_SIZE));
+	put_u32(&header[28], crc32(new_image, (size_t)new_pages * FLASH_PAGE_SIZE));
+	sha256_init(&ctx);
+	sha256_update(&ctx, ops, ops_size);
+	sha256_final(&ctx, &header[32]);
+
+	if (!(out = fopen(out_path, "wb")) || fwrite(header, 1, sizeof(header), out) != sizeof(header)
+			|| fwrite(ops, 1, ops_size, out) != ops_size) {
+		printf("Error writing patch file: %s\n", out_path);
+		goto exit;
+	}
+
+	printf("Patch: %zu bytes for a %ld byte firmware\n", sizeof(header) + ops_size, new_size);
+	error = 0;
+
+	exit:
+	if (out && fclose(out))
+		error = 1;
+	free(old_file);
+	free(new_file);
+	free(old_image);
+	free(new_image);
+	free(ops);
+
+	return error;
+}
+
+/* rebuild the firmware on the device from the one it runs with a patch package; returns 0 on success */
+static int apply_patch(hid_device *dev, const uint8_t *file, long file_size) {
+	uint8_t hid_buffer[65];
+	const uint8_t *ops = file + PATCH_HEADER_SIZE;
+	long ops_size = file_size - PATCH_HEADER_SIZE;
+	int base_pages = (get_u32(&file[16]) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	int target_pages = (get_u32(&file[20]) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	long reports = (ops_size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+	uint32_t crc;
+
+	if ((bootloader.features & (FEATURE_DELTA | FEATURE_VERIFY)) != (FEATURE_DELTA | FEATURE_VERIFY)) {
+		printf("Error: this bootloader can't apply patches, flash the full firmware instead\n");
+		return 1;
+	}
+
+	if (reports == 0 || reports > 0xFFFF || target_pages > 0xFFFF) {
+		printf("Error: the patch is too large\n");
+		return 1;
+	}
+
+	if (!get_flash_crc(dev, 0, target_pages, &crc) && crc == get_u32(&file[28])) {
+		printf("Firmware is already flashed.\n");
+		return 0;
+	}
+
+	/* the op stream only makes sense against the exact firmware it was made from */
+	if (get_flash_crc(dev, 0, base_pages, &crc) || crc != get_u32(&file[24])) {
+		printf("Error: the keyboard doesn't run the firmware this patch was made for, flash the full firmware instead\n");
+		return 1;
+	}
+
+	memset(hid_buffer, 0, sizeof(hid_buffer));
+	memcpy(&hid_buffer[1], CMD_PATCH, sizeof(CMD_PATCH));
+	hid_buffer[4] = target_pages % 256;
+	hid_buffer[5] = target_pages / 256;
+	hid_buffer[6] = reports % 256;
+	hid_buffer[7] = reports / 256;
+
+	printf("Sending patch command...\n");
+	if (!usb_write(dev, hid_buffer, 65)) {
+		printf("Error while sending patch command.\n");
+		return 1;
+	}
+
+	printf("Patching firmware...\n");
+	for (long report = 0; report < reports; ++report) {
+		long chunk = ops_size - report * FLASH_PAGE_SIZE;
+
+		/* the last report is padded with no-op bytes */
+		memset(hid_buffer, 0, sizeof(hid_buffer));
+		memcpy(&hid_buffer[1], ops + report * FLASH_PAGE_SIZE, chunk < FLASH_PAGE_SIZE ? chunk : FLASH_PAGE_SIZE);
+		if (!usb_write(dev, hid_buffer, 1 + FLASH_PAGE_SIZE)) {
+			printf("\nError while sending patch data.\n");
+			return 1;
+		}
+
+		printf("\r[%ld/%ld]: %ld%%", (report + 1) * FLASH_PAGE_SIZE, reports * FLASH_PAGE_SIZE, 100 * (report + 1) / reports);
+	}
+	printf("\n");
+
+	/* the bootloader answers with its verdict and the CRC of what it wrote */
+	if (usb_read(dev, hid_buffer, 8) != 0 || memcmp(hid_buffer, CMD_PATCH, 3) != 0) {
+		printf("Error while waiting for the patch to be applied.\n");
+		return 1;
+	}
+
+	if (hid_buffer[3] != 0 || get_u32(&hid_buffer[4]) != get_u32(&file[28])) {
+		printf("Error: applying the patch failed (%d), flash the full firmware to recover\n", hid_buffer[3]);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* collects the chunks of a sparse image into runs of whole erase pages, each run is flashed
+   as soon as no later chunk can land in it anymore */
+struct page_writer {
+	hid_device *dev;
+	uint32_t image_id;
+	long page_size;
+	uint8_t *buf;
+	long start; /* image offset of buf, at an erase page boundary */
+	long len;
+	long cap;
+	uint8_t *first; /* the image's first erase page, written once the rest made it */
+};
+
+static void writer_init(struct page_writer *w, hid_device *dev, uint32_t image_id) {
+	memset(w, 0, sizeof(*w));
+	w->dev = dev;
+	w->image_id = image_id;
+	/* bootloaders not reporting geometry run on 1K page parts */
+	w->page_size = bootloader.page_size >= FLASH_PAGE_SIZE ? bootloader.page_size : 1024;
+}
+
+static long round_up(long value, long to) {
+	return (value + to - 1) / to * to;
+}
+
+/* erase the first erase page, with the vector table gone the bootloader won't start what's
+   in flash; returns 0 on success */
+static int invalidate_firmware(hid_device *dev, long page_size) {
+	uint8_t *erased = malloc(page_size);
+	int error;
+
+	if (!erased) {
+		printf("Failed to allocate memory for firmware data.\n");
+		return 1;
+	}
+
+	printf("Invalidating the current firmware...\n");
+	memset(erased, 0xFF, page_size);
+	error = flash_pages(dev, erased, 0, page_size / FLASH_PAGE_SIZE, 0);
+	free(erased);
+	return error;
+}
+
+/* flash the first len bytes of the run, a multiple of the erase page size */
+static int writer_flush(struct page_writer *w, long len) {
+	long skip = 0;
+
+	/* the first erase page waits for everything else, so that an image cut off halfway
+	   by a bad chunk or a lost device isn't started */
+	if (w->start == 0 && !w->first) {
+		if (!(w->first = malloc(w->page_size))) {
+			printf("Failed to allocate memory for firmware data.\n");
+			return 1;
+		}
+		memcpy(w->first, w->buf, w->page_size);
+		if (invalidate_firmware(w->dev, w->page_size))
+			return 1;
+		skip = w->page_size;
+	}
 
-	while(((retval = hid_write(device, buffer, len)) < len) && --retries) {
-		if(retval < 0) {
-			usleep(100 * 1000); // No data has been sent here. Delay and retry.
-		} else {
-			return 0; // Partial data has been sent. Firmware will be corrupted. Abort process.
+	if (len > skip && flash_pages(w->dev, w->buf + skip, (w->start + skip) / FLASH_PAGE_SIZE,
+			(w->start + len) / FLASH_PAGE_SIZE, w->image_id))
+		return 1;
+
+	memmove(w->buf, w->buf + len, w->len - len);
+	w->start += len;
+	w->len -= len;
+	return 0;
+}
+
+/* add length bytes at offset, after everything added so far; data NULL adds erased bytes */
+static int writer_add(struct page_writer *w, long offset, const uint8_t *data, long length) {
+	long end;
+
+	/* a gap past the current erase page closes the run */
+	if (w->len && offset >= round_up(w->start + w->len, w->page_size)) {
+		long padded = round_up(w->len, w->page_size);
+
+		memset(w->buf + w->len, 0xFF, padded - w->len);
+		w->len = padded;
+		if (writer_flush(w, w->len))
+			return 1;
+	}
+	if (!w->len)
+		w->start = offset / w->page_size * w->page_size;
+
+	end = offset - w->start + length;
+	if (end > w->cap) {
+		uint8_t *buf = realloc(w->buf, round_up(end, w->page_size));
+
+		if (!buf) {
+			printf("Failed to allocate memory for firmware data.\n");
+			return 1;
 		}
+		w->buf = buf;
+		w->cap = round_up(end, w->page_size);
 	}
 
-	if(retries <= 0) {
-		return 0;
+	/* bytes no chunk covers are left erased */
+	memset(w->buf + w->len, 0xFF, offset - w->start - w->len);
+	if (data)
+		memcpy(w->buf + offset - w->start, data, length);
+	else
+		memset(w->buf + offset - w->start, 0xFF, length);
+	w->len = end;
+
+	/* only the erase page the data ends in can still change */
+	if (end / w->page_size)
+		return writer_flush(w, end / w->page_size * w->page_size);
+	return 0;
+}
+
+/* with commit set flash what is left, the first erase page last; either way free the
+   buffers. Returns 0 on success */
+static int writer_finish(struct page_writer *w, int commit) {
+	int error = 0;
+
+	if (commit && w->len) {
+		long padded = round_up(w->len, w->page_size);
+
+		memset(w->buf + w->len, 0xFF, padded - w->len);
+		w->len = padded;
+		error = writer_flush(w, w->len);
+	}
+	if (commit && !error && w->first) {
+		printf("Writing the first page...\n");
+		error = flash_pages(w->dev, w->first, 0, w->page_size / FLASH_PAGE_SIZE, w->image_id);
 	}
 
-	return 1;
+	free(w->buf);
+	free(w->first);
+	w->buf = NULL;
+	w->first = NULL;
+	return error;
 }
 
-static int usb_read(hid_device *device, uint8_t *buffer, size_t len) {
-	while (len > 0) {
-		int ret = hid_read(device, buffer, len);
-		if (ret < 0)
-			return ret;
-		len -= ret;
-		buffer += ret;
-		usleep(100 * 1000);
+/* flash a chunked package, chunk by chunk as each is read and checked; returns 0 on success */
+static int flash_vfw2(hid_device *dev, struct vfw2_reader *reader) {
+	struct page_writer writer;
+	const struct vfw2_chunk *chunk;
+	const uint8_t *data;
+	int patched = 0;
+	int res;
+
+	/* the image is identified to the bootloader by the start of the chunk table hash */
+	writer_init(&writer, dev, get_u32(&reader->header[32]));
+
+	while ((res = vfw2_next(reader, &chunk, &data)) > 0) {
+		switch (chunk->encoding) {
+		case VFW2_RAW:
+			res = writer_add(&writer, chunk->offset, data, chunk->length);
+			break;
+		case VFW2_ERASED:
+			res = writer_add(&writer, chunk->offset, NULL, chunk->length);
+			break;
+		case VFW2_DELTA:
+			res = apply_patch(dev, data, chunk->stored);
+			patched = !res;
+			break;
+		}
+		if (res) {
+			res = -1;
+			break;
+		}
 	}
 
-	return 0;
+	if (res < 0 && reader->error[0])
+		printf("\n%s\n", reader->error);
+
+	if (writer_finish(&writer, res == 0))
+		res = -1;
+
+	/* a patch rebuilds the first page itself, what follows it is cut off when a later
+	   chunk fails; take the firmware out rather than leave it that way */
+	if (res && patched)
+		invalidate_firmware(dev, writer.page_size);
+
+	return res != 0;
 }
 
-/* calculate sha256 hash of the data and check that it matches the recorded hash; returns 0 if check passed, 1 otherwise */
-int check_hash(void *data, size_t size, void *hash) {
-	uint8_t calculated[32];
-	SHA256_CTX ctx;
-	sha256_init(&ctx);
-	sha256_update(&ctx, data, size);
-	sha256_final(&ctx, calculated);
-	return memcmp(calculated, hash, sizeof(calculated)) != 0;
+/* read up to len bytes, short only at the end of the stream */
+static size_t read_block(FILE *file, uint8_t *buffer, size_t len) {
+	size_t got = 0, n;
+
+	while (got < len && (n = fread(buffer + got, 1, len - got, file)) > 0)
+		got += n;
+
+	return got;
 }
 
-#define NON_SILENT if (!silent)
+/* pad a block read from a stream to whole pages with the erased flash value */
+static size_t pad_block(uint8_t *block, size_t len) {
+	size_t padded = (len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
 
-/* return 0 if all checks pass and device matches */
-int check_vial_uid(hid_device *dev, void *vial_id, int silent) {
-	uint8_t hid_buffer[129];
+	memset(block + len, 0xFF, padded - len);
+	return padded;
+}
 
-	/* get bootloader version and feature flags */
-	memset(hid_buffer, 0, sizeof(hid_buffer));
-	memcpy(&hid_buffer[1], CMD_BOOTLOADER_IDENT, sizeof(CMD_BOOTLOADER_IDENT));
-	if(!usb_write(dev, hid_buffer, 65)) {
-		NON_SILENT printf("Error while asking for bootloader ident\n");
-		return 1;
+/* where the application starts, for addresses in ELF, HEX and UF2 files */
+static long app_base(void) {
+	return bootloader.app_base > 0x08000000 ? bootloader.app_base : DEFAULT_APP_BASE;
+}
+
+/* flash an image of unknown size while it is read from a pipe, head being what was already taken from it.
+   Page 0 is erased before anything else and the first block is held back until the end of the stream,
+   when digest (if given) has been checked, so that the keyboard stays in the bootloader unless the
+   whole image made it. returns 0 on success */
+static int flash_stream(hid_device *dev, FILE *file, const uint8_t *head, size_t head_len, const uint8_t *digest) {
+	long limit = bootloader.flash_size ? bootloader.flash_size - (app_base() - 0x08000000) : MAX_STREAM_SIZE;
+	long page_size = bootloader.page_size >= FLASH_PAGE_SIZE ? bootloader.page_size : 1024;
+	uint8_t *first = malloc(STREAM_BLOCK), *block = malloc(STREAM_BLOCK);
+	size_t first_len, first_padded, len;
+	long end;
+	uint8_t calculated[32];
+	uint32_t crc, flash_crc;
+	SHA256_CTX ctx;
+	int error = 1;
+
+	if (!first || !block) {
+		printf("Failed to allocate memory for firmware data.\n");
+		goto exit;
 	}
 
-	if (usb_read(dev, hid_buffer, 8) != 0) {
-		NON_SILENT printf("Error while retrieving bootloader ident\n");
-		return 1;
+	if (head_len)
+		memcpy(first, head, head_len);
+	first_len = head_len + read_block(file, first + head_len, STREAM_BLOCK - head_len);
+	if (first_len == 0) {
+		printf("Error: no firmware came through the pipe\n");
+		goto exit;
 	}
+	sha256_init(&ctx);
+	sha256_update(&ctx, first, first_len);
+	first_padded = pad_block(first, first_len);
+	crc = crc32(first, first_padded);
+	end = first_padded;
 
-	/* check supported bootloader version */
-	if (hid_buffer[0] != 0 && hid_buffer[0] != 1) {
-		NON_SILENT printf("Error: unsupported bootloader version: %d\n", hid_buffer[0]);
-		return 1;
+	/* nothing is sent for a stream that doesn't fit from the start, the firmware in flash stays */
+	if (end > limit) {
+		printf("Error: firmware doesn't fit, only %ld bytes do\n", limit);
+		goto exit;
 	}
 
-	/* get keyboard ID */
-	memset(hid_buffer, 0, sizeof(hid_buffer));
-	memcpy(&hid_buffer[1], CMD_GET_VIAL_ID, sizeof(CMD_GET_VIAL_ID));
-	if(!usb_write(dev, hid_buffer, 65)) {
-		NON_SILENT printf("Error while asking for Vial ID\n");
-		return 1;
+	/* with the vector table gone the bootloader won't start a half written firmware */
+	if (invalidate_firmware(dev, page_size))
+		goto exit;
+
+	/* only a full first block can have more following it */
+	len = first_len;
+	while (len == STREAM_BLOCK && (len = read_block(file, block, STREAM_BLOCK)) > 0) {
+		size_t padded;
+
+		if (end + (long)len > limit) {
+			printf("Error: firmware doesn't fit, only %ld bytes do. The keyboard stays in the bootloader.\n", limit);
+			goto exit;
+		}
+
+		sha256_update(&ctx, block, len);
+		padded = pad_block(block, len);
+		crc = crc32_update(crc, block, padded);
+		if (flash_pages(dev, block, end / FLASH_PAGE_SIZE, (end + padded) / FLASH_PAGE_SIZE, 0))
+			goto exit;
+		end += padded;
 	}
 
-	if (usb_read(dev, hid_buffer, 8) != 0) {
-		NON_SILENT printf("Error while retrieving Vial ID\n");
-		return 1;
+	if (ferror(file)) {
+		printf("Failed to read the firmware.\n");
+		goto exit;
 	}
 
-	if (vial_id && memcmp(vial_id, hid_buffer, VIAL_ID_SIZE) != 0) {
-		NON_SILENT printf("Error: Vial UID does not match\n");
-		return 1;
+	sha256_final(&ctx, calculated);
+	if (digest && memcmp(calculated, digest, sizeof(calculated)) != 0) {
+		printf("Firmware doesn't pass hash check. The keyboard stays in the bootloader.\n");
+		goto exit;
 	}
 
-	return 0;
-}
+	printf("Writing the first block...\n");
+	if (flash_pages(dev, first, 0, first_padded / FLASH_PAGE_SIZE, 0))
+		goto exit;
 
-/* searches for a compatible vial device in infinite loop */
-hid_device *search_device(void *vial_uid) {
-	hid_device *found = NULL;
+	/* the whole image is in place now, have the bootloader confirm it */
+	if ((bootloader.features & FEATURE_VERIFY)
+			&& (get_flash_crc(dev, 0, end / FLASH_PAGE_SIZE, &flash_crc) || flash_crc != crc)) {
+		printf("Error: the firmware in flash doesn't match what was sent\n");
+		goto exit;
+	}
 
-	while (1) {
-		struct hid_device_info *devs;
+	error = 0;
 
-		printf("Looking for devices...\n");
+exit:
+	free(first);
+	free(block);
+	return error;
+}
 
-		devs = hid_enumerate(0, 0);
-		for (struct hid_device_info *dev = devs; dev; dev = dev->next) {
-			if (dev->serial_number && wcsstr(dev->serial_number, L"vibl:d4f8159c")) {
-				/* ok got a potential vibl candidate. now check if UID is what we're expecting */
-				found = hid_open_path(dev->path);
+/* flash only the populated regions of a segment list; returns 0 on success */
+static int flash_segments(hid_device *dev, const struct segment_list *list) {
+	struct page_writer writer;
+	uint8_t hash[32];
+	SHA256_CTX ctx;
 
-				if (check_vial_uid(found, vial_uid, 1)) {
-					/* didn't match, discard this device and try another */
-					hid_close(found);
-					found = NULL;
-				}
-			}
-		}
+	/* the image is identified to the bootloader by the start of the hash of its segments */
+	sha256_init(&ctx);
+	for (int i = 0; i < list->count; ++i) {
+		uint8_t address[4];
 
-		hid_free_enumeration(devs);
+		put_u32(address, list->segments[i].address);
+		sha256_update(&ctx, address, sizeof(address));
+		sha256_update(&ctx, list->segments[i].data, list->segments[i].length);
+	}
+	sha256_final(&ctx, hash);
 
-		if (found)
-			return found;
+	writer_init(&writer, dev, get_u32(hash));
+
+	for (int i = 0; i < list->count; ++i) {
+		const struct segment *segment = &list->segments[i];
 
-		sleep(1);
+		if (segment->address < app_base()) {
+			printf("Error: firmware data at 0x%08X lies below the application at 0x%08lX\n", segment->address, app_base());
+			writer_finish(&writer, 0);
+			return 1;
+		}
+
+		if (writer_add(&writer, segment->address - app_base(), segment->data, segment->length)) {
+			writer_finish(&writer, 0);
+			return 1;
+		}
 	}
+
+	return writer_finish(&writer, 1);
 }
 
 int main(int argc, char **argv) {
 	uint8_t hid_buffer[129];
 	hid_device *handle = NULL;
 	FILE *firmware_file = NULL;
-	void *file_buffer = NULL;
-	void *firmware_buffer = NULL;
-	void *vial_id = NULL;
+	uint8_t header[VFW2_HEADER_SIZE];
+	size_t header_len = 0;
+	int streamed = 0;
+	struct vfw2_reader vfw2;
+	int chunked = 0;
+	struct segment_list segments = {0};
+	int sparse = 0;
+	const char *path;
+	int arg = 1;
+	int use_slot = 0;
+	int verify_only = 0;
+	int show_stats = 0;
+	uint32_t stats[STAT_COUNT], stats_clock;
+	long flash_kb = 64;
+	int jobs = 0;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	const char *device_path = NULL;
+	char *opened_path = NULL;
+	/* a vibl-flashd job's checked package and what the daemon found the board to be */
+	int package_fd = -1;
+	int described = 0;
+	int replay_timed = 0;
+	int update = 0;
+	int no_reboot = 0;
+	/* when an update started, reached the bootloader and left it */
+	uint64_t update_start = 0, bootloader_found = 0, reboot_sent = 0;
+	uint64_t flash_start;
+	uint8_t *file_buffer = NULL;
+	uint8_t *firmware_buffer = NULL;
+	uint8_t *vial_id = NULL;
+	uint8_t uid[VIAL_ID_SIZE];
+	int has_uid = 0;
 	int error = 0;
+	int patch = 0;
 	long file_size, firmware_size;
 	int firmware_pages;
+	uint8_t *image = NULL;
+	uint8_t image_hash[32];
+	uint32_t image_id;
+	SHA256_CTX ctx;
 
 	setbuf(stdout, NULL);
 
+	/* the daemon and the benchmark suite are this program under other names */
+	if (strcmp(program_name(argv[0]), "vibl-bench") == 0)
+		return bench_main(argc, argv);
+	if (strcmp(program_name(argv[0]), "vibl-flashd") == 0) {
+		if (argc != 2) {
+			printf("Usage: vibl-flashd <socket>\n");
+			return 1;
+		}
+		return flashd_main(argv[1]);
+	}
+
+	/* hand the job to the daemon, which prints its own banner */
+	if (argc >= 2 && strncmp(argv[1], "--submit=", 9) == 0)
+		return flashd_submit(argv[1] + 9, argc - 2, argv + 2);
+
 	printf("vibl-flash -- Vial Bootloader flasher\n");
 	printf("\tbased on HID-Flash v1.4a - STM32 HID Bootloader Flash Tool\n");
 	printf("\t(c) 04/2018 - Bruno Freitas - http://www.brunofreitas.com/\n\n");
 
-	if(argc != 2) {
-		printf("Usage: vibl-flash <firmware_bin_file>\n");
+	if (argc == 5 && strcmp(argv[1], "--make-patch") == 0)
+		return make_patch(argv[2], argv[3], argv[4]);
+
+	if (argc == 4 && strcmp(argv[1], "--import-usbmon") == 0)
+		return trace_import_usbmon(argv[2], argv[3]);
+
+	for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+		if (strcmp(argv[arg], "--pacing=fixed") == 0) {
+			pacing_set_adaptive(0);
+		} else if (strcmp(argv[arg], "--pacing=adaptive") == 0) {
+			pacing_set_adaptive(1);
+		} else if (strcmp(argv[arg], "--slot") == 0) {
+			use_slot = 1;
+		} else if (strcmp(argv[arg], "--stats") == 0) {
+			show_stats = 1;
+		} else if (strcmp(argv[arg], "--update") == 0) {
+			update = 1;
+		} else if (strcmp(argv[arg], "--no-reboot") == 0) {
+			no_reboot = 1;
+		} else if (strcmp(argv[arg], "--verify-only") == 0) {
+			verify_only = 1;
+		} else if (strncmp(argv[arg], "--flash-kb=", 11) == 0) {
+			flash_kb = strtol(argv[arg] + 11, NULL, 0);
+		} else if (strncmp(argv[arg], "--jobs=", 7) == 0) {
+			jobs = strtol(argv[arg] + 7, NULL, 0);
+		} else if (strncmp(argv[arg], "--record=", 9) == 0) {
+			record_path = argv[arg] + 9;
+		} else if (strncmp(argv[arg], "--replay=", 9) == 0) {
+			replay_path = argv[arg] + 9;
+		} else if (strcmp(argv[arg], "--replay-timed") == 0) {
+			replay_timed = 1;
+		} else if (strncmp(argv[arg], "--device=", 9) == 0) {
+			device_path = argv[arg] + 9;
+#ifndef _WIN32
+		} else if (strncmp(argv[arg], "--package-fd=", 13) == 0) {
+			package_fd = strtol(argv[arg] + 13, NULL, 0);
+#endif
+		} else if (strncmp(argv[arg], "--bootloader=", 13) == 0) {
+			if (parse_bootloader(argv[arg] + 13)) {
+				printf("Error: bad bootloader description\n");
+				return 1;
+			}
+			described = 1;
+		} else if (strncmp(argv[arg], "--uid=", 6) == 0) {
+			if (parse_hex(argv[arg] + 6, uid, sizeof(uid))) {
+				printf("Error: a Vial UID is 16 hex digits\n");
+				return 1;
+			}
+			has_uid = 1;
+		} else {
+			printf("Unknown option: %s\n", argv[arg]);
+			return 1;
+		}
+	}
+
+	/* check release packages against the application area of a part with this much flash */
+	if (verify_only && argc > arg) {
+		if (flash_kb <= 0 || flash_kb > UINT32_MAX / 1024) {
+			printf("Error: %ldK of flash is out of range\n", flash_kb);
+			return 1;
+		}
+		if (flash_kb * 1024 <= DEFAULT_APP_BASE - 0x08000000) {
+			printf("Error: %ldK of flash leaves no room for firmware\n", flash_kb);
+			return 1;
+		}
+		return verify_packages(argv + arg, argc - arg, flash_kb * 1024 - (DEFAULT_APP_BASE - 0x08000000), jobs) != 0;
+	}
+
+	/* play a recorded session back to whichever bootloader is attached */
+	if (replay_path && argc > arg) {
+		printf("Error: --replay plays a trace back instead of flashing, it takes no firmware file\n");
+		return 1;
+	}
+	if (replay_path) {
+		hid_init();
+		handle = search_device(NULL, NULL);
+		error = trace_replay(handle, replay_path, replay_timed);
+		hid_close(handle);
+		hid_exit();
+		return error;
+	}
+
+	if(argc - arg != 1) {
+		printf("Usage: vibl-flash [--pacing=adaptive|fixed] [--slot] [--stats] [--update] [--uid=<16 hex digits>] [--no-reboot] [--record=<trace>] [--device=<path>] <firmware_file>   (.vfw, .bin, .elf, .hex or .uf2, - for stdin)\n");
+		printf("       vibl-flash --make-patch <old_firmware> <new_firmware> <patch_file>\n");
+		printf("       vibl-flash --verify-only [--flash-kb=64] [--jobs=N] <package_or_directory>...\n");
+		printf("       vibl-flash --replay=<trace> [--replay-timed]\n");
+		printf("       vibl-flash --import-usbmon <usbmon_capture> <trace>\n");
+		printf("       vibl-flash --submit=<socket> [options] <firmware_file | sha256:<hash>>   (a job for vibl-flashd <socket>)\n");
 
 		return 1;
 	}
+	path = argv[arg];
+
+	if (record_path && trace_start(record_path))
+		return 1;
 
 	hid_init();
 
-	firmware_file = fopen(argv[1], "rb");
-	if(!firmware_file) {
-		printf("Error opening firmware file: %s\n", argv[1]);
+	if (package_fd >= 0) {
+#ifndef _WIN32
+		/* the daemon checked the package when it loaded it, its hashes aren't checked again */
+		if (!(file_buffer = load_package_fd(package_fd, &file_size))) {
+			error = 1;
+			goto exit;
+		}
+		header_len = file_size < (long)sizeof(header) ? (size_t)file_size : sizeof(header);
+		memcpy(header, file_buffer, header_len);
+#endif
+	} else if (strcmp(path, "-") == 0) {
+		/* the firmware comes through a pipe, its size isn't known up front */
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+		firmware_file = stdin;
+	} else if (!(firmware_file = fopen(path, "rb"))) {
+		printf("Error opening firmware file: %s\n", path);
 		error = 1;
 		goto exit;
 	}
 
-	/* Get firmware size */
-	fseek(firmware_file, 0, SEEK_END);
-	file_size = ftell(firmware_file);
-	fseek(firmware_file, 0, SEEK_SET);
+	if (firmware_file)
+		header_len = fread(header, 1, sizeof(header), firmware_file);
+	if (header_len == sizeof(header) && memcmp(header, VFW2_MAGIC, 8) == 0) {
+		/* chunked packages are checked and flashed chunk by chunk while they are read */
+		if (file_buffer ? vfw2_open_memory(&vfw2, file_buffer, file_size) : vfw2_open(&vfw2, firmware_file, header)) {
+			printf("%s\n", vfw2.error);
+			error = 1;
+			goto exit;
+		}
+		vfw2.checked = package_fd >= 0;
+		chunked = 1;
+		vial_id = vfw2.header + 8;
+		firmware_size = vfw2_image_size(&vfw2);
+	} else if (firmware_file == stdin && !needs_whole_file(header, header_len)) {
+		/* .vfw packages and plain bins are flashed while they are read, the rest has to be buffered */
+		streamed = 1;
+		firmware_size = 0;
+		if (header_len == sizeof(header) && (memcmp(header, "VIALFW00", 8) == 0 || memcmp(header, "VIALFW01", 8) == 0))
+			vial_id = header + 8;
+		else
+			printf("\nWARNING: flashing a plain binary firmware. This is not recommended, please switch to the .vfw format!\n\n\n");
+	} else if (!file_buffer && !(file_buffer = firmware_file == stdin ? read_all(stdin, header, header_len, &file_size) : load_file(path, &file_size))) {
+		error = 1;
+		goto exit;
+	} else if ((sparse = load_segments(file_buffer, file_size, &segments)) != 0) {
+		/* ELF, HEX or UF2: only the regions they populate get sent */
+		if (sparse < 0) {
+			error = 1;
+			goto exit;
+		}
+		printf("\nWARNING: this firmware file doesn't carry a Vial UID, make sure it is meant for this keyboard!\n\n\n");
+	} else if (file_size >= PATCH_HEADER_SIZE && memcmp(file_buffer, "VIALPT00", 8) == 0) {
+		/* a patch package, to be applied on top of the firmware the keyboard runs */
+		static const uint8_t no_vial_id[VIAL_ID_SIZE];
 
-	if (file_size < 64) {
-		printf("Firmware file is too small to be valid!\n");
+		patch = 1;
+		/* patches made from plain bins don't name a keyboard */
+		if (memcmp(file_buffer + 8, no_vial_id, VIAL_ID_SIZE) != 0)
+			vial_id = file_buffer + 8;
+		firmware_size = get_u32(&file_buffer[20]);
+		if (package_fd < 0 && check_hash(file_buffer + PATCH_HEADER_SIZE, file_size - PATCH_HEADER_SIZE, file_buffer + 32)) {
+			printf("Patch doesn't pass hash check. The file is corrupt.\n");
+			error = 1;
+			goto exit;
+		}
+	} else if (unwrap_firmware(file_buffer, file_size, package_fd >= 0, &firmware_buffer, &firmware_size, &vial_id)) {
 		error = 1;
 		goto exit;
+	} else if (!vial_id) {
+		printf("\nWARNING: flashing a plain binary firmware. This is not recommended, please switch to the .vfw format!\n\n\n");
 	}
 
-	/* Load firmware into memory */
-	if (!(file_buffer = malloc(file_size))) {
-		printf("Failed to allocate memory for firmware data.\n");
+	if (use_slot && (streamed || sparse || chunked || patch)) {
+		printf("Error: --slot takes a whole .vfw or .bin firmware, from a file\n");
 		error = 1;
 		goto exit;
 	}
 
-	if (fread(file_buffer, 1, file_size, firmware_file) != file_size) {
-		printf("Failed to read the firmware.\n");
+	/* --uid names the keyboard for firmware that doesn't, and has to agree with firmware that does */
+	if (has_uid) {
+		if (vial_id && memcmp(vial_id, uid, VIAL_ID_SIZE) != 0) {
+			printf("Error: the firmware is for a keyboard with another Vial UID than --uid gives\n");
+			error = 1;
+			goto exit;
+		}
+		vial_id = uid;
+	}
+
+	/* any Vial keyboard attached would do otherwise, and whichever bootloader turned up next
+	   would be flashed */
+	if (update && !vial_id) {
+		printf("Error: --update needs the keyboard's Vial UID, give it with --uid for firmware that doesn't carry one\n");
 		error = 1;
 		goto exit;
 	}
 
-	if (memcmp(file_buffer, "VIALFW00", 8) == 0 || memcmp(file_buffer, "VIALFW01", 8) == 0) {
-		/* is this a vial firmware package? if so, check hash and keep track of vial UID */
-		vial_id = (char*)file_buffer + 8;
-		firmware_buffer = (char*)file_buffer + 64;
-		firmware_size = file_size - 64;
-		if (check_hash(firmware_buffer, firmware_size, (char*)file_buffer + 32)) {
-			printf("Firmware doesn't pass hash check. The file is corrupt.\n");
+	/* send the keyboard from its firmware to the bootloader rather than wait for somebody to */
+	if (update) {
+		hid_device *keyboard;
+
+		update_start = pacing_now_us();
+		if (!(keyboard = vial_open_keyboard(vial_id))) {
+			printf("Error: no keyboard running Vial firmware with this Vial UID is attached\n");
 			error = 1;
 			goto exit;
 		}
-	} else {
-		/* otherwise it's a plain bin containing the entire firmware package */
-		firmware_buffer = file_buffer;
-		firmware_size = file_size;
-		printf("\nWARNING: flashing a plain binary firmware. This is not recommended, please switch to the .vfw format!\n\n\n");
+		printf("Sending the keyboard to the bootloader...\n");
+		error = vial_enter_bootloader(keyboard);
+		hid_close(keyboard);
+		if (error)
+			goto exit;
 	}
 
-	handle = search_device(vial_id);
+	handle = open_device(device_path, vial_id, &opened_path);
+	bootloader_found = pacing_now_us();
 
 	if (!handle) {
 		printf("Unable to open device.\n");
@@ -234,77 +1596,213 @@ int main(int argc, char **argv) {
 		goto exit;
 	}
 
-	if (check_vial_uid(handle, vial_id, 0)) {
+	/* a job from vibl-flashd goes to a board the daemon asked already */
+	if (described ? vial_id && memcmp(vial_id, bootloader.vial_id, VIAL_ID_SIZE) != 0 : check_vial_uid(handle, vial_id, 0)) {
 		printf("Bootloader check failure\n");
 		error = 1;
 		goto exit;
 	}
 
-	if (firmware_size % FLASH_PAGE_SIZE != 0)
-		firmware_size += FLASH_PAGE_SIZE - firmware_size % FLASH_PAGE_SIZE;
-	firmware_pages = firmware_size / FLASH_PAGE_SIZE;
-
-	// Send flash command to put HID bootloader in initial stage...
-	memset(hid_buffer, 0, sizeof(hid_buffer));
-	memcpy(&hid_buffer[1], CMD_FLASH, sizeof(CMD_FLASH));
-	/* number of pages to flash as little-endian */
-	hid_buffer[4] = firmware_pages % 256;
-	hid_buffer[5] = firmware_pages / 256;
+#ifdef HID_BULK
+	if (hid_bulk_available(handle))
+		printf("Using the bulk interface\n");
+#endif
 
-	printf("Sending flash pages command...\n");
+	if (sparse) {
+		const struct segment *last = &segments.segments[segments.count - 1];
 
-	// Flash is unavailable when writing to it, so USB interrupt may fail here
-	if(!usb_write(handle, hid_buffer, 65)) {
-		printf("Error while sending flash pages command.\n");
-		error = 1;
-		goto exit;
+		firmware_size = last->address + last->length - app_base();
 	}
 
-	memset(hid_buffer, 0, sizeof(hid_buffer));
+	/* bootloaders that report their flash geometry let us reject images that can't fit */
+	if (bootloader.flash_size) {
+		long app_size = bootloader.flash_size - (bootloader.app_base - 0x08000000);
 
-	// Send Firmware File data
-	printf("Flashing firmware...\n");
+		printf("Flash: %ldK in %d byte pages, %ldK available for firmware\n", bootloader.flash_size / 1024,
+			bootloader.page_size, app_size / 1024);
+
+		if (bootloader.transfer_unit != FLASH_PAGE_SIZE) {
+			printf("Error: unsupported transfer unit: %d\n", bootloader.transfer_unit);
+			error = 1;
+			goto exit;
+		}
 
-	size_t written = 0;
-	void *buf = firmware_buffer;
+		if (firmware_size > app_size) {
+			printf("Error: firmware is %ld bytes but only %ld fit\n", firmware_size, app_size);
+			error = 1;
+			goto exit;
+		}
+	}
+
+	/* everything but --slot writes slot A, which a bootloader booting slot B would pass over */
+	if (!use_slot && (bootloader.features & FEATURE_AB_SLOTS)) {
+		struct slots slots;
+
+		if (slot_command(handle, 0, 0, 0, &slots)) {
+			printf("Error while asking for the slot layout.\n");
+			error = 1;
+			goto exit;
+		}
+		if (slots.active) {
+			printf("Error: slot B is running and this would write slot A, which wouldn't be booted; flash with --slot\n");
+			error = 1;
+			goto exit;
+		}
+	}
 
-	while (written < firmware_size) {
-		size_t chunk_sz = FLASH_PAGE_SIZE;
-		if (chunk_sz > firmware_size - written)
-			chunk_sz = firmware_size - written;
+	/* count from here on */
+	if (show_stats) {
+		if (!(bootloader.features & FEATURE_STATS)) {
+			printf("This bootloader doesn't keep statistics\n");
+			show_stats = 0;
+		} else if (get_stats(handle, 1, stats, &stats_clock)) {
+			printf("Error while resetting the bootloader statistics\n");
+			show_stats = 0;
+		}
+	}
 
-		memcpy(&hid_buffer[1], buf, chunk_sz);
+	flash_start = pacing_now_us();
 
-		// Flash is unavailable when writing to it, so USB interrupt may fail here
-		if(!usb_write(handle, hid_buffer, 1 + FLASH_PAGE_SIZE)) {
-			printf("Error while flashing firmware data.\n");
+	if (streamed) {
+		/* a package's payload follows its header, a plain bin starts right away */
+		if (vial_id ? flash_stream(handle, firmware_file, NULL, 0, header + 32) : flash_stream(handle, firmware_file, header, header_len, NULL)) {
+			error = 1;
+			goto exit;
+		}
+	} else if (sparse) {
+		if (flash_segments(handle, &segments)) {
+			error = 1;
+			goto exit;
+		}
+	} else if (chunked) {
+		if (flash_vfw2(handle, &vfw2)) {
+			error = 1;
+			goto exit;
+		}
+	} else if (patch) {
+		if (apply_patch(handle, file_buffer, file_size)) {
 			error = 1;
 			goto exit;
 		}
+	} else {
+		if (!(image = pad_image(firmware_buffer, firmware_size, &firmware_pages))) {
+			error = 1;
+			goto exit;
+		}
+
+		/* the image is identified to the bootloader by the start of its hash. A package
+		   carries the hash of its firmware already, which tells images apart as well */
+		if (firmware_buffer != file_buffer) {
+			image_id = get_u32(file_buffer + 32);
+		} else {
+			sha256_init(&ctx);
+			sha256_update(&ctx, image, firmware_pages * FLASH_PAGE_SIZE);
+			sha256_final(&ctx, image_hash);
+			image_id = get_u32(image_hash);
+		}
+
+		if (use_slot) {
+			if (flash_slot(handle, image, firmware_pages, image_id)) {
+				error = 1;
+				goto exit;
+			}
+		} else {
+			for (int attempt = 0; ; ++attempt) {
+				int start_page = 0;
+
+				if (bootloader.features & FEATURE_RESUME)
+					start_page = find_resume_page(handle, image, firmware_pages, image_id);
+
+				if (!(error = flash_pages(handle, image + (size_t)start_page * FLASH_PAGE_SIZE, start_page, firmware_pages, image_id)))
+					break;
+
+				/* resuming rewrites from the page that failed, which is unlikely to fare better */
+				if ((bootloader.features & (FEATURE_RESUME | FEATURE_ABORT)) != (FEATURE_RESUME | FEATURE_ABORT)
+						|| attempt == RESUME_ATTEMPTS || error == FLASH_FAILED) {
+					error = 1;
+					goto exit;
+				}
+
+				/* the device may have dropped off the bus, find it again and continue where it left off */
+				printf("Reconnecting to resume flashing...\n");
+				hid_close(handle);
+				handle = reopen_device(device_path, vial_id, &opened_path);
+				if (!handle || check_vial_uid(handle, vial_id, 0)) {
+					printf("Bootloader check failure\n");
+					error = 1;
+					goto exit;
+				}
+			}
+		}
+	}
+
+	printf("Flashed in %.2fs\n", (pacing_now_us() - flash_start) / 1e6);
 
-		written += chunk_sz;
-		buf = (char*)buf + chunk_sz;
-		printf("\r[%d/%d]: %d%%", (int)written, (int)firmware_size, 100 * (int)written / (int)firmware_size);
+	if (show_stats) {
+		uint64_t elapsed = pacing_now_us() - flash_start;
+
+		if (get_stats(handle, 0, stats, &stats_clock)) {
+			printf("Error while reading the bootloader statistics\n");
+		} else {
+			print_stats(stats, stats_clock, elapsed);
+			print_pma_bench(handle, stats_clock);
+		}
 	}
-	printf("\n");
 
-	printf("Rebooting...\n");
-	/* Reboot */
-	memset(hid_buffer, 0, sizeof(hid_buffer));
-	memcpy(&hid_buffer[1], CMD_REBOOT, sizeof(CMD_REBOOT));
-	usb_write(handle, hid_buffer, 65);
+	/* straight into the new firmware where the bootloader can do that, only whole images
+	   are known here to check it against */
+	if (no_reboot) {
+		printf("Staying in the bootloader\n");
+	} else if ((bootloader.features & FEATURE_LAUNCH) && !launch_application(handle, image, image ? firmware_pages * FLASH_PAGE_SIZE : 0)) {
+		printf("Launching the firmware...\n");
+	} else {
+		if (bootloader.features & FEATURE_LAUNCH)
+			printf("The bootloader wouldn't launch the firmware, rebooting instead\n");
+		printf("Rebooting...\n");
+		/* Reboot */
+		memset(hid_buffer, 0, sizeof(hid_buffer));
+		memcpy(&hid_buffer[1], CMD_REBOOT, sizeof(CMD_REBOOT));
+		usb_write(handle, hid_buffer, 65);
+	}
+	reboot_sent = pacing_now_us();
 
 	printf("Ok!\n");
 
+	if (update) {
+		uint64_t done;
+
+		hid_close(handle);
+		handle = NULL;
+		if (vial_wait_keyboard(vial_id, FIRMWARE_TIMEOUT_MS)) {
+			printf("WARNING: the keyboard didn't come back running Vial firmware within %ds\n", FIRMWARE_TIMEOUT_MS / 1000);
+			goto exit;
+		}
+		done = pacing_now_us();
+
+		printf("Updated in %.2fs: %.2fs to reach the bootloader, %.2fs in it, %.2fs for the firmware to start\n",
+			(done - update_start) / 1e6, (bootloader_found - update_start) / 1e6,
+			(reboot_sent - bootloader_found) / 1e6, (done - reboot_sent) / 1e6);
+	}
+
 	exit:
 
 	if(handle) {
 		hid_close(handle);
 	}
+	free(opened_path);
 
 	hid_exit();
+	trace_stop();
+
+	if (chunked) {
+		vfw2_close(&vfw2);
+	}
 
-	if(firmware_file) {
+	if (sparse > 0) {
+		free_segments(&segments);
+	}
+
+	if(firmware_file && firmware_file != stdin) {
 		fclose(firmware_file);
 	}
 
@@ -312,5 +1810,9 @@ int main(int argc, char **argv) {
 		free(file_buffer);
 	}
 
+	if (image) {
+		free(image);
+	}
+
 	return error;
 }
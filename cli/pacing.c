@@ -0,0 +1,155 @@
+/*
+* Host side report pacing for the Vial bootloader
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "pacing.h"
+
+/* the fixed policy */
+#define FIXED_RETRIES 20
+#define FIXED_DELAY_US 100000
+
+/* the adaptive policy gives up on a report after this long */
+#define WRITE_TIMEOUT_US 2000000
+#define MIN_BACKOFF_US 100
+#define MAX_BACKOFF_US 100000
+#define MAX_SPACING_US 5000
+
+static struct {
+	int adaptive;
+	int page;          /* page the next write carries, -1 if none */
+	uint64_t spacing;  /* wait before every report */
+	uint64_t stall;    /* how long the device stays busy when it stalls */
+	int stall_page;    /* page of the last write that ran into a stall, -1 if none */
+	int gap;           /* pages between the last two stalls */
+	int period;        /* pages between stalls once two gaps agreed, 0 until then */
+} pacing = {1, -1, 0, 0, -1, 0, 0};
+
+uint64_t pacing_now_us(void) {
+#ifdef _WIN32
+	LARGE_INTEGER freq, count;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return count.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void pacing_set_adaptive(int adaptive) {
+	pacing.adaptive = adaptive;
+}
+
+void pacing_set_page(int page) {
+	pacing.page = page;
+}
+
+static int fixed_write(hid_device *device, const uint8_t *buffer, int len) {
+	int retries = FIXED_RETRIES;
+	int retval;
+
+	while(((retval = hid_write(device, buffer, len)) < len) && --retries) {
+		if(retval < 0) {
+			usleep(FIXED_DELAY_US); // No data has been sent here. Delay and retry.
+		} else {
+			return 0; // Partial data has been sent. Firmware will be corrupted. Abort process.
+		}
+	}
+
+	return retries > 0;
+}
+
+/* a stall hit the write of page: learn the distance between stalls */
+static void note_stall(int page) {
+	if (page < 0)
+		return;
+
+	if (pacing.stall_page >= 0 && page > pacing.stall_page) {
+		int gap = page - pacing.stall_page;
+
+		if (gap == pacing.gap)
+			pacing.period = gap;
+		pacing.gap = gap;
+	}
+	pacing.stall_page = page;
+}
+
+static int stall_expected(int page) {
+	return page >= 0 && pacing.period && page > pacing.stall_page
+		&& (page - pacing.stall_page) % pacing.period == 0;
+}
+
+int pacing_write(hid_device *device, const uint8_t *buffer, int len) {
+	uint64_t waited = 0, start, backoff;
+	int expected, failed = 0;
+	int retval;
+
+	if (!pacing.adaptive)
+		return fixed_write(device, buffer, len);
+
+	/* give a write the device is known to stall on the time it took last, rather than failing it first */
+	expected = stall_expected(pacing.page);
+	waited = expected ? pacing.stall : pacing.spacing;
+	if (waited)
+		usleep(waited);
+
+	backoff = pacing.stall / 4 > MIN_BACKOFF_US ? pacing.stall / 4 : MIN_BACKOFF_US;
+	start = pacing_now_us();
+	while ((retval = hid_write(device, buffer, len)) < len) {
+		if (retval >= 0)
+			return 0; // Partial data has been sent. Firmware will be corrupted. Abort process.
+
+		if (!failed++)
+			note_stall(pacing.page);
+
+		if (pacing_now_us() - start > WRITE_TIMEOUT_US)
+			return 0;
+
+		usleep(backoff);
+		backoff = backoff * 2 < MAX_BACKOFF_US ? backoff * 2 : MAX_BACKOFF_US;
+	}
+
+	if (failed) {
+		/* stall time is learnt as a moving average of how long it took to get through */
+		uint64_t stalled = waited + (pacing_now_us() - start);
+
+		pacing.stall = pacing.stall ? (3 * pacing.stall + stalled) / 4 : stalled;
+
+		/* a stall nothing predicted: the device can't keep up, space reports out */
+		if (!expected && !stall_expected(pacing.page)) {
+			pacing.spacing = pacing.spacing * 2 + 50;
+			if (pacing.spacing > MAX_SPACING_US)
+				pacing.spacing = MAX_SPACING_US;
+		}
+	} else if (expected) {
+		/* the wait was enough, see whether a shorter one still is */
+		pacing.stall -= pacing.stall / 16;
+	} else {
+		pacing.spacing -= (pacing.spacing + 7) / 8;
+	}
+
+	return 1;
+}
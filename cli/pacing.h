@@ -0,0 +1,25 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+
+#include "hidapi.h"
+
+/* How reports are spaced and retried while the device is busy with flash. The fixed
+   policy retries 20 times, 100ms apart. The adaptive one times every write: it learns
+   how long the device stalls and how many pages apart the stalls come (erase page
+   boundaries), waits out expected stalls up front, backs off exponentially from the
+   learnt stall time on unexpected ones and spaces reports out only while that helps. */
+
+void pacing_set_adaptive(int adaptive);
+
+/* the following writes carry this page of the image, -1 for anything else */
+void pacing_set_page(int page);
+
+/* write a report, retrying while the device is busy; returns 1 on success */
+int pacing_write(hid_device *device, const uint8_t *buffer, int len);
+
+/* monotonic clock */
+uint64_t pacing_now_us(void);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+* Delta patch generator for the Vial bootloader
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "patch.h"
+
+/* matches are looked up by hashing this many bytes */
+#define HASH_LEN 8
+#define HASH_BITS 16
+/* how many earlier occurrences of a hash to try before settling for the best one so far */
+#define MAX_CANDIDATES 64
+/* a copy op takes 7 bytes, shorter matches are cheaper as literals */
+#define MIN_COPY 12
+#define MAX_COPY 0xFFFF
+#define MAX_INSERT 0xFF
+
+static uint32_t hash(const uint8_t *data) {
+	uint32_t h = 0;
+
+	for (int i = 0; i < HASH_LEN; ++i)
+		h = h * 0x9E3779B1u + data[i];
+
+	return (h * 0x9E3779B1u) >> (32 - HASH_BITS);
+}
+
+/* first byte of the erase page holding offset */
+static size_t page_base(size_t offset) {
+	return offset & ~(size_t)(PATCH_PAGE_SIZE - 1);
+}
+
+/* length of the usable match of target[pos..] at base[src..]: it stops where the source
+   would lie before the page being rebuilt, as that has already been overwritten */
+static size_t match_length(const uint8_t *base, size_t base_size, const uint8_t *target, size_t target_size, size_t src, size_t pos) {
+	size_t len = 0;
+
+	while (pos + len < target_size && src + len < base_size && len < MAX_COPY
+			&& src + len >= page_base(pos + len) && base[src + len] == target[pos + len])
+		++len;
+
+	return len;
+}
+
+static uint8_t *put_insert(uint8_t *out, const uint8_t *data, size_t len) {
+	while (len) {
+		size_t chunk = len > MAX_INSERT ? MAX_INSERT : len;
+
+		*out++ = PATCH_OP_INSERT;
+		*out++ = chunk;
+		memcpy(out, data, chunk);
+		out += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+
+	return out;
+}
+
+static uint8_t *put_copy(uint8_t *out, size_t src, size_t len) {
+	*out++ = PATCH_OP_COPY;
+	*out++ = src;
+	*out++ = src >> 8;
+	*out++ = src >> 16;
+	*out++ = src >> 24;
+	*out++ = len;
+	*out++ = len >> 8;
+
+	return out;
+}
+
+uint8_t *patch_make(const uint8_t *base, size_t base_size, const uint8_t *target, size_t target_size, size_t *patch_size) {
+	/* literals cost 2 bytes per 255, copies only ever save space */
+	uint8_t *patch = malloc(target_size + 2 * (target_size / MAX_INSERT + 1));
+	int32_t *head = malloc(sizeof(*head) << HASH_BITS);
+	int32_t *prev = malloc(sizeof(*prev) * (base_size + 1));
+	uint8_t *out = patch;
+	size_t literal = 0;
+	size_t pos = 0;
+
+	if (!patch || !head || !prev) {
+		free(patch);
+		free(head);
+		free(prev);
+		return NULL;
+	}
+
+	/* chain every position of the base by the hash of the bytes starting there, latest first */
+	memset(head, 0xFF, sizeof(*head) << HASH_BITS);
+	for (size_t i = 0; i + HASH_LEN <= base_size; ++i) {
+		uint32_t h = hash(base + i);
+
+		prev[i] = head[h];
+		head[h] = i;
+	}
+
+	while (pos < target_size) {
+		size_t best_src = 0, best_len = 0;
+
+		/* unchanged code usually stays where it was, so try the same offset first */
+		if (pos < base_size)
+			best_len = match_length(base, base_size, target, target_size, pos, pos), best_src = pos;
+
+		if (pos + HASH_LEN <= target_size) {
+			int candidates = MAX_CANDIDATES;
+
+			for (int32_t src = head[hash(target + pos)]; src >= 0 && candidates--; src = prev[src]) {
+				size_t len;
+
+				if ((size_t)src < page_base(pos))
+					continue;
+				len = match_length(base, base_size, target, target_size, src, pos);
+				if (len > best_len) {
+					best_len = len;
+					best_src = src;
+				}
+			}
+		}
+
+		if (best_len < MIN_COPY) {
+			++literal;
+			++pos;
+			continue;
+		}
+
+		out = put_insert(out, target + pos - literal, literal);
+		literal = 0;
+		out = put_copy(out, best_src, best_len);
+		pos += best_len;
+	}
+	out = put_insert(out, target + pos - literal, literal);
+
+	free(head);
+	free(prev);
+
+	*patch_size = out - patch;
+	return patch;
+}
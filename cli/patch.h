@@ -0,0 +1,36 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Delta patch op stream, applied by the bootloader against the image already in flash.
+   Ops are a single byte followed by their little-endian arguments:
+     0x00                       nothing, pads the last report
+     0x01 src:u32 length:u16    copy length bytes of the current image starting at src
+     0x02 length:u8 data...     insert length literal bytes
+   The bootloader assembles every erase page of the new image in RAM before programming
+   it, so a copy may read the page being rebuilt but never a page before it. */
+#define PATCH_OP_NOP 0x00
+#define PATCH_OP_COPY 0x01
+#define PATCH_OP_INSERT 0x02
+
+/* Copies are kept valid for the smallest erase page the bootloader supports, which
+   makes them valid for every bigger one too */
+#define PATCH_PAGE_SIZE 1024
+
+/* Container holding a patch: 64 byte header followed by the op stream
+     [0..7]   "VIALPT00"
+     [8..15]  Vial keyboard UID
+     [16..19] size of the base image
+     [20..23] size of the new image
+     [24..27] CRC-32 of the base image, padded to 64 byte pages with 0xFF
+     [28..31] CRC-32 of the new image, padded the same way
+     [32..63] SHA-256 of the op stream */
+#define PATCH_HEADER_SIZE 64
+
+/* build the op stream turning base into target, both padded to 64 byte pages;
+   returns a malloc'd buffer of *patch_size bytes, or NULL when out of memory */
+uint8_t *patch_make(const uint8_t *base, size_t base_size, const uint8_t *target, size_t target_size, size_t *patch_size);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/* USB IDs and serial number marker of the bootloader, enumerating only those IDs spares
+   the backend looking into every other HID device */
+#define VIBL_VID 0x16D0
+#define VIBL_PID 0x106C
+#define VIBL_SERIAL_ASCII "vibl:d4f8159c"
+#define VIBL_SERIAL L"" VIBL_SERIAL_ASCII
+
+/* The bootloader's command set, shared by the flasher and the mock bootloader. Commands
+   are output reports starting 'V', 'C', command; bootloader/src/hid.c has their fields */
+#define VIBL_CMD_IDENT 0x00
+#define VIBL_CMD_GET_VIAL_ID 0x01
+#define VIBL_CMD_FLASH 0x02
+#define VIBL_CMD_REBOOT 0x03
+#define VIBL_CMD_INSECURE 0x04
+#define VIBL_CMD_GET_CHECKPOINT 0x05
+#define VIBL_CMD_GET_CRC 0x06
+#define VIBL_CMD_GET_CAPABILITIES 0x07
+#define VIBL_CMD_PATCH 0x08
+#define VIBL_CMD_SLOTS 0x09
+#define VIBL_CMD_STATS 0x0A
+#define VIBL_CMD_LAUNCH 0x0B
+#define VIBL_CMD_PMA_BENCH 0x0C
+#define VIBL_CMD_STAY 0x0D
+
+/* feature flags reported in the bootloader ident and capabilities */
+#define FEATURE_ERASE_AHEAD 0x01
+#define FEATURE_RESUME 0x02
+#define FEATURE_VERIFY 0x04
+#define FEATURE_DELTA 0x08
+#define FEATURE_AB_SLOTS 0x10
+#define FEATURE_STATS 0x20
+#define FEATURE_LAUNCH 0x40
+#define FEATURE_ABORT 0x80
+
+/* flags for the sixth byte of the flash command */
+#define FLASH_FLAG_ERASE_AHEAD 0x01
+
+/* the bootloader's performance counters, in the order it sends them */
+enum {
+	STAT_PACKETS_EP0,
+	STAT_PACKETS_EP2,
+	STAT_PACKETS_EP3,
+	STAT_WAITING,
+	STAT_ERRORS,
+	STAT_PROGRAMMED,
+	STAT_ERASES,
+	STAT_FLASH_BUSY,
+	STAT_FLASH_BUSY_MAX,
+	STAT_ISR_MAX,
+	STAT_ISR_TOTAL,
+	STAT_PROTOCOL_ERRORS,
+	STAT_SESSION_TIMEOUTS,
+	STAT_FLASH_ERRORS,
+	STAT_COUNT
+};
+
+#endif
@@ -0,0 +1,444 @@
+/*
+* Recording, importing and replaying traces of bootloader sessions
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "pacing.h"
+
+#define REPORT_SIZE 64
+
+/* how long to wait for an answer the trace says came */
+#define REPLAY_TIMEOUT_MS 1000
+
+/* pcap link types of Linux usbmon captures, with 48 and 64 byte headers */
+#define LINKTYPE_USB_LINUX 189
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+struct record {
+	uint64_t time;
+	int in;
+	int len;
+	uint8_t data[REPORT_SIZE];
+	/* where an imported transfer came from */
+	int bus, dev;
+};
+
+struct trace {
+	struct record *records;
+	int count;
+	int capacity;
+};
+
+static FILE *recording;
+
+static int add_record(struct trace *trace, uint64_t time, int in, const uint8_t *data, int len) {
+	struct record *record;
+
+	if (trace->count == trace->capacity) {
+		int capacity = trace->capacity ? trace->capacity * 2 : 1024;
+		struct record *records = realloc(trace->records, capacity * sizeof(*records));
+
+		if (!records) {
+			printf("Failed to allocate memory for the trace.\n");
+			return 1;
+		}
+		trace->records = records;
+		trace->capacity = capacity;
+	}
+
+	record = &trace->records[trace->count++];
+	memset(record, 0, sizeof(*record));
+	record->time = time;
+	record->in = in;
+	record->len = len < REPORT_SIZE ? len : REPORT_SIZE;
+	memcpy(record->data, data, record->len);
+
+	return 0;
+}
+
+/* a record is formatted whole and written at once, so recording stays cheap next to the flashing */
+static void write_record(FILE *file, uint64_t time, int in, const uint8_t *data, int len) {
+	static const char digits[] = "0123456789abcdef";
+	char line[32 + 2 * REPORT_SIZE + 1];
+	int pos = snprintf(line, sizeof(line), "%llu %c ", (unsigned long long)time, in ? '<' : '>');
+
+	/* as much as replaying reads back */
+	if (len > REPORT_SIZE)
+		len = REPORT_SIZE;
+	for (int i = 0; i < len; ++i) {
+		line[pos++] = digits[data[i] >> 4];
+		line[pos++] = digits[data[i] & 15];
+	}
+	line[pos++] = '\n';
+	fwrite(line, 1, pos, file);
+}
+
+int trace_start(const char *path) {
+	if (!(recording = fopen(path, "w"))) {
+		printf("Error creating trace file: %s\n", path);
+		return 1;
+	}
+
+	fprintf(recording, "# vibl trace 1\n");
+	return 0;
+}
+
+void trace_report(int in, const uint8_t *data, int len) {
+	if (recording && len > 0)
+		write_record(recording, pacing_now_us(), in, data, len);
+}
+
+void trace_stop(void) {
+	if (recording) {
+		fclose(recording);
+		recording = NULL;
+	}
+}
+
+static int hex_digit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* decode hex digits, stopping at anything else; returns the number of bytes */
+static int parse_hex(const char *text, uint8_t *data, int max) {
+	int len = 0;
+
+	while (len < max && hex_digit(text[0]) >= 0 && hex_digit(text[1]) >= 0) {
+		data[len++] = hex_digit(text[0]) << 4 | hex_digit(text[1]);
+		text += 2;
+	}
+
+	return len;
+}
+
+static int load_trace(const char *path, struct trace *trace) {
+	FILE *file = fopen(path, "r");
+	char line[512];
+	int number = 0;
+
+	memset(trace, 0, sizeof(*trace));
+	if (!file) {
+		printf("Error opening trace file: %s\n", path);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		unsigned long long time;
+		uint8_t data[REPORT_SIZE];
+		char dir;
+		int offset;
+
+		++number;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%llu %c %n", &time, &dir, &offset) != 2 || (dir != '<' && dir != '>')) {
+			printf("Error: bad record on line %d of %s\n", number, path);
+			goto error;
+		}
+		if (add_record(trace, time, dir == '<', data, parse_hex(line + offset, data, sizeof(data))))
+			goto error;
+	}
+
+	fclose(file);
+	return 0;
+
+error:
+	fclose(file);
+	free(trace->records);
+	return 1;
+}
+
+/* keep an imported transfer as the reports it holds, bulk transfers carry several */
+static int import_transfer(struct trace *trace, uint64_t time, int bus, int dev, int in, const uint8_t *data, int len) {
+	for (int offset = 0; offset < len; offset += REPORT_SIZE) {
+		if (add_record(trace, time, in, data + offset, len - offset))
+			return 1;
+		trace->records[trace->count - 1].bus = bus;
+		trace->records[trace->count - 1].dev = dev;
+	}
+
+	return 0;
+}
+
+/* usbmon text: tag timestamp event address [setup or status] length [= data words] */
+static int import_text(FILE *file, struct trace *trace, int *truncated) {
+	char line[1024];
+
+	while (fgets(line, sizeof(line), file)) {
+		char *words[64];
+		int count = 0, equals = -1;
+		uint8_t data[REPORT_SIZE];
+		int len = 0, length, bus = 0, dev, ep;
+		char type, dir, event;
+
+		for (char *word = strtok(line, " \n"); word && count < 64; word = strtok(NULL, " \n"))
+			words[count++] = word;
+		if (count < 5)
+			continue;
+
+		for (int i = 4; i < count && equals < 0; ++i)
+			if (strcmp(words[i], "=") == 0)
+				equals = i;
+		if (equals < 0)
+			continue;
+
+		event = words[2][0];
+		type = words[3][0];
+		dir = words[3][1];
+		/* the bus number only appears in the newer format */
+		if (sscanf(words[3] + 3, "%d:%d:%d", &bus, &dev, &ep) != 3) {
+			bus = 0;
+			if (sscanf(words[3] + 3, "%d:%d", &dev, &ep) != 2)
+				continue;
+		}
+
+		length = atoi(words[equals - 1]);
+		for (int i = equals + 1; i < count && len < REPORT_SIZE; ++i)
+			len += parse_hex(words[i], data + len, REPORT_SIZE - len);
+		if (len < length && len < REPORT_SIZE)
+			++*truncated;
+
+		if (type == 'C') {
+			/* SET_REPORT (class request 0x09 to the interface) carries an output report */
+			if (event != 'S' || dir != 'o' || strcmp(words[4], "s") != 0 || count < 7
+					|| strcmp(words[5], "21") != 0 || strcmp(words[6], "09") != 0)
+				continue;
+		} else if ((type != 'I' && type != 'B') || ep == 0 || event != (dir == 'i' ? 'C' : 'S')) {
+			continue;
+		}
+
+		if (import_transfer(trace, strtoull(words[1], NULL, 10), bus, dev, dir == 'i', data, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+static uint32_t pcap_u32(const uint8_t *buf, int swap) {
+	return swap ? (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3]
+		: buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+/* pcap of a usbmon interface: every packet is a URB header followed by the captured data */
+static int import_pcap(FILE *file, struct trace *trace, int *truncated) {
+	uint8_t header[24], record[16], packet[64 + 4096];
+	uint32_t magic;
+	int swap, header_size, nanoseconds;
+
+	if (fread(header, 1, sizeof(header), file) != sizeof(header))
+		return 1;
+
+	magic = pcap_u32(header, 0);
+	swap = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+	nanoseconds = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+	switch (pcap_u32(&header[20], swap)) {
+	case LINKTYPE_USB_LINUX:
+		header_size = 48;
+		break;
+	case LINKTYPE_USB_LINUX_MMAPPED:
+		header_size = 64;
+		break;
+	default:
+		printf("Error: the capture isn't of a usbmon interface\n");
+		return 1;
+	}
+
+	while (fread(record, 1, sizeof(record), file) == sizeof(record)) {
+		uint32_t captured = pcap_u32(&record[8], swap);
+		uint64_t time = pcap_u32(&record[0], swap) * 1000000ULL + pcap_u32(&record[4], swap) / (nanoseconds ? 1000 : 1);
+		uint8_t event, type, ep, dev;
+		uint32_t length, data_len;
+		const uint8_t *data;
+		int in;
+
+		if (captured > sizeof(packet)) {
+			if (fseek(file, captured, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+		if (fread(packet, 1, captured, file) != captured)
+			break;
+		if (captured < (uint32_t)header_size)
+			continue;
+
+		event = packet[8];
+		type = packet[9];
+		ep = packet[10];
+		dev = packet[11];
+		in = ep & 0x80;
+		length = pcap_u32(&packet[32], swap);
+		data_len = pcap_u32(&packet[36], swap);
+		data = packet + header_size;
+		if (data_len > captured - header_size)
+			data_len = captured - header_size;
+		if (data_len < length)
+			++*truncated;
+
+		if (type == 2) {
+			/* control: only SET_REPORT, its setup packet is in the header */
+			if (event != 'S' || in || packet[14] != 0 || packet[40] != 0x21 || packet[41] != 0x09)
+				continue;
+		} else if ((type != 1 && type != 3) || (ep & 0x7F) == 0 || event != (in ? 'C' : 'S')) {
+			continue;
+		}
+
+		if (import_transfer(trace, time, swap ? packet[12] << 8 | packet[13] : packet[12] | packet[13] << 8, dev,
+				in != 0, data, data_len))
+			return 1;
+	}
+
+	return 0;
+}
+
+int trace_import_usbmon(const char *capture, const char *path) {
+	FILE *file = fopen(capture, "rb");
+	FILE *out;
+	struct trace trace = {0};
+	uint8_t magic[4];
+	int truncated = 0, pcap, error, bus = -1, dev = -1, sent = 0, received = 0;
+
+	if (!file) {
+		printf("Error opening capture: %s\n", capture);
+		return 1;
+	}
+
+	/* pcap files start with a magic number in either byte order, usbmon text with a URB tag */
+	pcap = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && (pcap_u32(magic, 0) == 0xA1B2C3D4
+		|| pcap_u32(magic, 1) == 0xA1B2C3D4 || pcap_u32(magic, 0) == 0xA1B23C4D || pcap_u32(magic, 1) == 0xA1B23C4D);
+	rewind(file);
+	error = pcap ? import_pcap(file, &trace, &truncated) : import_text(file, &trace, &truncated);
+	fclose(file);
+
+	/* the bootloader is the device that gets sent the first command */
+	for (int i = 0; !error && i < trace.count && bus < 0; ++i) {
+		if (!trace.records[i].in && trace.records[i].len >= 2 && trace.records[i].data[0] == 'V' && trace.records[i].data[1] == 'C') {
+			bus = trace.records[i].bus;
+			dev = trace.records[i].dev;
+		}
+	}
+
+	if (!error && bus < 0) {
+		printf("Error: no bootloader traffic in %s\n", capture);
+		error = 1;
+	}
+
+	if (!error && !(out = fopen(path, "w"))) {
+		printf("Error creating trace file: %s\n", path);
+		error = 1;
+	}
+
+	if (!error) {
+		fprintf(out, "# vibl trace 1\n");
+		for (int i = 0; i < trace.count; ++i) {
+			const struct record *record = &trace.records[i];
+
+			if (record->bus != bus || record->dev != dev)
+				continue;
+			write_record(out, record->time, record->in, record->data, record->len);
+			if (record->in)
+				++received;
+			else
+				++sent;
+		}
+		fclose(out);
+
+		printf("Imported %d reports sent and %d received by device %d on bus %d\n", sent, received, dev, bus);
+		if (truncated)
+			printf("WARNING: %d transfers were cut short by the capture. usbmon's text interface keeps 32 bytes"
+				" of each, capture with tcpdump -i usbmonN -w for all of them.\n", truncated);
+	}
+
+	free(trace.records);
+	return error;
+}
+
+/* erase progress comes as often as the host collects it, only the final report is certain */
+static int interim_progress(const uint8_t *data, int len) {
+	return len >= 2 && data[0] == 0x02 && data[1] == 0;
+}
+
+int trace_replay(hid_device *dev, const char *path, int timed) {
+	struct trace trace;
+	uint64_t start, recorded;
+	int sent = 0, matched = 0, differed = 0, missing = 0;
+
+	if (load_trace(path, &trace))
+		return 1;
+	if (trace.count == 0) {
+		printf("Error: %s holds no reports\n", path);
+		free(trace.records);
+		return 1;
+	}
+
+	recorded = trace.records[trace.count - 1].time - trace.records[0].time;
+	start = pacing_now_us();
+
+	for (int i = 0; i < trace.count; ++i) {
+		const struct record *record = &trace.records[i];
+		uint8_t buffer[1 + REPORT_SIZE];
+		int len;
+
+		if (timed) {
+			uint64_t due = start + (record->time - trace.records[0].time);
+			uint64_t now = pacing_now_us();
+
+			if (due > now)
+				usleep(due - now);
+		}
+
+		if (!record->in) {
+			memset(buffer, 0, sizeof(buffer));
+			memcpy(&buffer[1], record->data, record->len);
+			if (!pacing_write(dev, buffer, sizeof(buffer))) {
+				printf("\nError while sending report %d, the device stopped taking them\n", sent);
+				break;
+			}
+			++sent;
+		} else if (!interim_progress(record->data, record->len)) {
+			do {
+				len = hid_read_timeout(dev, buffer, REPORT_SIZE, REPLAY_TIMEOUT_MS);
+			} while (len > 0 && interim_progress(buffer, len));
+
+			if (len <= 0)
+				++missing;
+			else if (memcmp(buffer, record->data, len < record->len ? len : record->len) != 0)
+				++differed;
+			else
+				++matched;
+		}
+
+		if (i % 64 == 0 || i == trace.count - 1)
+			printf("\r[%d/%d]", i + 1, trace.count);
+	}
+
+	printf("\nReplayed %d reports in %.2fs, recorded in %.2fs: %d answers matched, %d differed, %d missing\n",
+		sent, (pacing_now_us() - start) / 1e6, recorded / 1e6, matched, differed, missing);
+
+	free(trace.records);
+	return differed || missing;
+}
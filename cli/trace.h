@@ -0,0 +1,32 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "hidapi.h"
+
+/* Traces of the reports exchanged with the bootloader, to reproduce and compare flashing
+   sessions without the keyboard they were taken on. A trace is a text file:
+     # vibl trace 1
+     <microseconds> > <hex>    a report sent to the device
+     <microseconds> < <hex>    a report received from it
+   Timestamps count from any point, only their differences matter. */
+
+/* record every report from here on to path; returns 0 on success */
+int trace_start(const char *path);
+
+/* record a report if a trace is being recorded; in is set for reports from the device */
+void trace_report(int in, const uint8_t *data, int len);
+
+void trace_stop(void);
+
+/* convert a Linux usbmon capture of a session, text (from /sys/kernel/debug/usb/usbmon)
+   or pcap (tcpdump -i usbmonN -w), into a trace; returns 0 on success */
+int trace_import_usbmon(const char *capture, const char *path);
+
+/* send the reports of a trace to the device and check its answers against the recorded
+   ones, either as fast as it takes them or keeping the recorded gaps; returns 0 when all
+   answers matched */
+int trace_replay(hid_device *dev, const char *path, int timed);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+* Helpers shared by the flashing tool, the daemon and the mock bootloader
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <limits.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <limits.h>
+#include <mach-o/dyld.h>
+#endif
+
+#include "util.h"
+#include "sha256.h"
+
+uint32_t get_u32(const uint8_t *buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+void put_u32(uint8_t *buf, uint32_t value) {
+	buf[0] = value;
+	buf[1] = value >> 8;
+	buf[2] = value >> 16;
+	buf[3] = value >> 24;
+}
+
+int parse_hex(const char *text, uint8_t *out, size_t len) {
+	if (strlen(text) != 2 * len)
+		return 1;
+
+	for (size_t i = 0; i < len; ++i) {
+		char byte[3] = {text[2 * i], text[2 * i + 1], 0};
+		char *end;
+
+		out[i] = strtol(byte, &end, 16);
+		if (*end)
+			return 1;
+	}
+
+	return 0;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+	crc = ~crc;
+	while (size--) {
+		crc ^= *data++;
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+uint32_t crc32(const uint8_t *data, size_t size) {
+	return crc32_update(0, data, size);
+}
+
+int check_hash(const void *data, size_t size, const void *hash) {
+	uint8_t calculated[SHA256_BLOCK_SIZE];
+	SHA256_CTX ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, size);
+	sha256_final(&ctx, calculated);
+	return memcmp(calculated, hash, sizeof(calculated)) != 0;
+}
+
+const char *self_path(void) {
+#if defined(__linux__)
+	static char path[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+	if (len <= 0)
+		return NULL;
+	path[len] = 0;
+	return path;
+#elif defined(__APPLE__)
+	static char path[PATH_MAX];
+	uint32_t size = sizeof(path);
+
+	return _NSGetExecutablePath(path, &size) == 0 ? path : NULL;
+#else
+	return NULL;
+#endif
+}
@@ -0,0 +1,26 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* little-endian fields of the protocol and the package formats */
+uint32_t get_u32(const uint8_t *buf);
+void put_u32(uint8_t *buf, uint32_t value);
+
+/* CRC-32 (IEEE 802.3), matches what the bootloader computes over flash; crc is the CRC
+   of whatever came before data, 0 to start */
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size);
+uint32_t crc32(const uint8_t *data, size_t size);
+
+/* decode text, exactly 2 * len hex digits, into out; returns 0 on success */
+int parse_hex(const char *text, uint8_t *out, size_t len);
+
+/* returns 0 when the SHA-256 of data is hash */
+int check_hash(const void *data, size_t size, const void *hash);
+
+/* the path of the running executable, for starting it afresh rather than forking into a
+   copy of its state; NULL where that can't be found out */
+const char *self_path(void);
+
+#endif
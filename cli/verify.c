@@ -0,0 +1,346 @@
+/*
+* Batch validation of release packages
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* nftw */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "verify.h"
+#include "vfw.h"
+#include "patch.h"
+#include "pacing.h"
+#include "util.h"
+
+/* a package's Vial UID at [8..15] must not be all zero */
+#define UID_SIZE 8
+
+struct result {
+	char *path;
+	long size;
+	int failed;
+	char reason[160];
+};
+
+static struct {
+	struct result *results;
+	int count;
+	int capacity;
+	int next;
+	uint32_t app_size;
+#ifndef _WIN32
+	pthread_mutex_t lock;
+#endif
+} batch;
+
+static int blank_uid(const uint8_t *header) {
+	static const uint8_t blank[UID_SIZE];
+
+	return memcmp(header + 8, blank, UID_SIZE) == 0;
+}
+
+static int add_path(const char *path) {
+	if (batch.count == batch.capacity) {
+		int capacity = batch.capacity ? batch.capacity * 2 : 256;
+		struct result *results = realloc(batch.results, capacity * sizeof(*results));
+
+		if (!results)
+			return 1;
+		batch.results = results;
+		batch.capacity = capacity;
+	}
+
+	memset(&batch.results[batch.count], 0, sizeof(*batch.results));
+	if (!(batch.results[batch.count].path = strdup(path)))
+		return 1;
+	++batch.count;
+
+	return 0;
+}
+
+/* check a patch package; returns 0 when it is fine, with the problem in reason otherwise */
+static int check_patch(const uint8_t *file, size_t size, uint32_t app_size, char *reason, size_t len) {
+	if (size < PATCH_HEADER_SIZE) {
+		snprintf(reason, len, "patch is truncated");
+	} else if (check_hash(file + PATCH_HEADER_SIZE, size - PATCH_HEADER_SIZE, file + 32)) {
+		snprintf(reason, len, "patch doesn't pass hash check");
+	} else if (get_u32(&file[20]) > app_size) {
+		snprintf(reason, len, "patched firmware is %u bytes but only %u fit", get_u32(&file[20]), app_size);
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* check a chunked package; returns 0 when it is fine, with the problem in reason otherwise */
+static int check_vfw2(const uint8_t *file, size_t size, uint32_t app_size, char *reason, size_t len) {
+	struct vfw2_reader reader;
+	const struct vfw2_chunk *chunk;
+	const uint8_t *data;
+	int res = -1;
+
+	if (size == VFW2_HEADER_SIZE) {
+		snprintf(reason, len, "package has no chunk table");
+		return 1;
+	}
+
+	/* go through the same reader flashing uses, over the mapped file */
+	if (vfw2_open_memory(&reader, file, size)) {
+		snprintf(reason, len, "%s", reader.error);
+		return 1;
+	}
+
+	if (vfw2_image_size(&reader) > app_size) {
+		snprintf(reason, len, "firmware is %u bytes but only %u fit", vfw2_image_size(&reader), app_size);
+	} else {
+		while ((res = vfw2_next(&reader, &chunk, &data)) > 0) {
+			if (chunk->encoding != VFW2_DELTA)
+				continue;
+			if (memcmp(data, "VIALPT00", 8) != 0) {
+				snprintf(reason, len, "chunk %u isn't a patch", reader.next - 1);
+				res = -1;
+				break;
+			}
+			if (check_patch(data, chunk->stored, app_size, reason, len)) {
+				res = -1;
+				break;
+			}
+		}
+		if (res < 0 && reader.error[0]) {
+			snprintf(reason, len, "%s", reader.error);
+		} else if (res == 0 && reader.consumed != size - VFW2_HEADER_SIZE) {
+			snprintf(reason, len, "data after the last chunk");
+			res = -1;
+		}
+	}
+
+	vfw2_close(&reader);
+	return res != 0;
+}
+
+/* check a package of any kind; returns 0 when it is fine */
+static int check_package(const uint8_t *file, size_t size, uint32_t app_size, char *reason, size_t len) {
+	if (size < 64) {
+		snprintf(reason, len, "too small to be a package");
+		return 1;
+	}
+
+	if (memcmp(file, "VIALPT00", 8) == 0)
+		return check_patch(file, size, app_size, reason, len);
+
+	if (memcmp(file, "VIALFW00", 8) != 0 && memcmp(file, "VIALFW01", 8) != 0 && memcmp(file, VFW2_MAGIC, 8) != 0) {
+		snprintf(reason, len, "not a Vial firmware package");
+		return 1;
+	}
+
+	if (blank_uid(file)) {
+		snprintf(reason, len, "blank Vial UID");
+		return 1;
+	}
+
+	if (memcmp(file, VFW2_MAGIC, 8) == 0)
+		return check_vfw2(file, size, app_size, reason, len);
+
+	if (size == 64) {
+		snprintf(reason, len, "package holds no firmware");
+	} else if (size - 64 > app_size) {
+		snprintf(reason, len, "firmware is %lu bytes but only %u fit", (unsigned long) (size - 64), app_size);
+	} else if (check_hash(file + 64, size - 64, file + 32)) {
+		snprintf(reason, len, "firmware doesn't pass hash check");
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+#ifndef _WIN32
+static void check_file(struct result *result) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(result->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		snprintf(result->reason, sizeof(result->reason), "can't open");
+		result->failed = 1;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+	result->size = st.st_size;
+
+	if (st.st_size == 0) {
+		snprintf(result->reason, sizeof(result->reason), "empty file");
+		result->failed = 1;
+	} else if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		snprintf(result->reason, sizeof(result->reason), "can't map");
+		result->failed = 1;
+	} else {
+		/* packages are hashed front to back, let the kernel read ahead */
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		result->failed = check_package(map, st.st_size, batch.app_size, result->reason, sizeof(result->reason));
+		munmap(map, st.st_size);
+	}
+
+	close(fd);
+}
+
+static void *worker(void *arg) {
+	(void) arg;
+
+	for (;;) {
+		int i;
+
+		pthread_mutex_lock(&batch.lock);
+		i = batch.next++;
+		pthread_mutex_unlock(&batch.lock);
+
+		if (i >= batch.count)
+			return NULL;
+		check_file(&batch.results[i]);
+	}
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+	size_t len = strlen(path);
+
+	(void) st;
+	(void) ftw;
+
+	if (type == FTW_F && len > 4 && strcasecmp(path + len - 4, ".vfw") == 0)
+		return add_path(path);
+
+	return 0;
+}
+#else
+/* no mmap here, read the whole file */
+static void check_file(struct result *result) {
+	FILE *file = fopen(result->path, "rb");
+	uint8_t *buffer = NULL;
+
+	if (file) {
+		fseek(file, 0, SEEK_END);
+		result->size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+	}
+
+	if (!file || result->size <= 0 || !(buffer = malloc(result->size)) || fread(buffer, 1, result->size, file) != (size_t) result->size) {
+		snprintf(result->reason, sizeof(result->reason), "can't read");
+		result->failed = 1;
+	} else {
+		result->failed = check_package(buffer, result->size, batch.app_size, result->reason, sizeof(result->reason));
+	}
+
+	free(buffer);
+	if (file)
+		fclose(file);
+}
+#endif
+
+int verify_package(const uint8_t *file, size_t size, uint32_t app_size, char *reason, size_t len) {
+	return check_package(file, size, app_size, reason, len);
+}
+
+int verify_packages(char **paths, int count, uint32_t app_size, int jobs) {
+	uint64_t start = pacing_now_us();
+	double seconds, megabytes = 0;
+	int failed = 0;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.app_size = app_size;
+
+	for (int i = 0; i < count; ++i) {
+		struct stat st;
+
+		if (stat(paths[i], &st) != 0) {
+			printf("Error: can't find %s\n", paths[i]);
+			return -1;
+		}
+#ifndef _WIN32
+		if (S_ISDIR(st.st_mode)) {
+			if (nftw(paths[i], visit, 32, FTW_PHYS) != 0) {
+				printf("Error while searching %s\n", paths[i]);
+				return -1;
+			}
+			continue;
+		}
+#endif
+		if (add_path(paths[i])) {
+			printf("Failed to allocate memory for the file list.\n");
+			return -1;
+		}
+	}
+
+#ifndef _WIN32
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (jobs > batch.count)
+		jobs = batch.count;
+	if (jobs < 1)
+		jobs = 1;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	{
+		pthread_t threads[jobs];
+		int started = 0;
+
+		while (started < jobs && pthread_create(&threads[started], NULL, worker, NULL) == 0)
+			++started;
+		/* whatever threads couldn't be started, this one makes up for */
+		if (started < jobs)
+			worker(NULL);
+		for (int i = 0; i < started; ++i)
+			pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&batch.lock);
+#else
+	jobs = 1;
+	for (int i = 0; i < batch.count; ++i)
+		check_file(&batch.results[i]);
+#endif
+
+	for (int i = 0; i < batch.count; ++i) {
+		struct result *result = &batch.results[i];
+
+		megabytes += result->size / 1e6;
+		if (result->failed) {
+			printf("FAIL %s: %s\n", result->path, result->reason);
+			++failed;
+		}
+		free(result->path);
+	}
+	free(batch.results);
+
+	seconds = (pacing_now_us() - start) / 1e6;
+	printf("Checked %d packages (%.1f MB) in %.2fs on %d threads: %d ok, %d failed\n",
+		batch.count, megabytes, seconds, jobs, batch.count - failed, failed);
+
+	return failed;
+}
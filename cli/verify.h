@@ -0,0 +1,21 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Batch validation of release packages: .vfw in all versions and VIALPT00 patches are
+   checked the way vibl-flash checks them before flashing (header magic, a Vial UID that
+   isn't blank, SHA-256 hashes, chunk layout) and against the application area of the
+   target, without a keyboard attached. Directories are searched for .vfw files, files
+   that are named directly are checked whatever their name. */
+
+/* check everything under paths on jobs threads (0 for one per core), printing the
+   packages that fail and a summary; returns the number that failed, -1 on error */
+int verify_packages(char **paths, int count, uint32_t app_size, int jobs);
+
+/* check one package already in memory; returns 0 when it is fine, with the problem in
+   reason otherwise */
+int verify_package(const uint8_t *file, size_t size, uint32_t app_size, char *reason, size_t len);
+
+#endif
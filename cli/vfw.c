@@ -0,0 +1,194 @@
+/*
+* Streaming reader for version 2 .vfw packages
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vfw.h"
+#include "patch.h"
+#include "util.h"
+
+/* more chunks than this would not fit any flash anyway */
+#define MAX_CHUNKS 4096
+
+/* the largest erase page of supported parts; a patch leaves the rest of its last one erased */
+#define MAX_ERASE_PAGE 2048
+
+static void fail(struct vfw2_reader *reader, const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(reader->error, sizeof(reader->error), format, args);
+	va_end(args);
+}
+
+static int check_chunk(struct vfw2_reader *reader, const struct vfw2_chunk *chunk, uint32_t index, uint32_t end) {
+	if (chunk->offset % 64 || chunk->offset < end || chunk->offset + (uint64_t)chunk->length > UINT32_MAX) {
+		fail(reader, "Error: chunk %u is misplaced", index);
+		return 1;
+	}
+
+	switch (chunk->encoding) {
+	case VFW2_RAW:
+		if (chunk->stored == chunk->length)
+			return 0;
+		break;
+	case VFW2_ERASED:
+		if (chunk->stored == 0)
+			return 0;
+		break;
+	case VFW2_DELTA:
+		/* a patch rebuilds the image from the start, based on what is in flash before anything else is written */
+		if (index == 0 && chunk->offset == 0 && chunk->stored > PATCH_HEADER_SIZE)
+			return 0;
+		break;
+	default:
+		fail(reader, "Error: chunk %u uses unsupported encoding %d", index, chunk->encoding);
+		return 1;
+	}
+
+	fail(reader, "Error: chunk %u is malformed", index);
+	return 1;
+}
+
+/* the next size bytes of the package, NULL when it ends first. From a file they are read
+   into buffer, from memory they are used where they are */
+static const uint8_t *take(struct vfw2_reader *reader, uint8_t *buffer, size_t size) {
+	const uint8_t *data = buffer;
+
+	if (reader->memory) {
+		if (size > reader->memory_size - reader->consumed)
+			return NULL;
+		data = reader->memory + reader->consumed;
+	} else if (fread(buffer, 1, size, reader->file) != size) {
+		return NULL;
+	}
+
+	reader->consumed += size;
+	return data;
+}
+
+/* read the chunk table, once the reader knows where the package comes from */
+static int open_table(struct vfw2_reader *reader, const uint8_t *header) {
+	uint8_t *table = NULL;
+	const uint8_t *entries;
+	uint32_t end = 0;
+
+	memcpy(reader->header, header, VFW2_HEADER_SIZE);
+	reader->count = get_u32(&header[16]);
+
+	if (reader->count == 0 || reader->count > MAX_CHUNKS) {
+		fail(reader, "Error: package has %u chunks", reader->count);
+		return 1;
+	}
+
+	if (!(table = malloc((size_t)reader->count * VFW2_ENTRY_SIZE))
+			|| !(reader->chunks = calloc(reader->count, sizeof(*reader->chunks)))) {
+		fail(reader, "Failed to allocate memory for the chunk table.");
+		goto error;
+	}
+
+	/* the table is hashed as a whole, so it can be trusted before any chunk is read */
+	if (!(entries = take(reader, table, (size_t)reader->count * VFW2_ENTRY_SIZE))
+			|| check_hash(entries, (size_t)reader->count * VFW2_ENTRY_SIZE, &reader->header[32])) {
+		fail(reader, "Chunk table doesn't pass hash check. The file is corrupt.");
+		goto error;
+	}
+
+	for (uint32_t i = 0; i < reader->count; ++i) {
+		struct vfw2_chunk *chunk = &reader->chunks[i];
+		const uint8_t *entry = entries + (size_t)i * VFW2_ENTRY_SIZE;
+
+		chunk->offset = get_u32(&entry[0]);
+		chunk->length = get_u32(&entry[4]);
+		chunk->stored = get_u32(&entry[8]);
+		chunk->encoding = entry[12];
+		memcpy(chunk->hash, &entry[16], sizeof(chunk->hash));
+
+		if (check_chunk(reader, chunk, i, end))
+			goto error;
+		end = chunk->offset + chunk->length;
+		if (chunk->encoding == VFW2_DELTA)
+			end = (end + MAX_ERASE_PAGE - 1) / MAX_ERASE_PAGE * MAX_ERASE_PAGE;
+	}
+
+	free(table);
+	return 0;
+
+error:
+	free(table);
+	vfw2_close(reader);
+	return 1;
+}
+
+int vfw2_open(struct vfw2_reader *reader, FILE *file, const uint8_t *header) {
+	memset(reader, 0, sizeof(*reader));
+	reader->file = file;
+	return open_table(reader, header);
+}
+
+int vfw2_open_memory(struct vfw2_reader *reader, const uint8_t *package, size_t size) {
+	memset(reader, 0, sizeof(*reader));
+	if (size < VFW2_HEADER_SIZE) {
+		fail(reader, "Error: package is truncated");
+		return 1;
+	}
+	reader->memory = package + VFW2_HEADER_SIZE;
+	reader->memory_size = size - VFW2_HEADER_SIZE;
+	return open_table(reader, package);
+}
+
+int vfw2_next(struct vfw2_reader *reader, const struct vfw2_chunk **chunk, const uint8_t **data) {
+	const struct vfw2_chunk *next;
+	const uint8_t *taken;
+
+	if (reader->next == reader->count)
+		return 0;
+	next = &reader->chunks[reader->next];
+
+	if (!reader->memory) {
+		free(reader->data);
+		if (!(reader->data = malloc(next->stored ? next->stored : 1))) {
+			fail(reader, "Failed to allocate memory for chunk %u.", reader->next);
+			return -1;
+		}
+	}
+
+	if (!(taken = take(reader, reader->data, next->stored)) || (!reader->checked && check_hash(taken, next->stored, next->hash))) {
+		fail(reader, "Chunk %u doesn't pass hash check. The file is corrupt.", reader->next);
+		return -1;
+	}
+
+	++reader->next;
+	*chunk = next;
+	*data = taken;
+	return 1;
+}
+
+uint32_t vfw2_image_size(const struct vfw2_reader *reader) {
+	const struct vfw2_chunk *last = &reader->chunks[reader->count - 1];
+
+	return last->offset + last->length;
+}
+
+void vfw2_close(struct vfw2_reader *reader) {
+	free(reader->chunks);
+	free(reader->data);
+	reader->chunks = NULL;
+	reader->data = NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef VFW_H
+#define VFW_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Version 2 of the .vfw package, made of independently hashed chunks so that it can be
+   checked and flashed while it is being read, and so that it can describe sparse images.
+
+   Header, 64 bytes:
+     [0..7]   "VIALFW02"
+     [8..15]  Vial keyboard UID
+     [16..19] number of chunks
+     [20..31] reserved, zero
+     [32..63] SHA-256 of the chunk table
+   Chunk table, 48 bytes per chunk, sorted by offset and not overlapping:
+     [0..3]   offset of the chunk in the image, a multiple of 64
+     [4..7]   length of the chunk in the image
+     [8..11]  size of the chunk's data in the package
+     [12]     encoding, one of VFW2_*
+     [13..15] reserved, zero
+     [16..47] SHA-256 of the chunk's data
+   The data of every chunk follows the table, in table order.
+
+   Parts of an erase page that no chunk covers are written erased, erase pages that no
+   chunk touches are left alone. */
+#define VFW2_MAGIC "VIALFW02"
+#define VFW2_HEADER_SIZE 64
+#define VFW2_ENTRY_SIZE 48
+
+enum {
+	VFW2_RAW = 0,        /* data is the chunk as is */
+	VFW2_COMPRESSED = 1, /* reserved, not supported yet */
+	VFW2_ERASED = 2,     /* no data, the chunk is all 0xFF */
+	VFW2_DELTA = 3,      /* data is a VIALPT00 patch package; only as the first chunk, at offset 0,
+	                        and the next chunk has to start in a later 2K page */
+};
+
+struct vfw2_chunk {
+	uint32_t offset;
+	uint32_t length;
+	uint32_t stored;
+	uint8_t encoding;
+	uint8_t hash[32];
+};
+
+struct vfw2_reader {
+	FILE *file;
+	const uint8_t *memory; /* the package after its header, when it is read from memory */
+	size_t memory_size;
+	size_t consumed;       /* bytes taken after the header so far */
+	uint8_t header[VFW2_HEADER_SIZE];
+	uint32_t count;
+	uint32_t next;
+	struct vfw2_chunk *chunks;
+	uint8_t *data;
+	int checked;           /* the package was checked as a whole already, chunks aren't hashed again */
+	char error[128];
+};
+
+/* read and check the chunk table of a package whose header has already been read from file;
+   returns 0 on success, with what is wrong in reader->error otherwise */
+int vfw2_open(struct vfw2_reader *reader, FILE *file, const uint8_t *header);
+
+/* the same for a whole package of size bytes in memory, which has to outlive the reader;
+   chunk data then points into it rather than being copied */
+int vfw2_open_memory(struct vfw2_reader *reader, const uint8_t *package, size_t size);
+
+/* read the data of the next chunk and check its hash; returns 1 with chunk and data set,
+   0 after the last chunk, -1 on error, explained in reader->error. data stays valid until
+   the next call */
+int vfw2_next(struct vfw2_reader *reader, const struct vfw2_chunk **chunk, const uint8_t **data);
+
+/* size of the image the package describes: the end of its last chunk */
+uint32_t vfw2_image_size(const struct vfw2_reader *reader);
+
+void vfw2_close(struct vfw2_reader *reader);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+* Vial firmware side of an update: reaching the bootloader and waiting for the firmware
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "vial.h"
+#include "pacing.h"
+
+/* the raw HID interface of QMK, and the serial number Vial firmware marks itself with */
+#define RAW_USAGE_PAGE 0xFF60
+#define RAW_USAGE 0x61
+#define VIAL_SERIAL L"vial:f64c2b3c"
+#define RAW_REPORT_SIZE 32
+
+#define VIA_BOOTLOADER_JUMP 0x0B
+#define VIAL_PREFIX 0xFE
+#define VIAL_GET_KEYBOARD_ID 0x00
+#define VIAL_GET_UNLOCK_STATUS 0x05
+#define VIAL_UNLOCK_START 0x06
+#define VIAL_UNLOCK_POLL 0x07
+
+#define REPLY_TIMEOUT_MS 500
+#define UNLOCK_POLL_US 100000
+#define UNLOCK_TIMEOUT_US 60000000
+#define POLL_US 20000
+
+/* send a Vial command and read its answer into reply; returns 0 on success */
+static int vial_command(hid_device *dev, uint8_t cmd, uint8_t *reply) {
+	uint8_t buffer[1 + RAW_REPORT_SIZE];
+
+	memset(buffer, 0, sizeof(buffer));
+	buffer[1] = VIAL_PREFIX;
+	buffer[2] = cmd;
+	if (hid_write(dev, buffer, sizeof(buffer)) < 0)
+		return 1;
+
+	return hid_read_timeout(dev, reply, RAW_REPORT_SIZE, REPLY_TIMEOUT_MS) <= 0;
+}
+
+hid_device *vial_open_keyboard(const uint8_t *uid) {
+	struct hid_device_info *devs = hid_enumerate(0, 0);
+	hid_device *found = NULL;
+
+	for (struct hid_device_info *dev = devs; dev && !found; dev = dev->next) {
+		uint8_t reply[RAW_REPORT_SIZE];
+
+		if (dev->usage_page != RAW_USAGE_PAGE || dev->usage != RAW_USAGE
+				|| !dev->serial_number || !wcsstr(dev->serial_number, VIAL_SERIAL))
+			continue;
+
+		/* a keyboard that was just plugged in may not be ready to talk yet */
+		if (!(found = hid_open_path(dev->path)))
+			continue;
+
+		/* the answer is the protocol version followed by the keyboard's UID */
+		if (vial_command(found, VIAL_GET_KEYBOARD_ID, reply) || (uid && memcmp(&reply[4], uid, 8) != 0)) {
+			hid_close(found);
+			found = NULL;
+		}
+	}
+
+	hid_free_enumeration(devs);
+	return found;
+}
+
+/* wait for the user to hold the unlock keys; returns 0 once the keyboard is unlocked */
+static int unlock(hid_device *dev, const uint8_t *status) {
+	uint64_t start = pacing_now_us();
+	uint8_t reply[RAW_REPORT_SIZE];
+
+	/* the status lists the keys to hold as row, column pairs */
+	printf("The keyboard is locked. Hold down the unlock keys to let it be updated:");
+	for (int i = 2; i + 1 < RAW_REPORT_SIZE && status[i] != 0xFF; i += 2)
+		printf(" (row %d, col %d)", status[i], status[i + 1]);
+	printf("\n");
+
+	if (vial_command(dev, VIAL_UNLOCK_START, reply))
+		return 1;
+
+	while (pacing_now_us() - start < UNLOCK_TIMEOUT_US) {
+		usleep(UNLOCK_POLL_US);
+		if (vial_command(dev, VIAL_UNLOCK_POLL, reply))
+			return 1;
+		if (reply[0]) {
+			printf("\rUnlocked           \n");
+			return 0;
+		}
+		if (!reply[1])
+			break;
+		printf("\rKeep holding... %d ", reply[2]);
+	}
+
+	printf("\nThe keyboard wasn't unlocked\n");
+	return 1;
+}
+
+int vial_enter_bootloader(hid_device *dev) {
+	uint8_t status[RAW_REPORT_SIZE];
+	uint8_t buffer[1 + RAW_REPORT_SIZE];
+
+	if (vial_command(dev, VIAL_GET_UNLOCK_STATUS, status)) {
+		printf("Error: the keyboard doesn't answer\n");
+		return 1;
+	}
+
+	/* Vial firmware only jumps to the bootloader once it is unlocked */
+	if (!status[0] && unlock(dev, status))
+		return 1;
+
+	/* the keyboard resets rather than answer */
+	memset(buffer, 0, sizeof(buffer));
+	buffer[1] = VIA_BOOTLOADER_JUMP;
+	if (hid_write(dev, buffer, sizeof(buffer)) < 0) {
+		printf("Error: the keyboard didn't take the bootloader request\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int vial_wait_keyboard(const uint8_t *uid, int timeout_ms) {
+	uint64_t start = pacing_now_us();
+
+	do {
+		hid_device *dev = vial_open_keyboard(uid);
+
+		if (dev) {
+			hid_close(dev);
+			return 0;
+		}
+		usleep(POLL_US);
+	} while (pacing_now_us() - start < timeout_ms * 1000ULL);
+
+	return 1;
+}
@@ -0,0 +1,23 @@
+#ifndef VIAL_H
+#define VIAL_H
+
+#include <stdint.h>
+
+#include "hidapi.h"
+
+/* Talking to a keyboard that runs Vial firmware, over its raw HID interface, to send it
+   to the bootloader before an update and to see it come back afterwards. */
+
+/* open the keyboard with this Vial UID, any Vial keyboard when uid is NULL; returns NULL
+   when there is none attached */
+hid_device *vial_open_keyboard(const uint8_t *uid);
+
+/* have the keyboard jump to its bootloader, walking the user through unlocking it first
+   if it asks for that; returns 0 once the request is sent */
+int vial_enter_bootloader(hid_device *dev);
+
+/* wait up to timeout_ms for the keyboard to be back running Vial firmware; returns 0 once
+   it answers */
+int vial_wait_keyboard(const uint8_t *uid, int timeout_ms);
+
+#endif